@@ -17,10 +17,12 @@ auto lowercase(const std::basic_string<T>& s) {
 /**
  * \brief Queries all OpenCL devices and returns them in a vector
  * \param devices list of devices to query
+ * \param precision precision of the computation, devices without double precision are only used with fp32 kernel
  * \param useLog if true, logs the devices which will be used
  * \return list of found OpenCL devices
  */
-inline auto queryClDevices(const std::vector<std::string>& devices, bool useLog = true) {
+inline auto queryClDevices(const std::vector<std::string>& devices, const ClPrecision precision,
+                           bool useLog = true) {
 	if (useLog) {
 		log(DEBUG, "Querying OpenCL devices...");
 	}
@@ -49,15 +51,13 @@ inline auto queryClDevices(const std::vector<std::string>& devices, bool useLog
 
 		// Iterate over platform devices and find those that match the filter if it is specified
 		for (const auto& device : platformDevices) {
-			const auto deviceExtensions = lowercase(device.getInfo<CL_DEVICE_EXTENSIONS>());
 			const auto deviceName = std::string(device.getInfo<CL_DEVICE_NAME>());
 
-			// Skip if we cant find double precision extension
-			if (!deviceExtensions.find(DOUBLE_PRECISION_DEFAULT) && !deviceExtensions.find(
-				DOUBLE_PRECISION_AMD)) {
+			// Skip if we cant find double precision extension, unless the device can use the fp32 kernel
+			if (precision == ClPrecision::FP64 && !clDeviceSupportsFp64(device)) {
 				if (useLog) {
 					log(INFO, "Skipping OpenCL device \"" + deviceName +
-					    "\" because it doesn't support double precision");
+					    "\" because it doesn't support double precision (see --cl_precision)");
 				}
 				continue;
 			}
@@ -107,6 +107,32 @@ inline auto queryClDevices(const std::vector<std::string>& devices, bool useLog
 	return result;
 }
 
+/**
+ * \brief Parses byte range in format start:end, where end can be omitted
+ * \param range range string
+ * \return pair of start and end (exclusive) byte
+ */
+inline std::pair<size_t, size_t> parseByteRange(const std::string& range) {
+	const auto separatorIdx = range.find(':');
+	if (separatorIdx == std::string::npos) {
+		throw std::runtime_error("Byte range must be in format start:end");
+	}
+
+	try {
+		const auto start = std::stoull(range.substr(0, separatorIdx));
+		const auto endStr = range.substr(separatorIdx + 1);
+		const auto end = endStr.empty() ? SIZE_MAX : static_cast<size_t>(std::stoull(endStr));
+		if (start >= end) {
+			throw std::runtime_error("Byte range start must be lower than its end");
+		}
+
+		return {static_cast<size_t>(start), end};
+	}
+	catch (const std::logic_error&) {
+		throw std::runtime_error("Could not parse byte range " + range);
+	}
+}
+
 ProcessingConfig ArgumentParser::processArgs(const int argc, char** argv) const {
 	// For argument parsing we use cxxopts
 	auto options = cxxopts::Options("PPR Distribution Estimator",
@@ -124,6 +150,29 @@ ProcessingConfig ArgumentParser::processArgs(const int argc, char** argv) const
 		("o, output_file", "Path to the output file if any", cxxopts::value<std::filesystem::path>())
 		("disable_avx2", "Disables AVX2 vectorized instructions")
 		("t,watchdog_timeout", "Timeout for watchdog in seconds", cxxopts::value<size_t>()->default_value("5"))
+		("c,columns", "Number of interleaved double columns in each record (SMP only if more than 1)",
+		 cxxopts::value<size_t>()->default_value("1"))
+		("k,key_file", "Path to the file with uint32 key for each value, statistics are computed for each key (SMP only)",
+		 cxxopts::value<std::string>())
+		("cpu_queue_depth", "Maximum number of jobs queued for SMP at once",
+		 cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_CPU_QUEUE_DEPTH)))
+		("cl_queue_depth", "Maximum number of jobs queued for each OpenCL device at once",
+		 cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_CL_QUEUE_DEPTH)))
+		("cpu_nodes", "Number of SMP coordinators, each with its own threads bound to a NUMA node (0 means one per NUMA node)",
+		 cxxopts::value<size_t>()->default_value("0"))
+		("stall_timeout", "Time in seconds without progress after which the job of a device is re-issued to another device and the device is not used anymore (0 disables)",
+		 cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_STALL_TIMEOUT / 1000)))
+		("range", "Byte range of the file to process as start:end, end can be omitted to process the rest of the file",
+		 cxxopts::value<std::string>())
+		("serve", "Runs as a server on given Unix domain socket, the devices are set up once for all requests",
+		 cxxopts::value<std::string>())
+		("connect", "Processes the file on the server listening on given Unix domain socket",
+		 cxxopts::value<std::string>())
+		("batch", "Treats the file as a list of files (one path per line) and processes all of them in one process")
+		("cl_precision", "Precision on OpenCL devices: fp64, fp32_fallback (fp32 kernel on devices without double precision) or fp32 (fp32 kernel everywhere)",
+		 cxxopts::value<std::string>()->default_value("fp64"))
+		("cl_jobs_per_device", "Number of jobs processed concurrently on each OpenCL device, each with its own command queues and buffers",
+		 cxxopts::value<size_t>()->default_value(std::to_string(DEFAULT_CL_JOBS_PER_DEVICE)))
 		("h,help", "Print help");
 
 	options.parse_positional({"file", "mode", "devices"});
@@ -145,9 +194,10 @@ ProcessingConfig ArgumentParser::processArgs(const int argc, char** argv) const
 
 	if (result.count("list_cl_devices")) {
 		std::cout << "Available OpenCL devices: " << "\n";
-		const auto clDevices = queryClDevices({}, false);
+		const auto clDevices = queryClDevices({}, ClPrecision::FP32_FALLBACK, false);
 		for (const auto& clDevice : clDevices) {
-			std::cout << "  -\t" << "\"" << clDevice.getInfo<CL_DEVICE_NAME>() << "\"" << std::endl;
+			std::cout << "  -\t" << "\"" << clDevice.getInfo<CL_DEVICE_NAME>() << "\""
+				<< (clDeviceSupportsFp64(clDevice) ? "" : " (fp32 kernel only)") << std::endl;
 
 		}
 		exit(0); // NOLINT(concurrency-mt-unsafe)
@@ -180,6 +230,35 @@ ProcessingConfig ArgumentParser::validateArgs(const cxxopts::ParseResult& args)
 		throw std::runtime_error("File path " + filePath.string() + " does not exist.");
 	}
 
+	const auto byteRange = args.count("range") > 0
+		                       ? parseByteRange(args["range"].as<std::string>())
+		                       : std::pair<size_t, size_t>{0, SIZE_MAX};
+
+	// Client only sends the request, everything else is configured by the server. Paths are made absolute since the
+	// server may run in another working directory
+	if (args.count("connect") > 0) {
+		auto clientConfig = ProcessingConfig{};
+		clientConfig.DistFilePath = fs::absolute(filePath);
+		clientConfig.KeyFilePath = args.count("key_file") > 0
+			                           ? fs::absolute(fs::path{args["key_file"].as<std::string>()})
+			                           : fs::path{};
+		clientConfig.OutputPath = args.count("output_file") > 0
+			                          ? args["output_file"].as<std::filesystem::path>()
+			                          : fs::path{};
+		clientConfig.ByteRange = byteRange;
+		clientConfig.ConnectSocketPath = args["connect"].as<std::string>();
+		return clientConfig;
+	}
+
+	const auto serverSocketPath = args.count("serve") > 0 ? fs::path{args["serve"].as<std::string>()} : fs::path{};
+
+	// Each file of the batch is processed whole, small files share runs with each other
+	const auto isBatch = args.count("batch") > 0;
+	if (isBatch && (args.count("key_file") > 0 || args.count("range") > 0 || args.count("benchmark") > 0 ||
+		args.count("serve") > 0)) {
+		throw std::runtime_error("Batch mode cannot be combined with key file, byte range, benchmark or server");
+	}
+
 	// Check processing mode
 	if (args.count("mode") < 1 && args.count("devices") < 1) {
 		throw std::runtime_error("Processing mode not specified");
@@ -229,6 +308,76 @@ ProcessingConfig ArgumentParser::validateArgs(const cxxopts::ParseResult& args)
 		log(WARNING, "Detected watchdog timeout over 60s: " + std::to_string(watchdogTimeout / 1000) + "s");
 	}
 
+	// Stalls are only detected when the watchdog checks the progress, therefore shorter timeout is not precise
+	const auto stallTimeout = args.count("stall_timeout") > 0
+		                          ? args["stall_timeout"].as<size_t>() * 1000
+		                          : DEFAULT_STALL_TIMEOUT;
+	if (stallTimeout > 0 && stallTimeout < watchdogTimeout) {
+		log(WARNING, "Stall timeout is shorter than the watchdog timeout, stalls are only detected every " +
+		    std::to_string(watchdogTimeout / 1000) + "s");
+	}
+
+	const auto nColumns = args.count("columns") > 0 ? args["columns"].as<size_t>() : 1;
+	if (nColumns == 0) {
+		throw std::runtime_error("Number of columns must be at least 1");
+	}
+
+	if (nColumns > 1 && processingMode == ProcessingMode::OPENCL_DEVICES) {
+		throw std::runtime_error("Multi-column files can only be processed on SMP, use smp or all mode");
+	}
+
+	// Key file must contain one uint32 key for each double in the value file
+	const auto keyFilePath = args.count("key_file") > 0 ? fs::path{args["key_file"].as<std::string>()} : fs::path{};
+	if (!keyFilePath.empty()) {
+		if (!fs::exists(keyFilePath)) {
+			throw std::runtime_error("Key file path " + keyFilePath.string() + " does not exist.");
+		}
+
+		if (fs::file_size(keyFilePath) * (sizeof(double) / sizeof(uint32_t)) != fs::file_size(filePath)) {
+			throw std::runtime_error("Key file must contain exactly one uint32 key for each value");
+		}
+
+		if (nColumns > 1) {
+			throw std::runtime_error("Grouping by key is not supported for multi-column files");
+		}
+
+		if (processingMode == ProcessingMode::OPENCL_DEVICES) {
+			throw std::runtime_error("Grouping by key can only be processed on SMP, use smp or all mode");
+		}
+	}
+
+	const auto cpuQueueDepth = args.count("cpu_queue_depth") > 0
+		                           ? args["cpu_queue_depth"].as<size_t>()
+		                           : DEFAULT_CPU_QUEUE_DEPTH;
+	const auto clQueueDepth = args.count("cl_queue_depth") > 0
+		                          ? args["cl_queue_depth"].as<size_t>()
+		                          : DEFAULT_CL_QUEUE_DEPTH;
+	if (cpuQueueDepth == 0 || clQueueDepth == 0) {
+		throw std::runtime_error("Queue depth must be at least 1");
+	}
+
+	// Single thread mode only has a single thread, therefore there is nothing to partition
+	const auto nCpuNodes = processingMode == ProcessingMode::SINGLE_THREAD
+		                       ? 1
+		                       : args.count("cpu_nodes") > 0
+		                       ? args["cpu_nodes"].as<size_t>()
+		                       : 0;
+
+	const auto clPrecisionArg = args.count("cl_precision") > 0
+		                            ? lowercase(args["cl_precision"].as<std::string>())
+		                            : std::string("fp64");
+	if (CL_PRECISIONS_LUT.find(clPrecisionArg) == CL_PRECISIONS_LUT.end()) {
+		throw std::runtime_error("Unknown OpenCL precision " + clPrecisionArg + ", use fp64, fp32_fallback or fp32");
+	}
+	const auto clPrecision = CL_PRECISIONS_LUT.at(clPrecisionArg);
+
+	const auto clJobsPerDevice = args.count("cl_jobs_per_device") > 0
+		                             ? args["cl_jobs_per_device"].as<size_t>()
+		                             : DEFAULT_CL_JOBS_PER_DEVICE;
+	if (clJobsPerDevice == 0) {
+		throw std::runtime_error("Number of jobs per OpenCL device must be at least 1");
+	}
+
 	if (processingMode == ProcessingMode::SMP || processingMode == ProcessingMode::SINGLE_THREAD) {
 		return {
 			processingMode,
@@ -240,22 +389,51 @@ ProcessingConfig ArgumentParser::validateArgs(const cxxopts::ParseResult& args)
 			outputPath,
 			useAvx2,
 			watchdogTimeout,
+			nColumns,
+			keyFilePath,
+			cpuQueueDepth,
+			clQueueDepth,
+			nCpuNodes,
+			stallTimeout,
+			byteRange,
+			serverSocketPath,
+			{},
+			isBatch,
+			clPrecision,
+			clJobsPerDevice,
 		};
 	}
 
 	// Otherwise we have OpenCL devices or ALL mode
 	// Query all OpenCL devices and filter them if necessary
 	if (processingMode == ProcessingMode::ALL) {
+		const auto smpOnly = nColumns > 1 || !keyFilePath.empty();
+		if (smpOnly) {
+			log(WARNING, "Multi-column files and grouping by key can only be processed on SMP, OpenCL devices will not be used");
+		}
+
 		return {
 			processingMode,
 			filePath,
-			queryClDevices({}),
+			smpOnly ? std::vector<cl::Device>() : queryClDevices({}, clPrecision),
 			memoryLimit,
 			runBenchmark,
 			nBenchmarkRuns,
 			outputPath,
 			useAvx2,
 			watchdogTimeout,
+			nColumns,
+			keyFilePath,
+			cpuQueueDepth,
+			clQueueDepth,
+			nCpuNodes,
+			stallTimeout,
+			byteRange,
+			serverSocketPath,
+			{},
+			isBatch,
+			clPrecision,
+			clJobsPerDevice,
 		};
 	}
 
@@ -274,7 +452,7 @@ ProcessingConfig ArgumentParser::validateArgs(const cxxopts::ParseResult& args)
 		throw std::runtime_error("No OpenCL devices specified");
 	}
 
-	const auto clDevices = queryClDevices({deviceNames.begin(), deviceNames.end()});
+	const auto clDevices = queryClDevices({deviceNames.begin(), deviceNames.end()}, clPrecision);
 	if (clDevices.empty()) {
 		throw std::runtime_error("No OpenCL devices found");
 	}
@@ -289,5 +467,17 @@ ProcessingConfig ArgumentParser::validateArgs(const cxxopts::ParseResult& args)
 		outputPath,
 		useAvx2,
 		watchdogTimeout,
+		nColumns,
+		keyFilePath,
+		cpuQueueDepth,
+		clQueueDepth,
+		nCpuNodes,
+		stallTimeout,
+		byteRange,
+		serverSocketPath,
+		{},
+		isBatch,
+		clPrecision,
+		clJobsPerDevice,
 	};
 }
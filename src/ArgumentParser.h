@@ -3,9 +3,8 @@
 #include "ProcessingConfig.h"
 #include "include/cxxopts.h"
 
-constexpr auto DOUBLE_PRECISION_DEFAULT = "cl_khr_fp64";
-constexpr auto DOUBLE_PRECISION_AMD = "cl_amd_fp64";
 constexpr auto DEFAULT_WATCHDOG_TIMEOUT = 5000; // 5 seconds
+constexpr auto DEFAULT_STALL_TIMEOUT = 30000; // 30 seconds
 
 /**
  * \brief Simple class to parse and validate arguments
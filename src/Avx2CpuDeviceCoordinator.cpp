@@ -1,4 +1,3 @@
-#define NOMINMAX
 #include <tbb/tbb.h>
 #include "Avx2StatsAccumulator.h"
 #include "Avx2CpuDeviceCoordinator.h"
@@ -12,25 +11,39 @@ Avx2CpuDeviceCoordinator::Avx2CpuDeviceCoordinator(const CoordinatorType coordin
                                                    jobFinishedCallback,
                                                    const std::function<void(size_t)>& notifyWatchdogCallback,
                                                    const std::function<void(CoordinatorErr)>& errCallback,
+                                                   const std::function<std::unique_ptr<Job>(size_t)>& claimJobCallback,
                                                    const size_t chunkSizeBytes, const size_t bytesPerAccumulator,
                                                    const size_t cpuBufferSizeBytes,
-                                                   fs::path& distFilePath, const size_t id): CpuDeviceCoordinator(
+                                                   fs::path& distFilePath, const fs::path& keyFilePath,
+                                                   const int numaNodeId, const int maxConcurrency,
+                                                   const size_t id): CpuDeviceCoordinator(
 	coordinatorType,
 	processingMode,
 	jobFinishedCallback,
 	notifyWatchdogCallback,
 	errCallback,
+	claimJobCallback,
 	chunkSizeBytes,
 	bytesPerAccumulator,
 	cpuBufferSizeBytes,
 	distFilePath,
+	keyFilePath,
+	numaNodeId,
+	maxConcurrency,
 	id) {
 }
 
-void Avx2CpuDeviceCoordinator::onProcessJob() {
+void Avx2CpuDeviceCoordinator::computeJob() {
 	log(INFO, "[SMP (AVX2)] Processing job with id " + std::to_string(currentJob->Id));
 	// Load data into the vector
-	const auto buffer = dataLoader.loadJobDataIntoVector(*currentJob);
+	const auto buffer = loadJobData();
+	auto accumulateTimer = ScopedStageTimer(stageProfiler, STAGE_ACCUMULATE);
+	if (currentJob->NColumns > 1) {
+		processColumns(buffer);
+		return;
+	}
+
+	processGroups(buffer);
 
 	// Create vector for results
 	const auto doublesPerAccumulator = bytesPerAccumulator / sizeof(double);
@@ -43,48 +56,159 @@ void Avx2CpuDeviceCoordinator::onProcessJob() {
 		log(DEBUG, "[SMP (AVX2)] Job too small to be processed in parallel, processing in a single accumulator");
 		auto accumulator = Avx2StatsAccumulator();
 		for (auto i = 0ULL; i < buffer.size() / 4; i += 1) {
-			accumulator.pushWithFiltering({
-				buffer[i * 4],
-				buffer[i * 4 + 1],
-				buffer[i * 4 + 2],
-				buffer[i * 4 + 3],
-			});
+			const auto x = _mm256_loadu_pd(&buffer[i * 4]);
+			accumulator.pushWithFiltering(x);
+			VectorizationUtils::pushToHistogram(jobHistograms[0], x);
 		}
+		pushRemainder(buffer, buffer.size() / 4 * 4, accumulator, jobHistograms[0]);
 		notifyWatchdogCallback(buffer.size() * sizeof(double));
 		accumulators.push_back(accumulator);
 	}
 	else {
 		log(DEBUG, "[SMP (AVX2)] Job split into " + std::to_string(nAccumulators) + " accumulators");
+		// Each thread gathers its own histogram, these are combined once the job is done
 		tbb::parallel_for(tbb::blocked_range<size_t>(0, nAccumulators),
 		                  [&](const tbb::blocked_range<size_t> r) {
+			                  auto& histogram = localHistograms()[0];
 			                  for (auto accumulatorId = r.begin(); accumulatorId < r.end(); accumulatorId += 1) {
 				                  // Since we are using AVX2 in each step we process 4 doubles at once, therefore the indices must
 				                  // be scaled by 1/4th
+				                  // The last accumulator takes the remaining values, including the ones that do not fill
+				                  // the whole vector
+				                  const auto isLast = accumulatorId + 1 == nAccumulators;
 				                  const auto jobStart = (accumulatorId * doublesPerAccumulator) / 4;
-				                  const auto jobEnd = jobStart + (doublesPerAccumulator) / 4;
+				                  const auto jobEnd = isLast ? buffer.size() / 4 : jobStart + (doublesPerAccumulator) / 4;
 				                  for (auto i = jobStart; i < jobEnd; i += 1) {
-									  accumulators[accumulatorId].pushWithFiltering(
-										  // Equivalent to:
-										  // _mm256_load_pd(&buffer[i * 4]));
-										  {
-						                  buffer[i * 4],
-						                  buffer[i * 4 + 1],
-						                  buffer[i * 4 + 2],
-						                  buffer[i * 4 + 3],
-					                  });
+					                  const auto x = _mm256_loadu_pd(&buffer[i * 4]);
+					                  accumulators[accumulatorId].pushWithFiltering(x);
+					                  VectorizationUtils::pushToHistogram(histogram, x);
+				                  }
+
+				                  if (isLast) {
+					                  pushRemainder(buffer, jobEnd * 4, accumulators[accumulatorId], histogram);
 				                  }
 
 				                  // Notify the watchdog
-								  notifyWatchdogCallback((jobEnd - jobStart) * sizeof(double));
+								  notifyWatchdogCallback((jobEnd - jobStart) * 4 * sizeof(double));
 			                  }
 		                  });
+		moveThreadHistogramsToJob();
+	}
+	// Lanes of each accumulator are stored directly into the batch
+	auto result = StatsAccumulatorBatch(accumulators.size() * 4);
+	for (auto i = 0ULL; i < accumulators.size(); i += 1) {
+		accumulators[i].storeInto(result, i * 4);
 	}
-	auto result = std::vector<StatsAccumulator>();
-	for (const auto& accumulator : accumulators) {
-		result.push_back(accumulator.asScalar());
+
+	currentJob->Items = std::move(result);
+	log(DEBUG,
+	    "[SMP (AVX2)] Finished computing job with id " + std::to_string(currentJob->Id) + ". Computed " +
+	    std::to_string(
+		    currentJob->getNChunks()) + " chunks. Chunk size is " + std::to_string(chunkSizeBytes) + " bytes");
+}
+
+void Avx2CpuDeviceCoordinator::pushRemainder(const std::vector<double>& buffer, const size_t start,
+                                             Avx2StatsAccumulator& accumulator, Histogram& histogram) {
+	if (start >= buffer.size()) {
+		return;
 	}
-	
-	currentJob->Items = result;
+
+	// Remaining values are padded with NaNs which are filtered out by the accumulator
+	alignas(32) auto values = std::array<double, 4>{NAN, NAN, NAN, NAN};
+	std::copy(buffer.begin() + static_cast<ptrdiff_t>(start), buffer.end(), values.begin());
+	const auto x = _mm256_load_pd(values.data());
+	accumulator.pushWithFiltering(x);
+	VectorizationUtils::pushToHistogram(histogram, x);
+}
+
+void Avx2CpuDeviceCoordinator::processColumns(const std::vector<double>& buffer) {
+	log(DEBUG, "[SMP (AVX2)] Processing job with " + std::to_string(currentJob->NColumns) + " columns");
+	const auto nColumns = currentJob->NColumns;
+	const auto nRecords = buffer.size() / nColumns;
+	const auto recordsPerAccumulator = bytesPerAccumulator / (nColumns * sizeof(double));
+
+	// Small jobs are processed by a single accumulator, the last accumulator takes the remaining records
+	const auto nAccumulators = std::max<size_t>(1, nRecords / recordsPerAccumulator);
+	auto accumulators = std::vector<Avx2StatsAccumulator>(nAccumulators * nColumns);
+	auto coMoments = std::vector<CoMomentAccumulator>(nAccumulators, CoMomentAccumulator(nColumns));
+
+	// Offsets of the same column in four consecutive records
+	const auto stride = static_cast<int64_t>(nColumns);
+	const auto gatherIndices = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, nAccumulators),
+	                  [&](const tbb::blocked_range<size_t> r) {
+		                  auto& histograms = localHistograms();
+		                  for (auto accumulatorId = r.begin(); accumulatorId < r.end(); accumulatorId += 1) {
+			                  const auto recordStart = accumulatorId * recordsPerAccumulator;
+			                  const auto recordEnd = accumulatorId + 1 == nAccumulators
+				                                         ? nRecords
+				                                         : recordStart + recordsPerAccumulator;
+			                  auto* columnAccumulators = &accumulators[accumulatorId * nColumns];
+
+			                  // De-interleave four records at a time - each gather loads one column from four records
+			                  auto recordIdx = recordStart;
+			                  for (; recordIdx + 4 <= recordEnd; recordIdx += 4) {
+				                  const auto* records = &buffer[recordIdx * nColumns];
+				                  for (auto column = 0ULL; column < nColumns; column += 1) {
+					                  const auto x = _mm256_i64gather_pd(records + column, gatherIndices, sizeof(double));
+					                  columnAccumulators[column].pushWithFiltering(x);
+					                  VectorizationUtils::pushToHistogram(histograms[column], x);
+				                  }
+
+				                  for (auto i = 0ULL; i < 4; i += 1) {
+					                  coMoments[accumulatorId].push(records + i * nColumns);
+				                  }
+			                  }
+
+			                  // Remaining records are padded with NaNs which are filtered out by the accumulator
+			                  if (recordIdx < recordEnd) {
+				                  for (auto column = 0ULL; column < nColumns; column += 1) {
+					                  alignas(32) auto values = std::array<double, 4>{NAN, NAN, NAN, NAN};
+					                  for (auto i = recordIdx; i < recordEnd; i += 1) {
+						                  values[i - recordIdx] = buffer[i * nColumns + column];
+					                  }
+					                  const auto x = _mm256_load_pd(values.data());
+					                  columnAccumulators[column].pushWithFiltering(x);
+					                  VectorizationUtils::pushToHistogram(histograms[column], x);
+				                  }
+
+				                  for (auto i = recordIdx; i < recordEnd; i += 1) {
+					                  coMoments[accumulatorId].push(&buffer[i * nColumns]);
+				                  }
+			                  }
+
+			                  notifyWatchdogCallback((recordEnd - recordStart) * nColumns * sizeof(double));
+		                  }
+	                  });
+
+	moveThreadHistogramsToJob();
+
+	// Co-moments are merged via parallel reduction
+	currentJob->CoMoments = tbb::parallel_reduce(
+		tbb::blocked_range<size_t>(0, nAccumulators),
+		CoMomentAccumulator(nColumns),
+		[&](const tbb::blocked_range<size_t>& r, CoMomentAccumulator result) {
+			for (auto i = r.begin(); i < r.end(); i += 1) {
+				result += coMoments[i];
+			}
+			return result;
+		},
+		[](CoMomentAccumulator lhs, const CoMomentAccumulator& rhs) {
+			lhs += rhs;
+			return lhs;
+		});
+
+	// Lanes are stored directly into the batch, column c occupies c-th block
+	auto result = StatsAccumulatorBatch(accumulators.size() * 4);
+	for (auto accumulatorId = 0ULL; accumulatorId < nAccumulators; accumulatorId += 1) {
+		for (auto column = 0ULL; column < nColumns; column += 1) {
+			accumulators[accumulatorId * nColumns + column].storeInto(
+				result, (column * nAccumulators + accumulatorId) * 4);
+		}
+	}
+
+	currentJob->Items = std::move(result);
 	log(DEBUG,
 	    "[SMP (AVX2)] Finished computing job with id " + std::to_string(currentJob->Id) + ". Computed " +
 	    std::to_string(
@@ -1,5 +1,6 @@
 #pragma once
 #include "ProcessingConfig.h"
+#include "Avx2StatsAccumulator.h"
 #include "CpuDeviceCoordinator.h"
 
 /**
@@ -15,10 +16,14 @@ public:
 	 * \param jobFinishedCallback callback when job is finished
 	 * \param notifyWatchdogCallback callback to notify the watchdog
 	 * \param errCallback error callback
+	 * \param claimJobCallback callback for claiming the next job
 	 * \param chunkSizeBytes chunk size in bytes
 	 * \param bytesPerAccumulator number of bytes per single accumulator
 	 * \param cpuBufferSizeBytes buffer size for a single job
 	 * \param distFilePath path to the file being processed
+	 * \param keyFilePath path to the file with keys, empty if values are not grouped by key
+	 * \param numaNodeId NUMA node the threads are bound to, tbb::task_arena::automatic for no binding
+	 * \param maxConcurrency number of threads of this coordinator, tbb::task_arena::automatic for all threads of the node
 	 * \param id id of this Device Coordinator
 	 */
 	Avx2CpuDeviceCoordinator(const CoordinatorType coordinatorType,
@@ -26,12 +31,33 @@ public:
 	                         const std::function<void(std::unique_ptr<Job>, size_t)>& jobFinishedCallback,
 	                         const std::function<void(size_t)>& notifyWatchdogCallback,
 	                         const std::function<void(CoordinatorErr)>& errCallback,
+	                         const std::function<std::unique_ptr<Job>(size_t)>& claimJobCallback,
 	                         const size_t chunkSizeBytes,
 	                         const size_t bytesPerAccumulator,
 	                         const size_t cpuBufferSizeBytes,
 	                         fs::path& distFilePath,
+	                         const fs::path& keyFilePath,
+	                         int numaNodeId,
+	                         int maxConcurrency,
 	                         const size_t id);
 
 protected:
-	void onProcessJob() override;
+	void computeJob() override;
+
+	/**
+	 * \brief Processes interleaved records of multiple columns, columns are de-interleaved via AVX2 gather
+	 * \param buffer buffer with the job data
+	 */
+	void processColumns(const std::vector<double>& buffer) override;
+
+private:
+	/**
+	 * \brief Pushes values from start to the end of the buffer that do not fill the whole vector
+	 * \param buffer buffer with the job data
+	 * \param start index of the first remaining value, at most 3 values may remain
+	 * \param accumulator accumulator to push to
+	 * \param histogram histogram to push to
+	 */
+	static void pushRemainder(const std::vector<double>& buffer, size_t start, Avx2StatsAccumulator& accumulator,
+	                          Histogram& histogram);
 };
@@ -69,6 +69,7 @@ void Avx2StatsAccumulator::pushWithFiltering(const __m256d x) {
 
 void Avx2StatsAccumulator::push(const __m256d x) {
 	isIntegerDistribution = _mm256_and_si256(isIntegerDistribution, VectorizationUtils::valuesInteger(x));
+	minVal = _mm256_min_pd(minVal, x);
 
 	const auto n1 = convertInt4ToDouble4(n); // n1 = n
 	n = _mm256_add_epi64(n, _mm256_set1_epi64x(1)); // n += 1
@@ -142,6 +143,17 @@ std::vector<StatsAccumulator> Avx2StatsAccumulator::asVectorOfScalars() const {
 	return results;
 }
 
+void Avx2StatsAccumulator::storeInto(StatsAccumulatorBatch& batch, const size_t idx) const {
+	_mm256_storeu_pd(batch.field(N_ITEMS_IDX) + idx, convertInt4ToDouble4(n));
+	_mm256_storeu_pd(batch.field(M1_IDX) + idx, m1);
+	_mm256_storeu_pd(batch.field(M2_IDX) + idx, m2);
+	_mm256_storeu_pd(batch.field(M3_IDX) + idx, m3);
+	_mm256_storeu_pd(batch.field(M4_IDX) + idx, m4);
+	_mm256_storeu_pd(batch.field(INTEGER_ONLY_IDX) + idx,
+	                 _mm256_and_pd(_mm256_castsi256_pd(isIntegerDistribution), _mm256_set1_pd(1.0)));
+	_mm256_storeu_pd(batch.field(MIN_IDX) + idx, minVal);
+}
+
 StatsAccumulator Avx2StatsAccumulator::asScalar() const {
 	auto results = asVectorOfScalars();
 	auto& result = results[0];
@@ -183,10 +195,10 @@ Avx2StatsAccumulator Avx2StatsAccumulator::operator+(const Avx2StatsAccumulator&
 	const auto m2a = _mm256_add_pd(m2, other.m2);
 
 	// m2`b = (delta2 * n) * (other.n / result.n)
-	const auto m2b = _mm256_mul_pd(_mm256_mul_pd(delta2, nDouble), _mm256_div_pd(otherNDouble, nDouble));
+	const auto m2b = _mm256_mul_pd(_mm256_mul_pd(delta2, nDouble), _mm256_div_pd(otherNDouble, meanB));
 
-	// result.m2 = m2 + m2a + m2b
-	result.m2 = _mm256_add_pd(m2, _mm256_add_pd(m2a, m2b));
+	// result.m2 = m2a + m2b
+	result.m2 = _mm256_add_pd(m2a, m2b);
 
 	// result.m3 = m3 + other.m3 + delta3 * n * other.n * (n - other.n) / (result.n * result.n)
 	// + 3.0 * delta * (n * other.m2 - other.n * m2) / result.n
@@ -209,7 +221,7 @@ Avx2StatsAccumulator Avx2StatsAccumulator::operator+(const Avx2StatsAccumulator&
 	                            resultNDouble);
 
 	// m3` = m3`a + ((m3`b * m3`c) + (m3`d * m3`e))
-	result.m3 = _mm256_add_pd(m3, _mm256_add_pd(m3a, _mm256_add_pd(_mm256_mul_pd(m3b, m3c), _mm256_mul_pd(m3d, m3e))));
+	result.m3 = _mm256_add_pd(m3a, _mm256_add_pd(_mm256_mul_pd(m3b, m3c), _mm256_mul_pd(m3d, m3e)));
 
 	// result.m4 = m4 + other.m4 +
 	// delta4 * n * other.n *
@@ -248,11 +260,11 @@ Avx2StatsAccumulator Avx2StatsAccumulator::operator+(const Avx2StatsAccumulator&
 	const auto m4f = _mm256_mul_pd(m4f1, m4f2);
 
 	// m4` = (m4`a + ((m4`b1 * (m4`b2 / m4`c))) + ((m4`d1 * (m4`d2 / m4`e)) + m4`f))
-	result.m4 = _mm256_add_pd(m4, _mm256_add_pd(m4a, _mm256_add_pd(_mm256_mul_pd(m4b1, _mm256_div_pd(m4b2, m4c)),
-	                                                      _mm256_add_pd(_mm256_mul_pd(m4d1, _mm256_div_pd(m4d2, m4e)),
-	                                                                 m4f))));
+	result.m4 = _mm256_add_pd(m4a, _mm256_add_pd(_mm256_mul_pd(m4b1, _mm256_div_pd(m4b2, m4c)),
+	                                             _mm256_add_pd(_mm256_mul_pd(m4d1, _mm256_div_pd(m4d2, m4e)), m4f)));
 
 	result.isIntegerDistribution = _mm256_and_si256(isIntegerDistribution, other.isIntegerDistribution);
+	result.minVal = _mm256_min_pd(minVal, other.minVal);
 
 	// return the result
 	return result;
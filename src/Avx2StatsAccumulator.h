@@ -3,6 +3,7 @@
 #include <vector>
 
 #include "StatsAccumulator.h"
+#include "StatsAccumulatorBatch.h"
 #include "VectorizationUtils.h"
 
 /**
@@ -53,6 +54,13 @@ public:
 	 */
 	[[nodiscard]] std::vector<StatsAccumulator> asVectorOfScalars() const;
 
+	/**
+	 * \brief Stores the four lanes directly into the batch without conversion to StatsAccumulator objects
+	 * \param batch batch to store to
+	 * \param idx index of the first lane in the batch, lanes are stored at idx, ..., idx + 3
+	 */
+	void storeInto(StatsAccumulatorBatch& batch, size_t idx) const;
+
 	/**
 	 * \brief Combines items in the vector into a single accumulator via left to right addition
 	 * \return combined StatsAccumulator
@@ -0,0 +1,219 @@
+#pragma once
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <tbb/tbb.h>
+
+#include "Benchmark.h"
+#include "CoMomentAccumulator.h"
+#include "DistributionClassification.h"
+#include "Histogram.h"
+#include "JobScheduler.h"
+#include "Logging.h"
+#include "ProcessingConfig.h"
+#include "StatsAccumulator.h"
+#include "Timer.h"
+
+// Files smaller than this are packed together into shared runs, larger ones keep all devices busy on their own
+constexpr auto BATCH_SMALL_FILE_LIMIT = 64ULL * 1024 * 1024;
+
+/**
+ * \brief Reads the list of files to process - one path per line, empty lines are skipped
+ * \param listFilePath path to the file with the list
+ * \return paths of the files
+ */
+inline std::vector<fs::path> readBatchFileList(const fs::path& listFilePath) {
+	auto file = std::ifstream(listFilePath);
+	if (!file) {
+		throw std::runtime_error("Could not open batch file list " + listFilePath.string());
+	}
+
+	auto result = std::vector<fs::path>();
+	auto line = std::string();
+	while (std::getline(file, line)) {
+		// Lists written on Windows end the lines with \r\n
+		if (!line.empty() && line.back() == '\r') {
+			line.pop_back();
+		}
+
+		if (!line.empty()) {
+			result.emplace_back(line);
+		}
+	}
+
+	return result;
+}
+
+/**
+ * \brief Writes results of a file of the batch to the console and to the output file (if any). Failed files are
+ *		  skipped, therefore each result is preceded by the path of the file
+ * \param filePath path to the processed file
+ * \param result results of the file
+ * \param outputFile output file, nullptr if the results are only printed to the console
+ */
+inline void emitBatchResult(const fs::path& filePath, const FileResult& result, std::ofstream* outputFile) {
+	auto output = std::stringstream();
+	output << "File: \"" << filePath.string() << "\"\n";
+	printResults(result.Columns, result.Histograms, result.CoMoments, {}, false, output);
+	output << "\n";
+
+	std::cout << output.str() << std::flush;
+	if (outputFile != nullptr) {
+		*outputFile << output.str() << std::flush;
+	}
+}
+
+/**
+ * \brief Runs the batch - the file of the config contains list of files to process. All files share a single
+ *		  scheduler, therefore the devices are set up only once. Consecutive small files are packed into a single run
+ *		  so that the coordinators process several of them at once, large files are processed one by one with all
+ *		  coordinators. Results of each file are emitted as soon as its run is finished
+ * \param config processing configuration
+ * \return true if all files were processed successfully
+ */
+inline bool runBatch(ProcessingConfig& config) {
+	auto tbbThreadControl = tbb::global_control(tbb::global_control::max_allowed_parallelism,
+	                                            config.ProcessingMode == SINGLE_THREAD
+		                                            ? 1
+		                                            : tbb::this_task_arena::max_concurrency()
+	);
+
+	auto filePaths = std::vector<fs::path>();
+	try {
+		filePaths = readBatchFileList(config.DistFilePath);
+	}
+	catch (const std::runtime_error& err) {
+		log(CRITICAL, err.what());
+		exit(1); // NOLINT(concurrency-mt-unsafe)
+	}
+
+	setupOutputFileDirsIfNeeded(config);
+	auto outputFile = std::ofstream();
+	if (!config.OutputPath.empty()) {
+		outputFile.open(config.OutputPath);
+	}
+	auto* outputFilePtr = config.OutputPath.empty() ? nullptr : &outputFile;
+
+	// Stage latencies of each run go next to the output file, or to the console if there is none
+	auto profileFile = openStageProfileFile(config);
+	auto& profileOutput = profileFile.is_open() ? profileFile : std::cout;
+
+	// Missing files and files that do not consist of whole records are reported right away
+	const auto recordSizeBytes = config.NColumns * sizeof(double);
+	auto nFailed = size_t{0};
+	auto validFiles = std::vector<std::pair<fs::path, size_t>>();
+	for (const auto& filePath : filePaths) {
+		auto errorCode = std::error_code();
+		const auto fileSize = fs::file_size(filePath, errorCode);
+		if (errorCode) {
+			log(WARNING, "[BATCH] File \"" + filePath.string() + "\" cannot be processed: " + errorCode.message());
+			nFailed += 1;
+		}
+		else if (fileSize == 0 || fileSize % recordSizeBytes != 0) {
+			log(WARNING, "[BATCH] File \"" + filePath.string() + "\" cannot be processed: size must be a non-zero "
+			    "multiple of the record size (" + std::to_string(recordSizeBytes) + " bytes)");
+			nFailed += 1;
+		}
+		else {
+			validFiles.emplace_back(filePath, static_cast<size_t>(fileSize));
+		}
+	}
+
+	log(INFO, "[BATCH] Processing " + std::to_string(validFiles.size()) + " files");
+	auto timer = Timer();
+	timer.start();
+
+	if (!validFiles.empty()) {
+		// The scheduler is set up for the first file, the following runs only reset the per-run state
+		auto schedulerConfig = config;
+		schedulerConfig.DistFilePath = validFiles.front().first;
+		try {
+			auto jobScheduler = std::make_unique<JobScheduler>(schedulerConfig);
+
+			// Fatal error terminates the coordinators, therefore the devices are set up again
+			const auto recoverFromError = [&] {
+				if (jobScheduler->fatalErrorOccurred()) {
+					log(WARNING, "[BATCH] Setting up the devices again after a fatal error");
+					jobScheduler = std::make_unique<JobScheduler>(schedulerConfig);
+				}
+			};
+
+			const auto processFile = [&](const fs::path& filePath) {
+				try {
+					log(INFO, "[BATCH] Processing file: \"" + filePath.string() + "\"");
+					auto result = FileResult(config.NColumns);
+					result.Columns = jobScheduler->run(filePath, {});
+					result.Histograms = jobScheduler->getHistograms();
+					result.CoMoments = jobScheduler->getCoMoments();
+					emitBatchResult(filePath, result, outputFilePtr);
+					if constexpr (STAGE_PROFILING_ENABLED) {
+						jobScheduler->writeStageProfiles(profileOutput, filePath.string());
+					}
+				}
+				catch (const std::runtime_error& err) {
+					log(WARNING, "[BATCH] Failed to process file \"" + filePath.string() + "\": " + err.what());
+					nFailed += 1;
+					recoverFromError();
+				}
+			};
+
+			auto packedFiles = std::vector<fs::path>();
+			const auto processPackedFiles = [&] {
+				if (packedFiles.empty()) {
+					return;
+				}
+
+				try {
+					log(INFO, "[BATCH] Processing " + std::to_string(packedFiles.size()) + " small files at once");
+					const auto& results = jobScheduler->runFiles(packedFiles);
+					for (auto fileIdx = 0ULL; fileIdx < packedFiles.size(); fileIdx += 1) {
+						emitBatchResult(packedFiles[fileIdx], results[fileIdx], outputFilePtr);
+					}
+
+					// Files of the run share the coordinators, therefore the latencies are written once for the run
+					if constexpr (STAGE_PROFILING_ENABLED) {
+						auto runName = std::string();
+						for (const auto& filePath : packedFiles) {
+							runName += (runName.empty() ? "" : ", ") + filePath.string();
+						}
+						jobScheduler->writeStageProfiles(profileOutput, runName);
+					}
+				}
+				catch (const std::runtime_error& err) {
+					// The failed file is not known, therefore the files are processed again one by one
+					log(WARNING, std::string("[BATCH] Failed to process small files at once: ") + err.what());
+					recoverFromError();
+					for (const auto& filePath : packedFiles) {
+						processFile(filePath);
+					}
+				}
+				packedFiles.clear();
+			};
+
+			// Files are emitted in the order of the list - a large file ends the current pack
+			for (const auto& [filePath, fileSize] : validFiles) {
+				if (fileSize >= BATCH_SMALL_FILE_LIMIT) {
+					processPackedFiles();
+					processFile(filePath);
+					continue;
+				}
+
+				packedFiles.push_back(filePath);
+				if (packedFiles.size() == MAX_FILES_PER_RUN) {
+					processPackedFiles();
+				}
+			}
+			processPackedFiles();
+		}
+		catch (const std::runtime_error& err) {
+			log(CRITICAL, err.what());
+			exit(1); // NOLINT(concurrency-mt-unsafe)
+		}
+	}
+
+	timer.stop();
+	log(INFO, "[BATCH] Processed " + std::to_string(filePaths.size() - nFailed) + " of " +
+	    std::to_string(filePaths.size()) + " files");
+	timer.printResults();
+	return nFailed == 0;
+}
@@ -12,26 +12,60 @@
 constexpr auto MAX_RUNS = 1024;
 constexpr auto DEFAULT_RUNS = 10; // 10 seems to be a good default
 
+// Suffix of the file with the stage latencies, appended to the path of the output file
+constexpr auto PROFILE_FILE_SUFFIX = ".profile.json";
+
 /**
- * \brief Performs one benchmark run of the classification for given processing config
- * \param processingConfig processing configuration
+ * \brief Performs one benchmark run of the classification on an already created scheduler - i.e. with all threads,
+ *		  arenas and compiled programs from the previous runs
+ * \param jobScheduler job scheduler
  * \return computation time
  */
-inline auto performBenchmarkRun(ProcessingConfig& processingConfig) {
-	auto jobScheduler = JobScheduler(processingConfig);
-
+inline auto performBenchmarkRun(JobScheduler& jobScheduler, std::ostream& profileOutput,
+                                const std::string& runName) {
 	// Perform the run - note that only the actual computing time is measured
 	auto timer = Timer();
 	timer.start();
 	const auto result = jobScheduler.run();
 	timer.stop();
-	classifyDistribution(StatUtils::mergeLeftToRight(result));
+	if (const auto nColumns = jobScheduler.getNColumns(); nColumns > 1) {
+		classifyColumns(result, jobScheduler.getHistograms(),
+		                jobScheduler.getCoMoments());
+	}
+	else {
+		classifyDistribution(result[0], jobScheduler.getHistogram());
+	}
 	timer.printResults();
 	std::cout << "\n";
 
+	if constexpr (STAGE_PROFILING_ENABLED) {
+		jobScheduler.writeStageProfiles(profileOutput, runName);
+	}
+
 	return timer.getElapsedTimeMillis();
 }
 
+/**
+ * \brief Logs throughput of a run to the console and file (if provided)
+ * \param statName name of the statistic
+ * \param durationMillis duration in milliseconds
+ * \param fileSizeBytes size of the processed file in bytes
+ * \param file file to write the results to
+ * \param logToFile whether to log to the file
+ */
+inline void logThroughput(const std::string& statName,
+                          const std::chrono::duration<int64_t, std::milli> durationMillis,
+                          const uintmax_t fileSizeBytes,
+                          std::ofstream& file,
+                          const bool logToFile) {
+	const auto secs = std::max(static_cast<double>(durationMillis.count()), 1.0) / 1000.0;
+	const auto megabytesPerSec = static_cast<double>(fileSizeBytes) / (1024.0 * 1024.0) / secs;
+	std::cout << statName << " throughput: " << StatUtils::doubleToStr(megabytesPerSec, 5) << " MB/s" << std::endl;
+	if (logToFile) {
+		file << statName << " throughput: " << StatUtils::doubleToStr(megabytesPerSec, 5) << " MB/s" << std::endl;
+	}
+}
+
 /**
  * \brief Logs stat to the console and file (if provided)
  * \param statName name of the statistic
@@ -63,9 +97,8 @@ inline void setupOutputFileDirsIfNeeded(const ProcessingConfig& config) {
 	}
 	else {
 		// Create output file directories if needed
-		const auto parentPath = config.DistFilePath.parent_path();
 		try {
-			FilesystemUtils::makeDirs(parentPath); // This will throw if it is not possible
+			FilesystemUtils::makeDirs(config.OutputPath); // This will throw if it is not possible
 		}
 		catch (std::runtime_error& err) {
 			// Cannot continue if we have nowhere to write the results
@@ -75,6 +108,20 @@ inline void setupOutputFileDirsIfNeeded(const ProcessingConfig& config) {
 	}
 }
 
+/**
+ * \brief Opens the file for the stage latencies next to the output file, each run writes a single line of JSON into it
+ * \param config config
+ * \return opened file, not open if profiling is not compiled in or there is no output file
+ */
+inline std::ofstream openStageProfileFile(const ProcessingConfig& config) {
+	auto result = std::ofstream();
+	if (STAGE_PROFILING_ENABLED && !config.OutputPath.empty()) {
+		result.open(config.OutputPath.string() + PROFILE_FILE_SUFFIX);
+	}
+
+	return result;
+}
+
 /**
  * \brief Gets correct number of runs so that user cannot e.g. pass negative number
  * \param config config
@@ -123,13 +170,26 @@ inline void runBenchmark(ProcessingConfig& config) {
 	log(INFO, "[BENCHMARK] Benchmark will run in processing mode: " + inverseProcessingModeLutTable[config.
 		    ProcessingMode]);
 
-	// Run the benchmark
+	// Run the benchmark - the scheduler is created once, so the first run also pays for creating the threads,
+	// compiling the OpenCL programs and measuring the device throughputs. This cold start is reported separately
 	log(INFO, "[BENCHMARK] Starting the benchmark\n");
 	auto runDurations = std::vector<std::chrono::duration<long long, std::milli>>();
+	auto coldStartDuration = std::chrono::milliseconds(0);
+
+	// Stage latencies of each run go next to the output file, or to the console if there is none
+	auto profileFile = openStageProfileFile(config);
+	auto& profileOutput = profileFile.is_open() ? profileFile : std::cout;
 	try {
+		log(INFO, "[BENCHMARK] Starting cold start run");
+		const auto coldStart = std::chrono::steady_clock::now();
+		auto jobScheduler = JobScheduler(config);
+		performBenchmarkRun(jobScheduler, profileOutput, "cold start");
+		coldStartDuration = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - coldStart);
+
 		for (auto i = 1ULL; i <= nRuns; i += 1) {
 			log(INFO, "[BENCHMARK] Starting run #" + std::to_string(i));
-			runDurations.push_back(performBenchmarkRun(config));
+			runDurations.push_back(performBenchmarkRun(jobScheduler, profileOutput, std::to_string(i)));
 		}
 	}
 	catch (const std::runtime_error& err) {
@@ -166,9 +226,16 @@ inline void runBenchmark(ProcessingConfig& config) {
 	}
 	std::cout << "\n";
 
-	// Log the average, best, and worst run time
+	// Log the cold start and the average, best, and worst steady-state run time
+	logStat("Cold start", coldStartDuration, file, logToFile);
 	logStat("Average", averageRunTime, file, logToFile);
 	logStat("Best", minRunTime, file, logToFile);
 	logStat("Worst", maxRunTime, file, logToFile);
+	std::cout << "\n";
+
+	const auto fileSizeBytes = fs::file_size(config.DistFilePath);
+	logThroughput("Cold start", coldStartDuration, fileSizeBytes, file, logToFile);
+	logThroughput("Average", averageRunTime, fileSizeBytes, file, logToFile);
+	logThroughput("Best", minRunTime, fileSizeBytes, file, logToFile);
 
 }
@@ -0,0 +1,284 @@
+#pragma once
+#include <array>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ClConfig.h"
+
+/**
+ * \brief Device buffer that is reused as long as it is large enough
+ */
+struct PooledDeviceBuffer {
+	cl::Buffer Buffer;
+	size_t CapacityBytes = 0;
+	double* HostPtr = nullptr; // Mapped memory of zero-copy buffer, nullptr if the buffer is not mapped
+	cl::Event MapEvent; // Event of the map operation, HostPtr can be used once it completes
+};
+
+/**
+ * \brief Pinned host buffer (allocated by the runtime with CL_MEM_ALLOC_HOST_PTR) that stays mapped for its whole
+ *		  lifetime - transfers from pinned memory avoid the extra copy of the driver and run at the full bus speed
+ */
+struct PooledStagingBuffer {
+	cl::Buffer Buffer;
+	double* HostPtr = nullptr;
+	size_t CapacityBytes = 0;
+};
+
+/**
+ * \brief Device and pinned host buffers of a single OpenCL device. Buffers are created on the first request and
+ *		  recycled by all following jobs, they are only reallocated if a job needs more memory than any job before.
+ *		  Each slot has its own data and staging buffer so that multiple transfers can be in flight at once.
+ *		  Zero-copy pool is meant for devices sharing the memory with the host - data buffers are allocated by the
+ *		  runtime in the host memory and the host writes into them directly via mapping, no staging is needed
+ */
+class ClBufferPool {
+
+	cl::Context context;
+	cl::CommandQueue commandQueue;
+
+	/**
+	 * \brief Device buffer for the data of each slot
+	 */
+	std::vector<PooledDeviceBuffer> dataBuffers;
+
+	/**
+	 * \brief Device buffer for the accumulators
+	 */
+	PooledDeviceBuffer accumulatorsBuffer;
+
+	/**
+	 * \brief Device buffers for the results of the on-device reduction - the first pass reduces the accumulators
+	 *		  into one partial result per work group, the second pass reduces the partial results into one
+	 */
+	std::array<PooledDeviceBuffer, 2> reductionBuffers;
+
+	/**
+	 * \brief Pinned host buffer for the data of each slot
+	 */
+	std::vector<PooledStagingBuffer> stagingBuffers;
+
+	/**
+	 * \brief Total number of buffers allocated by the pool
+	 */
+	size_t nAllocations = 0;
+
+	/**
+	 * \brief Whether the data buffers are accessed by the host directly
+	 */
+	bool isZeroCopy;
+
+public:
+	/**
+	 * \brief Creates empty pool, no memory is allocated until the buffers are requested
+	 * \param context context of the device
+	 * \param commandQueue command queue used to map the staging buffers
+	 * \param nSlots number of slots
+	 * \param isZeroCopy whether the data buffers are allocated in the host memory and mapped instead of staged
+	 */
+	ClBufferPool(cl::Context context, cl::CommandQueue commandQueue, const size_t nSlots = 1,
+	             const bool isZeroCopy = false) :
+		context(std::move(context)),
+		commandQueue(std::move(commandQueue)),
+		dataBuffers(nSlots),
+		stagingBuffers(nSlots),
+		isZeroCopy(isZeroCopy) {
+	}
+
+	ClBufferPool(const ClBufferPool&) = delete;
+	ClBufferPool& operator=(const ClBufferPool&) = delete;
+
+	~ClBufferPool() {
+		for (auto& staging : stagingBuffers) {
+			unmap(staging);
+		}
+
+		for (auto& pooled : dataBuffers) {
+			unmap(pooled);
+		}
+	}
+
+	/**
+	 * \brief Returns whether the data buffers are accessed by the host directly
+	 * \return true if the pool is zero-copy
+	 */
+	[[nodiscard]] bool zeroCopy() const {
+		return isZeroCopy;
+	}
+
+	/**
+	 * \brief Returns device buffer for the data of the slot
+	 * \param slot slot index
+	 * \param sizeBytes required size in bytes
+	 * \return buffer with at least the required size
+	 */
+	const cl::Buffer& dataBuffer(const size_t slot, const size_t sizeBytes) {
+		return reserve(dataBuffers.at(slot), sizeBytes,
+		               isZeroCopy ? CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR : CL_MEM_READ_WRITE);
+	}
+
+	/**
+	 * \brief Returns host pointer to the data buffer of the slot (zero-copy pool only), waiting for the map operation
+	 *		  if needed. The pointer is valid until the buffer is unmapped
+	 * \param slot slot index
+	 * \param sizeBytes required size in bytes
+	 * \return pointer to the mapped memory of the buffer
+	 */
+	double* mapDataBuffer(const size_t slot, const size_t sizeBytes) {
+		auto& pooled = dataBuffers.at(slot);
+		dataBuffer(slot, sizeBytes);
+
+		if (pooled.HostPtr == nullptr) {
+			enqueueMap(pooled, {});
+		}
+
+		throwIfStatusUnsuccessful(pooled.MapEvent.wait(), "map device buffer");
+		return pooled.HostPtr;
+	}
+
+	/**
+	 * \brief Hands the data buffer of the slot over to the device (zero-copy pool only)
+	 * \param slot slot index
+	 * \param unmapEvent event of the unmap operation, the device can use the buffer once it completes
+	 */
+	void unmapDataBuffer(const size_t slot, cl::Event& unmapEvent) {
+		auto& pooled = dataBuffers.at(slot);
+		throwIfStatusUnsuccessful(commandQueue.enqueueUnmapMemObject(pooled.Buffer, pooled.HostPtr, nullptr,
+		                                                             &unmapEvent), "unmap device buffer");
+		pooled.HostPtr = nullptr;
+	}
+
+	/**
+	 * \brief Schedules mapping of the data buffer of the slot once the event completes (zero-copy pool only) - this
+	 *		  way the host does not block the queue and the next mapDataBuffer only waits for the map itself
+	 * \param slot slot index
+	 * \param event event after which the buffer can be mapped, usually the kernel which reads the buffer
+	 */
+	void mapDataBufferAfter(const size_t slot, const cl::Event& event) {
+		enqueueMap(dataBuffers.at(slot), {event});
+	}
+
+	/**
+	 * \brief Returns device buffer for the accumulators
+	 * \param sizeBytes required size in bytes
+	 * \return buffer with at least the required size
+	 */
+	const cl::Buffer& accumulatorsDeviceBuffer(const size_t sizeBytes) {
+		return reserve(accumulatorsBuffer, sizeBytes, CL_MEM_READ_WRITE);
+	}
+
+	/**
+	 * \brief Returns device buffer for the results of the reduction pass
+	 * \param pass index of the reduction pass
+	 * \param sizeBytes required size in bytes
+	 * \return buffer with at least the required size
+	 */
+	const cl::Buffer& reductionDeviceBuffer(const size_t pass, const size_t sizeBytes) {
+		return reserve(reductionBuffers.at(pass), sizeBytes, CL_MEM_READ_WRITE);
+	}
+
+	/**
+	 * \brief Returns pinned host buffer of the slot
+	 * \param slot slot index
+	 * \param sizeBytes required size in bytes
+	 * \return pointer to the mapped memory with at least the required size
+	 */
+	double* stagingBuffer(const size_t slot, const size_t sizeBytes) {
+		auto& staging = stagingBuffers.at(slot);
+		if (staging.CapacityBytes >= sizeBytes) {
+			return staging.HostPtr;
+		}
+
+		unmap(staging);
+		auto clStatus = cl_int{};
+		staging.Buffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, sizeBytes, nullptr, &clStatus);
+		throwIfStatusUnsuccessful(clStatus, "allocate pinned host buffer");
+		staging.HostPtr = static_cast<double*>(commandQueue.enqueueMapBuffer(
+			staging.Buffer, CL_TRUE, CL_MAP_WRITE, 0, sizeBytes, nullptr, nullptr, &clStatus));
+		throwIfStatusUnsuccessful(clStatus, "map pinned host buffer");
+		staging.CapacityBytes = sizeBytes;
+		nAllocations += 1;
+		return staging.HostPtr;
+	}
+
+	/**
+	 * \brief Returns total number of buffers allocated by the pool - this does not grow once the pool is warmed up
+	 * \return number of allocations
+	 */
+	[[nodiscard]] size_t getNAllocations() const {
+		return nAllocations;
+	}
+
+private:
+	/**
+	 * \brief Reallocates the device buffer if it is smaller than required
+	 * \param pooled pooled buffer
+	 * \param sizeBytes required size in bytes
+	 * \param flags memory flags of the buffer
+	 * \return buffer with at least the required size
+	 */
+	const cl::Buffer& reserve(PooledDeviceBuffer& pooled, const size_t sizeBytes, const cl_mem_flags flags) {
+		if (pooled.CapacityBytes >= sizeBytes) {
+			return pooled.Buffer;
+		}
+
+		// Old buffer must be released before the new one is created, otherwise both may not fit on the device
+		unmap(pooled);
+		pooled.Buffer = cl::Buffer();
+		auto clStatus = cl_int{};
+		pooled.Buffer = cl::Buffer(context, flags, sizeBytes, nullptr, &clStatus);
+		throwIfStatusUnsuccessful(clStatus, "allocate device buffer");
+		pooled.CapacityBytes = sizeBytes;
+		nAllocations += 1;
+		return pooled.Buffer;
+	}
+
+	/**
+	 * \brief Schedules non-blocking map of the whole device buffer for writing
+	 * \param pooled pooled buffer
+	 * \param waitEvents events the map waits for
+	 */
+	void enqueueMap(PooledDeviceBuffer& pooled, const std::vector<cl::Event>& waitEvents) {
+		auto clStatus = cl_int{};
+		pooled.HostPtr = static_cast<double*>(commandQueue.enqueueMapBuffer(
+			pooled.Buffer, CL_FALSE, CL_MAP_WRITE_INVALIDATE_REGION, 0, pooled.CapacityBytes,
+			waitEvents.empty() ? nullptr : &waitEvents, &pooled.MapEvent, &clStatus));
+		throwIfStatusUnsuccessful(clStatus, "map device buffer");
+	}
+
+	/**
+	 * \brief Unmaps the device buffer, does nothing if it is not mapped
+	 * \param pooled pooled buffer
+	 */
+	void unmap(PooledDeviceBuffer& pooled) {
+		if (pooled.HostPtr == nullptr) {
+			return;
+		}
+
+		commandQueue.enqueueUnmapMemObject(pooled.Buffer, pooled.HostPtr);
+		commandQueue.finish();
+		pooled.HostPtr = nullptr;
+	}
+
+	/**
+	 * \brief Unmaps the staging buffer, does nothing if it is not mapped
+	 * \param staging staging buffer
+	 */
+	void unmap(PooledStagingBuffer& staging) {
+		if (staging.HostPtr == nullptr) {
+			return;
+		}
+
+		commandQueue.enqueueUnmapMemObject(staging.Buffer, staging.HostPtr);
+		commandQueue.finish();
+		staging.HostPtr = nullptr;
+		staging.CapacityBytes = 0;
+	}
+
+	static void throwIfStatusUnsuccessful(const cl_int clStatus, const std::string& action) {
+		if (clStatus != CL_SUCCESS) {
+			throw std::runtime_error("Failed to " + action + ", OpenCL error: " + std::to_string(clStatus));
+		}
+	}
+};
@@ -0,0 +1,8 @@
+#pragma once
+// OpenCL version the host code is written against - every file that uses OpenCL includes it through this header so
+// that all translation units see the same API
+#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
+#define CL_HPP_TARGET_OPENCL_VERSION 200
+#define CL_TARGET_OPENCL_VERSION 200
+
+#include <CL/opencl.hpp>
@@ -1,13 +1,43 @@
+#include <algorithm>
+#include <array>
+#include <limits>
+
+#include "ClDeviceProfile.h"
+#include "ClProgramCache.h"
 #include "ClSources.h"
 #include "StatUtils.h"
+#include "Timer.h"
 #include "Logging.h"
 #include "ClDeviceCoordinator.h"
 
 auto ClDeviceCoordinator::compile(const std::string& source, const std::string& programName,
-                                  const cl::Context& deviceContext) const {
+                                  const cl::Context& deviceContext, const std::string& buildFlags) const {
+	// Binary from the cache still has to be built, but that is much cheaper than the compilation from the source
+	const auto cacheKey = ClProgramCache::buildKey(device, buildFlags, source);
+	try {
+		if (const auto binary = ClProgramCache::load(cacheKey)) {
+			auto binaryStatus = std::vector<cl_int>();
+			auto status = cl_int{CL_SUCCESS};
+			auto cachedProgram = cl::Program(deviceContext, {device}, cl::Program::Binaries{*binary}, &binaryStatus,
+			                                 &status);
+			if (status == CL_SUCCESS && cachedProgram.build(buildFlags.c_str()) == CL_BUILD_SUCCESS) {
+				log(DEBUG, "[OPENCLBUILD - " + deviceName + " " + deviceType + "] Loaded " + programName +
+				    " from the cache");
+				return cachedProgram;
+			}
+
+			log(DEBUG, "[OPENCLBUILD - " + deviceName + " " + deviceType + "] Cached " + programName +
+			    " was rejected by the device, compiling from the source");
+		}
+	}
+	catch (const std::exception& err) {
+		log(DEBUG, "[OPENCLBUILD - " + deviceName + " " + deviceType + "] Failed to load " + programName +
+		    " from the cache: " + err.what());
+	}
+
 	auto program = cl::Program(deviceContext, source);
-	const auto result = program.build(DEFAULT_BUILD_FLAG);
-	 auto buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+	const auto result = program.build(buildFlags.c_str());
+	auto buildLog = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
 	if (buildLog.empty() || buildLog == "\n") {
 		buildLog = "Compilation successful";
 	}
@@ -17,6 +47,19 @@ auto ClDeviceCoordinator::compile(const std::string& source, const std::string&
 			"Error during OpenCL Program compilation ( " + programName + " )\n. Error: " + std::to_string(result));
 	}
 
+	// The program is built for a single device, therefore it has a single binary
+	try {
+		const auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+		if (binaries.size() == 1 && !binaries[0].empty() && !ClProgramCache::store(cacheKey, binaries[0])) {
+			log(DEBUG, "[OPENCLBUILD - " + deviceName + " " + deviceType + "] Failed to store " + programName +
+			    " in the cache");
+		}
+	}
+	catch (const std::exception& err) {
+		log(DEBUG, "[OPENCLBUILD - " + deviceName + " " + deviceType + "] Failed to store " + programName +
+		    " in the cache: " + err.what());
+	}
+
 	return program;
 }
 
@@ -25,21 +68,28 @@ ClDeviceCoordinator::ClDeviceCoordinator(const CoordinatorType coordinatorType,
                                          const std::function<void(std::unique_ptr<Job>, size_t)>& jobFinishedCallback,
                                          const std::function<void(size_t)>& notifyWatchdogCallback,
                                          const std::function<void(CoordinatorErr)>& errCallback,
+                                         const std::function<std::unique_ptr<Job>(size_t)>& claimJobCallback,
                                          const size_t chunkSizeBytes,
                                          const size_t bytesPerAccumulator,
                                          const size_t clHostBufferSizeBytes,
                                          fs::path& distFilePath,
                                          const size_t id,
-                                         cl::Device device):
+                                         cl::Device device,
+                                         const ClPrecision clPrecision,
+                                         const size_t nDeviceJobs):
 	DeviceCoordinator(
 		coordinatorType,
 		processingMode,
 		jobFinishedCallback,
 		notifyWatchdogCallback,
 		errCallback,
+		claimJobCallback,
 		chunkSizeBytes,
 		bytesPerAccumulator, distFilePath, id),
 	device(std::move(device)),
+	clPrecision(clPrecision),
+	nDeviceJobs(std::max<size_t>(1, nDeviceJobs)),
+	clHostBufferSizeBytes(clHostBufferSizeBytes),
 	maxHostChunks(
 		clHostBufferSizeBytes / chunkSizeBytes) {
 	// Setup the device
@@ -52,34 +102,424 @@ ClDeviceCoordinator::ClDeviceCoordinator(const CoordinatorType coordinatorType,
 void ClDeviceCoordinator::setup() {
 	// OpenCL boilerplate
 	context = cl::Context(device);
-	commandQueue = cl::CommandQueue(context, device);
+	// Transfers get their own queue - kernels and transfers are only ordered by the events between them, so devices
+	// with copy engines transfer the next batch while the current one is computed
+	// Queues only collect timestamps of the commands if profiling is compiled in
+	const auto queueProperties = cl_command_queue_properties{STAGE_PROFILING_ENABLED ? CL_QUEUE_PROFILING_ENABLE : 0};
+	commandQueue = cl::CommandQueue(context, device, queueProperties);
+	transferQueue = cl::CommandQueue(context, device, queueProperties);
 	deviceName = device.getInfo<CL_DEVICE_NAME>();
-	program = compile(CL_PROGRAM, "program", context);
+
+	// Set the device type
+	if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) {
+		this->deviceType = "CPU";
+	}
+
+	// Devices sharing the memory with the host (CPU runtimes, integrated GPUs) read the data in place
+	const auto isZeroCopy = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+	log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] " +
+	    (isZeroCopy ? "Host unified memory detected, using zero-copy buffers" : "Using pinned staging buffers"));
+	bufferPool = std::make_unique<ClBufferPool>(context, transferQueue, CL_DATA_SLOTS, isZeroCopy);
+
+	// Several work groups per compute unit hide the latency of the memory reads
+	nComputeUnits = std::max<size_t>(1, device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+
+	useFp32 = clPrecision == ClPrecision::FP32 ||
+		(clPrecision == ClPrecision::FP32_FALLBACK && !clDeviceSupportsFp64(device));
+	if (useFp32) {
+		setupFp32();
+		return;
+	}
+
+	program = compile(CL_PROGRAM, "program", context,
+	                  std::string(DEFAULT_BUILD_FLAG) + " " + CL_KERNEL_VARIANTS[kernelVariantIdx].buildFlags());
 	estimateWorkgroupSize();
+	maxWorkGroups = nComputeUnits * workGroupsPerComputeUnit;
+
+	// Tuning is expensive, therefore its results are stored and reused as long as the device and the kernel are the same
+	const auto profileKey = ClDeviceProfiles::buildKey(device, CL_PROGRAM);
+	const auto profile = ClDeviceProfiles::load(profileKey);
+	if (!profile || !applyProfile(*profile)) {
+		tuneDevice();
+		if (!ClDeviceProfiles::store(profileKey, currentProfile())) {
+			log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Failed to store the device profile");
+		}
+	}
+
+	log(INFO, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Using kernel variant with " +
+	    CL_KERNEL_VARIANTS[kernelVariantIdx].name() + ", up to " + std::to_string(maxWorkGroups) +
+	    " work groups of " + std::to_string(maxWorkGroupSize) + " work items");
+	log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Device profile: " +
+	    ClDeviceProfiles::profileFilePath(profileKey).string());
+	configureChunks();
+}
+
+void ClDeviceCoordinator::setupFp32() {
+	program = compile(CL_PROGRAM_FP32, "fp32 program", context, FP32_BUILD_FLAG);
+	kernel = cl::Kernel(program, KERNEL_NAME);
+	estimateWorkgroupSize();
+	maxWorkGroups = nComputeUnits * workGroupsPerComputeUnit;
+
+	log(INFO, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Using compensated fp32 kernel, up to " +
+	    std::to_string(maxWorkGroups) + " work groups of " + std::to_string(maxWorkGroupSize) + " work items");
+	configureChunks();
+}
+
+void ClDeviceCoordinator::createKernels() {
+	kernel = cl::Kernel(program, KERNEL_NAME);
+	reduceKernel = cl::Kernel(program, REDUCE_KERNEL_NAME);
+
+	// Work group of the reduce kernel keeps an accumulator of each work item in the local memory
+	const auto localMemoryItems = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() / (N_CL_OUT_ITEMS * sizeof(double));
+	reduceWorkGroupSize = std::max<size_t>(1, std::min({
+		                                       device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(),
+		                                       static_cast<size_t>(localMemoryItems),
+		                                       reduceKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)
+	                                       }));
+}
+
+bool ClDeviceCoordinator::applyProfile(const ClDeviceProfile& profile) {
+	if (profile.KernelVariantIdx >= CL_KERNEL_VARIANTS.size()) {
+		return false;
+	}
+
+	try {
+		const auto& variant = CL_KERNEL_VARIANTS[profile.KernelVariantIdx];
+		auto variantProgram = profile.KernelVariantIdx == kernelVariantIdx
+			                      ? program
+			                      : compile(CL_PROGRAM, "program (" + variant.name() + ")", context,
+			                                std::string(DEFAULT_BUILD_FLAG) + " " + variant.buildFlags());
+
+		// Profile may come from a different build of the same driver with tighter limits, then the device is tuned again
+		if (cl::Kernel(variantProgram, KERNEL_NAME).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) <
+			profile.WorkGroupSize) {
+			return false;
+		}
+
+		program = std::move(variantProgram);
+	}
+	catch (const std::exception& err) {
+		log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Device profile cannot be applied: " +
+		    err.what());
+		return false;
+	}
+
+	kernelVariantIdx = profile.KernelVariantIdx;
+	maxWorkGroupSize = profile.WorkGroupSize;
+	workGroupsPerComputeUnit = profile.WorkGroupsPerComputeUnit;
+	maxWorkGroups = nComputeUnits * workGroupsPerComputeUnit;
+	bytesPerAccumulator = profile.BytesPerAccumulator;
+	hostBatchBytes = profile.HostBatchBytes;
+	createKernels();
+	log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Loaded tuned device profile");
+	return true;
+}
+
+ClDeviceProfile ClDeviceCoordinator::currentProfile() const {
+	return {kernelVariantIdx, maxWorkGroupSize, workGroupsPerComputeUnit, bytesPerAccumulator, hostBatchBytes};
+}
+
+void ClDeviceCoordinator::tuneDevice() {
+	log(INFO, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Tuning the device, this is only done once");
+
+	// Synthetic data mix integers, fractions and invalid values, so that all paths of the kernel are taken
+	const auto nValues = std::min<size_t>(CL_CALIBRATION_VALUES,
+	                                      device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / 2 / sizeof(double));
+	auto values = std::vector<double>(nValues);
+	for (auto i = 0ULL; i < nValues; i += 1) {
+		values[i] = i % CL_CALIBRATION_INVALID_PERIOD == 0
+			            ? std::numeric_limits<double>::quiet_NaN()
+			            : static_cast<double>(i % 1000) * (i % 2 == 0 ? 1.0 : 0.37);
+	}
+
+	auto clStatus = cl_int{};
+	const auto dataBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nValues * sizeof(double),
+	                                   values.data(), &clStatus);
+	throwIfStatusUnsuccessful(clStatus);
+
+	// Buffers of the sweep are sized for the synthetic data and the largest candidates rather than for the jobs,
+	// therefore the whole sweep runs on a temporary pool which is released once the tuning is done
+	auto jobBufferPool = std::exchange(bufferPool, std::make_unique<ClBufferPool>(context, transferQueue, 1,
+	                                                                              bufferPool->zeroCopy()));
+	calibrateKernelVariant(dataBuffer, nValues);
+	createKernels();
+	const auto kernelTime = tuneWorkGroups(dataBuffer, nValues);
+	tuneJobSize(nValues * sizeof(double), kernelTime);
+	tuneHostBatchSize();
+	bufferPool = std::move(jobBufferPool);
+}
+
+std::chrono::microseconds ClDeviceCoordinator::timeKernel(cl::Kernel& timedKernel, const cl::Buffer& dataBuffer,
+                                                          const size_t nValues, const size_t workGroupSize,
+                                                          const size_t nWorkGroups) {
+	const auto nAccumulators = workGroupSize * nWorkGroups;
+	const auto& accumulatorsBuffer = bufferPool->accumulatorsDeviceBuffer(
+		nAccumulators * N_CL_OUT_ITEMS * sizeof(double));
+	timedKernel.setArg(0, dataBuffer);
+	timedKernel.setArg(1, accumulatorsBuffer);
+	timedKernel.setArg(2, static_cast<cl_ulong>(nValues));
+
+	auto result = std::chrono::microseconds::max();
+	for (auto run = 0; run <= CL_CALIBRATION_RUNS; run += 1) {
+		resetAccumulators(accumulatorsBuffer, nAccumulators);
+		auto clStatus = commandQueue.finish();
+		throwIfStatusUnsuccessful(clStatus);
+
+		auto timer = Timer();
+		timer.start();
+		clStatus = commandQueue.enqueueNDRangeKernel(timedKernel, cl::NullRange, cl::NDRange(nAccumulators),
+		                                             cl::NDRange(workGroupSize));
+		throwIfStatusUnsuccessful(clStatus);
+		clStatus = commandQueue.finish();
+		throwIfStatusUnsuccessful(clStatus);
+		timer.stop();
+
+		// First run only warms the device up
+		if (run > 0) {
+			result = std::min(result, timer.getElapsedTimeMicros());
+		}
+	}
+
+	return result;
+}
+
+void ClDeviceCoordinator::calibrateKernelVariant(const cl::Buffer& dataBuffer, const size_t nValues) {
+	const auto nWorkGroups = workGroupsForValues(nValues);
+	const auto nAccumulators = nWorkGroups * maxWorkGroupSize;
+	auto reference = StatsAccumulator();
+	auto bestTime = std::chrono::microseconds::max();
+	const auto genericProgram = program;
+	for (auto variantIdx = 0ULL; variantIdx < CL_KERNEL_VARIANTS.size(); variantIdx += 1) {
+		const auto& variant = CL_KERNEL_VARIANTS[variantIdx];
+		try {
+			// Generic variant is compiled by the setup already
+			const auto variantProgram = variantIdx == 0
+				                            ? genericProgram
+				                            : compile(CL_PROGRAM, "program (" + variant.name() + ")", context,
+				                                      std::string(DEFAULT_BUILD_FLAG) + " " + variant.buildFlags());
+			auto variantKernel = cl::Kernel(variantProgram, KERNEL_NAME);
+			if (variantKernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device) < maxWorkGroupSize) {
+				log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Kernel variant " + variant.name() +
+				    " does not fit the work group size, skipping");
+				continue;
+			}
+
+			const auto variantTime = timeKernel(variantKernel, dataBuffer, nValues, maxWorkGroupSize, nWorkGroups);
+			auto accumulators = StatsAccumulatorBatch(nAccumulators);
+			const auto clStatus = commandQueue.enqueueReadBuffer(
+				bufferPool->accumulatorsDeviceBuffer(accumulators.sizeBytes()), CL_TRUE, 0, accumulators.sizeBytes(),
+				accumulators.data());
+			throwIfStatusUnsuccessful(clStatus);
+			const auto result = accumulators.mergeBlocks(1, false)[0];
+			if (variantIdx == 0) {
+				reference = result;
+			}
+
+			const auto relativeDiff = [](const double lhs, const double rhs) {
+				return std::abs(lhs - rhs) / std::max(std::abs(lhs), 1.0);
+			};
+			if (result.getN() != reference.getN() || result.getMin() != reference.getMin() ||
+				result.integerDistribution() != reference.integerDistribution() ||
+				relativeDiff(result.getMean(), reference.getMean()) > CL_CALIBRATION_TOLERANCE ||
+				relativeDiff(result.getVariance(), reference.getVariance()) > CL_CALIBRATION_TOLERANCE) {
+				log(WARNING, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Kernel variant " + variant.name() +
+				    " produced different results than the generic kernel, skipping");
+				continue;
+			}
+
+			log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Kernel variant " + variant.name() +
+			    " took " + std::to_string(variantTime.count()) + " us");
+			if (variantTime < bestTime) {
+				bestTime = variantTime;
+				kernelVariantIdx = variantIdx;
+				program = variantProgram;
+			}
+		}
+		catch (const std::exception& err) {
+			// Generic variant is the fallback, therefore it must work
+			if (variantIdx == 0) {
+				throw;
+			}
+
+			log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Kernel variant " + variant.name() +
+			    " failed: " + err.what());
+		}
+	}
+}
+
+std::chrono::microseconds ClDeviceCoordinator::tuneWorkGroups(const cl::Buffer& dataBuffer, const size_t nValues) {
+	// Work group sizes are multiples of the preferred multiple up to the limit of the kernel, the estimate of
+	// estimateWorkgroupSize is tried as well
+	const auto preferredMultiple = std::max<size_t>(
+		1, kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+	const auto workGroupSizeLimit = std::min(device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(),
+	                                         kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+	auto workGroupSizes = std::vector<size_t>{maxWorkGroupSize};
+	for (auto size = preferredMultiple; size <= workGroupSizeLimit; size *= 2) {
+		if (size != maxWorkGroupSize) {
+			workGroupSizes.push_back(size);
+		}
+	}
+
+	auto bestTime = std::chrono::microseconds::max();
+	for (const auto workGroupSize : workGroupSizes) {
+		const auto time = timeKernel(kernel, dataBuffer, nValues, workGroupSize, maxWorkGroups);
+		log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Work group size " +
+		    std::to_string(workGroupSize) + " took " + std::to_string(time.count()) + " us");
+		if (time < bestTime) {
+			bestTime = time;
+			maxWorkGroupSize = workGroupSize;
+		}
+	}
+
+	for (const auto workGroupsPerUnit : CL_TUNER_WORK_GROUPS_PER_COMPUTE_UNIT) {
+		const auto time = timeKernel(kernel, dataBuffer, nValues, maxWorkGroupSize,
+		                             nComputeUnits * workGroupsPerUnit);
+		log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] " + std::to_string(workGroupsPerUnit) +
+		    " work groups per compute unit took " + std::to_string(time.count()) + " us");
+		if (time < bestTime) {
+			bestTime = time;
+			workGroupsPerComputeUnit = workGroupsPerUnit;
+		}
+	}
+
+	maxWorkGroups = nComputeUnits * workGroupsPerComputeUnit;
+	return bestTime;
+}
+
+void ClDeviceCoordinator::tuneJobSize(const size_t kernelBytes, const std::chrono::microseconds kernelTime) {
+	// Each job pays for resetting the accumulators, the reduction and the read back regardless of its size. Jobs
+	// should be as small as possible so that the file is split evenly between the devices, but large enough to hide
+	// this overhead
+	const auto nAccumulators = maxWorkGroups * maxWorkGroupSize;
+	const auto& accumulatorsBuffer = bufferPool->accumulatorsDeviceBuffer(
+		nAccumulators * N_CL_OUT_ITEMS * sizeof(double));
+	auto jobOverhead = std::chrono::microseconds::max();
+	for (auto run = 0; run <= CL_CALIBRATION_RUNS; run += 1) {
+		auto timer = Timer();
+		timer.start();
+		reduceAccumulators(accumulatorsBuffer, nAccumulators, resetAccumulators(accumulatorsBuffer, nAccumulators));
+		timer.stop();
+		if (run > 0) {
+			jobOverhead = std::min(jobOverhead, timer.getElapsedTimeMicros());
+		}
+	}
+
+	const auto bytesPerMicro = static_cast<double>(kernelBytes) / static_cast<double>(
+		std::max<std::chrono::microseconds::rep>(1, kernelTime.count()));
+	bytesPerAccumulator = CL_TUNER_MAX_BYTES_PER_ACCUMULATOR;
+	for (auto candidate = CL_TUNER_MIN_BYTES_PER_ACCUMULATOR; candidate < CL_TUNER_MAX_BYTES_PER_ACCUMULATOR;
+	     candidate *= 2) {
+		const auto jobMicros = static_cast<double>(candidate * maxWorkGroupSize) / bytesPerMicro;
+		if (static_cast<double>(jobOverhead.count()) <= CL_TUNER_MAX_JOB_OVERHEAD * jobMicros) {
+			bytesPerAccumulator = candidate;
+			break;
+		}
+	}
+
+	log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Job overhead is " +
+	    std::to_string(jobOverhead.count()) + " us, using " + std::to_string(bytesPerAccumulator) +
+	    " bytes per accumulator");
+}
+
+void ClDeviceCoordinator::tuneHostBatchSize() {
+	// Zero-copy devices read the batches in place, there is no transfer to tune
+	hostBatchBytes = 0;
+	if (bufferPool->zeroCopy()) {
+		return;
+	}
+
+	// Small transfers are dominated by the latency of each transfer, the smallest batch which comes close to the
+	// best throughput is chosen - smaller batches overlap better and leave more memory to the rest of the application
+	const auto maxDeviceBufferSize = static_cast<size_t>(
+		static_cast<double>(device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) * BUFFER_MAX_SIZE_SCALE);
+	const auto maxBatchBytes = std::min<size_t>({
+		CL_TUNER_MAX_BATCH_BYTES, maxDeviceBufferSize,
+		std::max<size_t>(CL_TUNER_MIN_BATCH_BYTES, clHostBufferSizeBytes / CL_DATA_SLOTS)
+	});
+	if (maxBatchBytes < CL_TUNER_MIN_BATCH_BYTES) {
+		log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Device buffers are smaller than the " +
+		    "smallest tuned batch, batch size is not limited");
+		return;
+	}
+
+	// The largest batch is allocated up front and the smaller batches reuse it
+	const auto& dataBuffer = bufferPool->dataBuffer(0, maxBatchBytes);
+	auto* stagingBuffer = bufferPool->stagingBuffer(0, maxBatchBytes);
+	auto batchThroughputs = std::vector<std::pair<size_t, double>>();
+	for (auto batchBytes = CL_TUNER_MIN_BATCH_BYTES; batchBytes <= maxBatchBytes; batchBytes *= 2) {
+		const auto nTransfers = std::max<size_t>(1, CL_TUNER_TRANSFER_BYTES / batchBytes);
+
+		auto timer = Timer();
+		timer.start();
+		for (auto transfer = 0ULL; transfer < nTransfers; transfer += 1) {
+			const auto clStatus = transferQueue.enqueueWriteBuffer(dataBuffer, CL_FALSE, 0, batchBytes, stagingBuffer);
+			throwIfStatusUnsuccessful(clStatus);
+		}
+		const auto clStatus = transferQueue.finish();
+		throwIfStatusUnsuccessful(clStatus);
+		timer.stop();
+
+		const auto throughput = static_cast<double>(nTransfers * batchBytes) / static_cast<double>(
+			std::max<std::chrono::microseconds::rep>(1, timer.getElapsedTimeMicros().count()));
+		batchThroughputs.emplace_back(batchBytes, throughput);
+		log(DEBUG, "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Batch of " + std::to_string(batchBytes) +
+		    " bytes transferred at " + StatUtils::doubleToStr(throughput, 2) + " MB/s");
+	}
+
+	const auto bestThroughput = std::max_element(batchThroughputs.begin(), batchThroughputs.end(),
+	                                              [](const auto& lhs, const auto& rhs) {
+		                                              return lhs.second < rhs.second;
+	                                              })->second;
+	for (const auto& [batchBytes, throughput] : batchThroughputs) {
+		if (throughput >= CL_TUNER_BATCH_THROUGHPUT_SHARE * bestThroughput) {
+			hostBatchBytes = batchBytes;
+			break;
+		}
+	}
+}
+
+size_t ClDeviceCoordinator::workGroupsForValues(const size_t nValues) const {
+	// Each work group gets at least CL_MIN_VALUES_PER_WORK_ITEM values per work item so that small jobs do not
+	// launch thousands of empty accumulators, large jobs occupy all work groups of the device
+	const auto valuesPerWorkGroup = maxWorkGroupSize * CL_MIN_VALUES_PER_WORK_ITEM;
+	return std::clamp<size_t>((nValues + valuesPerWorkGroup - 1) / valuesPerWorkGroup, 1, maxWorkGroups);
+}
 
+void ClDeviceCoordinator::configureChunks() {
 	const auto maxDeviceBufferSize = static_cast<size_t>(static_cast<double>(device.getInfo<
 			CL_DEVICE_MAX_MEM_ALLOC_SIZE>())
 		* BUFFER_MAX_SIZE_SCALE);
 
-	// This is (ideally) divisible without remainder
-	chunksPerAccumulator = static_cast<size_t>(std::floor(
-		static_cast<double>(bytesPerAccumulator) / static_cast<double>(chunkSizeBytes)));
-
-	// Total chunks we manage to process is accumulatorsPerJob * chunksPerAccumulator
+	// Job covers at most bytesPerAccumulator bytes for each work item of a work group, the kernel reads any number
+	// of values, therefore jobs only have to consist of whole values
+	const auto chunksPerAccumulator = std::max<size_t>(1, bytesPerAccumulator / chunkSizeBytes);
 	maxNumberOfChunksPerJob = maxWorkGroupSize * chunksPerAccumulator;
+	jobGranularityChunks = std::max<size_t>(1, sizeof(double) / chunkSizeBytes);
 
 	// If we get more host memory than device memory align host memory to device memory
+	maxHostChunks = clHostBufferSizeBytes / chunkSizeBytes;
 	maxHostChunks = maxHostChunks * chunkSizeBytes > maxDeviceBufferSize
 		                ? static_cast<size_t>(std::floor(
 			                static_cast<double>(maxDeviceBufferSize) / static_cast<double>(chunkSizeBytes)))
 		                : maxHostChunks;
 
-	// Set the device type
-	if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) {
-		this->deviceType = "CPU";
+	// Host and device memory is split between the slots of the buffer pool and the coordinators sharing the device
+	maxHostChunks = std::max<size_t>(1, maxHostChunks / (CL_DATA_SLOTS * nDeviceJobs));
+
+	// Larger batches than the tuned one do not transfer any faster
+	if (hostBatchBytes > 0) {
+		maxHostChunks = std::max<size_t>(1, std::min(maxHostChunks, hostBatchBytes / chunkSizeBytes));
 	}
 }
 
+void ClDeviceCoordinator::prepareRun(const std::vector<FileSegment>& fileSegments, const fs::path& keyFilePath,
+                                     const size_t runChunkSizeBytes) {
+	// Context, queue and the compiled program are kept, only the limits depending on the chunk size change
+	DeviceCoordinator::prepareRun(fileSegments, keyFilePath, runChunkSizeBytes);
+	configureChunks();
+}
+
 void ClDeviceCoordinator::throwIfStatusUnsuccessful(const cl_int clStatus) const {
 	if (clStatus != CL_SUCCESS) {
 		log(CRITICAL, "OpenCL error occurred. Error: " + std::to_string(clStatus));
@@ -117,43 +557,119 @@ void ClDeviceCoordinator::estimateWorkgroupSize() {
 }
 
 // ReSharper disable once CppMemberFunctionMayBeConst
-auto ClDeviceCoordinator::performJobSetup(cl_int& clStatus) {
-	// Get total number of accumulators
-	auto nAccumulators = currentJob->getNChunks() / chunksPerAccumulator;
-
-	// Get total number of workgroup runs
-	auto totalBytes = nAccumulators * bytesPerAccumulator;
-	if (nAccumulators == 0 && currentJob->getSizeBytes(chunkSizeBytes) < chunksPerAccumulator * chunkSizeBytes) {
-		// Our file is smaller than chunksPerAccumulator - therefore we only run one work item in one workgroup
-		nAccumulators = 1;
-		totalBytes = currentJob->getSizeBytes(chunkSizeBytes);
+std::vector<cl::Event> ClDeviceCoordinator::resetAccumulators(const cl::Buffer& accumulatorsBuffer,
+                                                              const size_t nAccumulators) {
+	// Accumulators of the fp32 kernel are all zero when empty, the count included
+	if (useFp32) {
+		auto resetEvents = std::vector<cl::Event>(1);
+		const auto clStatus = commandQueue.enqueueFillBuffer(accumulatorsBuffer, 0.0f, 0,
+		                                                     nAccumulators * N_CL_FP32_FIELDS * sizeof(float),
+		                                                     nullptr, &resetEvents[0]);
+		throwIfStatusUnsuccessful(clStatus);
+		return resetEvents;
 	}
 
+	// Accumulators are reset on the device instead of uploading empty ones - moments and the item count are zero,
+	// integer flag is set and the minimum is infinity (the layout of StatsAccumulatorBatch)
+	const auto fieldSizeBytes = nAccumulators * sizeof(double);
+	auto resetEvents = std::vector<cl::Event>(3);
+	auto clStatus = commandQueue.enqueueFillBuffer(accumulatorsBuffer, 0.0, N_ITEMS_IDX * fieldSizeBytes,
+	                                               INTEGER_ONLY_IDX * fieldSizeBytes, nullptr, &resetEvents[0]);
+	throwIfStatusUnsuccessful(clStatus);
+	clStatus = commandQueue.enqueueFillBuffer(accumulatorsBuffer, 1.0, INTEGER_ONLY_IDX * fieldSizeBytes,
+	                                          fieldSizeBytes, nullptr, &resetEvents[1]);
+	throwIfStatusUnsuccessful(clStatus);
+	clStatus = commandQueue.enqueueFillBuffer(accumulatorsBuffer, std::numeric_limits<double>::infinity(),
+	                                          MIN_IDX * fieldSizeBytes, fieldSizeBytes, nullptr, &resetEvents[2]);
+	throwIfStatusUnsuccessful(clStatus);
+	return resetEvents;
+}
+
+auto ClDeviceCoordinator::performJobSetup() {
+	// Only whole values are processed - chunks of small files are single bytes
+	const auto totalBytes = currentJob->getSizeBytes(chunkSizeBytes) / sizeof(double) * sizeof(double);
+
+	const auto nWorkGroups = workGroupsForValues(totalBytes / sizeof(double));
+	const auto nAccumulators = nWorkGroups * maxWorkGroupSize;
+
 	log(DEBUG,
 	    "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Job split into " + std::to_string(nAccumulators) +
-	    " accumulators");
-	// Create buffer for results
-	const auto accumulatorsBuffer = cl::Buffer(context, CL_MEM_READ_WRITE,
-	                                           nAccumulators * N_CL_OUT_ITEMS * sizeof(double), nullptr,
-	                                           &clStatus);
-	throwIfStatusUnsuccessful(clStatus);
+	    " accumulators in " + std::to_string(nWorkGroups) + " work groups");
+	// Buffers come from the pool - they are only allocated if this job needs more memory than any job before
+	const auto& accumulatorsBuffer = bufferPool->accumulatorsDeviceBuffer(
+		useFp32 ? nAccumulators * N_CL_FP32_FIELDS * sizeof(float) : nAccumulators * N_CL_OUT_ITEMS * sizeof(double));
 
-	// Write true values for isInteger only
-	auto accumulatorData = std::vector<double>(nAccumulators * N_CL_OUT_ITEMS, 0.0);
-	for (auto i = 0ULL; i < nAccumulators; i += 1) {
-		accumulatorData[i * N_CL_OUT_ITEMS + INTEGER_ONLY_IDX] = static_cast<double>(true);
-		accumulatorData[i * N_CL_OUT_ITEMS + MIN_IDX] = std::numeric_limits<double>::infinity();
+	const auto resetEvents = resetAccumulators(accumulatorsBuffer, nAccumulators);
+	return std::make_tuple(nAccumulators, totalBytes, accumulatorsBuffer, resetEvents);
+}
+
+void ClDeviceCoordinator::recordEventTime(const PipelineStage stage, const cl::Event& first, const cl::Event& last) {
+	if constexpr (STAGE_PROFILING_ENABLED) {
+		const auto startNanos = first.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		const auto endNanos = last.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		stageProfiler.record(stage, static_cast<int64_t>(endNanos) - static_cast<int64_t>(startNanos));
 	}
+}
 
-	clStatus = commandQueue.enqueueWriteBuffer(accumulatorsBuffer, CL_TRUE, 0, accumulatorData.size() * sizeof(double),
-	                                           accumulatorData.data());
+StatsAccumulatorBatch ClDeviceCoordinator::readFp32Accumulators(const cl::Buffer& accumulatorsBuffer,
+                                                                const size_t nAccumulators,
+                                                                const std::vector<cl::Event>& dependencies) {
+	auto accumulators = std::vector<float>(nAccumulators * N_CL_FP32_FIELDS);
+	auto readEvent = cl::Event();
+	const auto clStatus = commandQueue.enqueueReadBuffer(accumulatorsBuffer, CL_TRUE, 0,
+	                                                     accumulators.size() * sizeof(float), accumulators.data(),
+	                                                     &dependencies, &readEvent);
 	throwIfStatusUnsuccessful(clStatus);
+	recordEventTime(STAGE_TRANSFER, readEvent, readEvent);
+
+	// Promoted accumulators are merged by the host the same way as the results of the CPU coordinators
+	auto mergeTimer = ScopedStageTimer(stageProfiler, STAGE_MERGE);
+	return fp32Converter.promote(accumulators, nAccumulators);
+}
+
+StatsAccumulatorBatch ClDeviceCoordinator::reduceAccumulators(const cl::Buffer& accumulatorsBuffer,
+                                                              const size_t nAccumulators,
+                                                              const std::vector<cl::Event>& dependencies) {
+	// First pass merges the accumulators into one partial result per work group, at most one per work item of the
+	// second pass, which merges the partial results into the final accumulator
+	const auto nPartials = std::clamp<size_t>((nAccumulators + reduceWorkGroupSize - 1) / reduceWorkGroupSize, 1,
+	                                          std::min(maxWorkGroups, reduceWorkGroupSize));
+	const auto localScratch = cl::Local(N_CL_OUT_ITEMS * sizeof(double) * reduceWorkGroupSize);
+	auto passInput = accumulatorsBuffer;
+	auto passInputItems = nAccumulators;
+	auto passDependencies = dependencies;
+	auto reduceEvents = std::vector<cl::Event>();
+	// Single partial result is already final, therefore the second pass is skipped if the first pass produced one
+	for (auto pass = 0ULL; pass < 2 && passInputItems > 1; pass += 1) {
+		const auto nGroups = pass == 0 ? nPartials : 1;
+		const auto& passOutput = bufferPool->reductionDeviceBuffer(pass, nGroups * N_CL_OUT_ITEMS * sizeof(double));
+		reduceKernel.setArg(0, passInput);
+		reduceKernel.setArg(1, static_cast<cl_ulong>(passInputItems));
+		reduceKernel.setArg(2, passOutput);
+		reduceKernel.setArg(3, localScratch);
+
+		auto reduceEvent = cl::Event();
+		const auto clStatus = commandQueue.enqueueNDRangeKernel(reduceKernel, cl::NullRange,
+		                                                        cl::NDRange(nGroups * reduceWorkGroupSize),
+		                                                        cl::NDRange(reduceWorkGroupSize), &passDependencies,
+		                                                        &reduceEvent);
+		throwIfStatusUnsuccessful(clStatus);
+		reduceEvents.push_back(reduceEvent);
+
+		passInput = passOutput;
+		passInputItems = nGroups;
+		passDependencies = {reduceEvent};
+	}
 
-	// Create buffer for data
-	const auto dataBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, maxHostChunks * chunkSizeBytes, nullptr, &clStatus);
+	auto result = StatsAccumulatorBatch(1);
+	auto readEvent = cl::Event();
+	const auto clStatus = commandQueue.enqueueReadBuffer(passInput, CL_TRUE, 0, result.sizeBytes(), result.data(),
+	                                                     &passDependencies, &readEvent);
 	throwIfStatusUnsuccessful(clStatus);
 
-	return std::make_tuple(nAccumulators, totalBytes, accumulatorsBuffer, dataBuffer, accumulatorData);
+	// Merge spans both passes and the read of the merged accumulator
+	recordEventTime(STAGE_MERGE, reduceEvents.empty() ? readEvent : reduceEvents.front(), readEvent);
+	return result;
 }
 
 
@@ -162,74 +678,137 @@ void ClDeviceCoordinator::onProcessJob() {
 	    std::to_string(currentJob->Id));
 
 	auto clStatus = cl_int{};
+	const auto nAllocationsBefore = bufferPool->getNAllocations();
 	auto [
 		nAccumulators,
 		totalBytes,
 		accumulatorsBuffer,
-		dataBuffer,
-		accumulatorData
-	] = performJobSetup(clStatus);
-
-	// Load the kernel
-	auto kernel = cl::Kernel(program, KERNEL_NAME);
+		resetEvents
+	] = performJobSetup();
+	fp32Converter.reset();
+
+	// Batches rotate through the slots of the buffer pool - while the device transfers and computes the previous
+	// batches, the host already reads the next one into the staging buffer of the next slot. This overlap of host
+	// reading with the device is what the slots guarantee. Transfers and kernels are in separate queues, but they
+	// run concurrently only if the device has a copy engine - otherwise the device executes them one after another.
+	// Slot can be refilled once the kernel which read it has finished, the kernel itself waits for the transfer of
+	// its batch and for the previous kernel which updated the same accumulators
+	auto kernelEvents = std::array<cl::Event, CL_DATA_SLOTS>();
+	auto nBatches = 0ULL;
+
+	// Transfers and kernels are timed by the device, their timestamps are read once the whole job is done
+	auto profiledEvents = std::vector<std::pair<PipelineStage, cl::Event>>();
+
+	// Batches are contiguous ranges of the job, uploaded unchanged or converted in place for the fp32 kernel - each
+	// value becomes a pair of floats of the same size
+	const auto batchSizeBytes = std::max(sizeof(double),
+	                                     maxHostChunks * chunkSizeBytes / sizeof(double) * sizeof(double));
 
 	// Run the computation
 	auto bytesRemaining = totalBytes;
-	auto bytesProcessedPerAccumulator = 0ULL;
+	auto bytesProcessed = 0ULL;
 	const auto [startIdx, _] = currentJob->ChunkIdxRange;
 	while (bytesRemaining > 0) {
-		// Load either max size of the buffer if there is too much data to load or the remaining data
-		const auto chunksToLoad = bytesRemaining > maxHostChunks * chunkSizeBytes
-			                          ? maxHostChunks // buffer size is maxHostChunks * chunkSizeBytes
-			                          : bytesRemaining / chunkSizeBytes; // or something smaller
+		const auto slot = nBatches % CL_DATA_SLOTS;
+		if (nBatches >= CL_DATA_SLOTS) {
+			clStatus = kernelEvents[slot].wait();
+			throwIfStatusUnsuccessful(clStatus);
+		}
 
-		// Load chunks "into the device" - or rather schedule to do so via OpenCL
-		dataLoader.loadChunksIntoDeviceBuffer(nAccumulators, chunksToLoad, startIdx, bytesProcessedPerAccumulator,
-		                                bytesPerAccumulator,
-		                                dataBuffer, commandQueue);
+		const auto bytesToLoad = std::min(bytesRemaining, batchSizeBytes);
+
+		// Load chunks into the staging buffer and schedule the transfer to the device. Zero-copy device reads the
+		// memory of the host directly, therefore the chunks are loaded straight into the mapped buffer and unmapping
+		// hands it over to the device
+		const auto& dataBuffer = bufferPool->dataBuffer(slot, maxHostChunks * chunkSizeBytes);
+		const auto loadIntoHostBuffer = [&](double* hostBuffer) {
+			{
+				auto readTimer = ScopedStageTimer(stageProfiler, STAGE_READ);
+				dataLoader.loadChunksIntoHostBuffer(startIdx, bytesProcessed, bytesToLoad, hostBuffer,
+				                                    jobHistograms[0]);
+			}
+
+			if (useFp32) {
+				auto convertTimer = ScopedStageTimer(stageProfiler, STAGE_ACCUMULATE);
+				fp32Converter.convert(hostBuffer, bytesToLoad / sizeof(double));
+			}
+		};
 
-		// Amount of items is the number of bytes to load divided by the number of accumulators and the size of double (i.e. 8 bytes)
-		const auto itemsToProcess = (chunksToLoad * chunkSizeBytes) / nAccumulators / sizeof(double);
+		auto transferEvent = cl::Event();
+		if (bufferPool->zeroCopy()) {
+			loadIntoHostBuffer(bufferPool->mapDataBuffer(slot, maxHostChunks * chunkSizeBytes));
+			bufferPool->unmapDataBuffer(slot, transferEvent);
+		}
+		else if (useFp32) {
+			auto* stagingBuffer = bufferPool->stagingBuffer(slot, maxHostChunks * chunkSizeBytes);
+			loadIntoHostBuffer(stagingBuffer);
+			clStatus = transferQueue.enqueueWriteBuffer(dataBuffer, CL_FALSE, 0, bytesToLoad, stagingBuffer, nullptr,
+			                                            &transferEvent);
+			throwIfStatusUnsuccessful(clStatus);
+		}
+		else {
+			auto* stagingBuffer = bufferPool->stagingBuffer(slot, maxHostChunks * chunkSizeBytes);
+			auto readTimer = ScopedStageTimer(stageProfiler, STAGE_READ);
+			dataLoader.loadChunksIntoDeviceBuffer(startIdx, bytesProcessed, bytesToLoad, dataBuffer, stagingBuffer,
+			                                      transferQueue, jobHistograms[0], transferEvent);
+		}
 
-		// Pass args to the kernel
+		// Pass args to the kernel - the work items stride over all values of the batch
 		kernel.setArg(0, dataBuffer);
 		kernel.setArg(1, accumulatorsBuffer);
-		kernel.setArg(2, itemsToProcess);
+		kernel.setArg(2, static_cast<cl_ulong>(bytesToLoad / sizeof(double)));
 
-		// Schedule to execute the kernel
+		// Schedule to execute the kernel once its data are on the device
+		auto kernelDependencies = std::vector<cl::Event>{transferEvent};
+		if (nBatches > 0) {
+			kernelDependencies.push_back(kernelEvents[(nBatches - 1) % CL_DATA_SLOTS]);
+		}
+		else {
+			kernelDependencies.insert(kernelDependencies.end(), resetEvents.begin(), resetEvents.end());
+		}
 		clStatus = commandQueue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(nAccumulators),
-		                                             cl::NDRange(nAccumulators));
+		                                             cl::NDRange(maxWorkGroupSize), &kernelDependencies,
+		                                             &kernelEvents[slot]);
 		throwIfStatusUnsuccessful(clStatus);
+		if constexpr (STAGE_PROFILING_ENABLED) {
+			profiledEvents.emplace_back(STAGE_TRANSFER, transferEvent);
+			profiledEvents.emplace_back(STAGE_KERNEL, kernelEvents[slot]);
+		}
 
-		const auto bytesProcessed = chunksToLoad * chunkSizeBytes;
-		bytesRemaining -= bytesProcessed;
-		bytesProcessedPerAccumulator += bytesProcessed / nAccumulators;
-		notifyWatchdogCallback(chunksToLoad * chunkSizeBytes);
-	}
+		// Mapping is queued behind the kernel, so the host gets the buffer back as soon as the kernel is done
+		if (bufferPool->zeroCopy()) {
+			bufferPool->mapDataBufferAfter(slot, kernelEvents[slot]);
+		}
 
-	// Read out the results
-	clStatus = commandQueue.enqueueReadBuffer(accumulatorsBuffer, CL_TRUE, 0, accumulatorData.size() * sizeof(double),
-	                                          accumulatorData.data());
-	throwIfStatusUnsuccessful(clStatus);
+		// Both queues are flushed - each waits for events of the other one
+		clStatus = transferQueue.flush();
+		throwIfStatusUnsuccessful(clStatus);
+		clStatus = commandQueue.flush();
+		throwIfStatusUnsuccessful(clStatus);
 
-	// Map the results
-	auto results = std::vector<StatsAccumulator>(nAccumulators);
-	for (auto workerId = 0ULL; workerId < nAccumulators; workerId += 1) {
-		const auto offset = workerId * N_CL_OUT_ITEMS;
-		results[workerId] = {
-			static_cast<size_t>(accumulatorData[offset]),
-			accumulatorData[offset + M1_IDX],
-			accumulatorData[offset + M2_IDX],
-			accumulatorData[offset + M3_IDX],
-			accumulatorData[offset + M4_IDX],
-			static_cast<bool>(accumulatorData[offset + INTEGER_ONLY_IDX]),
-			accumulatorData[offset + MIN_IDX],
-		};
+		bytesRemaining -= bytesToLoad;
+		bytesProcessed += bytesToLoad;
+		nBatches += 1;
+		notifyWatchdogCallback(bytesToLoad);
 	}
 
-	currentJob->Items = results;
+	// Accumulators are merged on the device and only the merged one is read back - this is the only point where the
+	// host waits for the whole job. Accumulators of the fp32 kernel are promoted on the host instead
+	const auto reduceDependencies = nBatches > 0
+		                                ? std::vector<cl::Event>{kernelEvents[(nBatches - 1) % CL_DATA_SLOTS]}
+		                                : resetEvents;
+	currentJob->Items = useFp32
+		                    ? readFp32Accumulators(accumulatorsBuffer, nAccumulators, reduceDependencies)
+		                    : reduceAccumulators(accumulatorsBuffer, nAccumulators, reduceDependencies);
+	for (const auto& [stage, event] : profiledEvents) {
+		recordEventTime(stage, event, event);
+	}
 	log(DEBUG,
 	    "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Finished computing job with id " +
 	    std::to_string(currentJob->Id) + ". Computed " + std::to_string(
 		    currentJob->getNChunks()) + " chunks. Chunk size is " + std::to_string(chunkSizeBytes) + " bytes");
+	log(DEBUG,
+	    "[OPENCL - " + deviceName + " (" + deviceType + ")" + "] Buffer pool allocations: " + std::to_string(
+		    bufferPool->getNAllocations()) + " in total, " + std::to_string(
+		    bufferPool->getNAllocations() - nAllocationsBefore) + " in this job");
 }
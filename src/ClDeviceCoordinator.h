@@ -1,28 +1,72 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <filesystem>
 #include <stdexcept>
 #include <string>
 
+#include "ClBufferPool.h"
+#include "ClDeviceProfile.h"
+#include "ClFp32Converter.h"
+#include "ClKernelVariant.h"
 #include "DeviceCoordinator.h"
 
 namespace fs = std::filesystem;
 
 constexpr auto BUFFER_MAX_SIZE_SCALE = .9;
 constexpr auto KERNEL_NAME = "computeStats";
+constexpr auto REDUCE_KERNEL_NAME = "reduceStats";
 // 80% of video memory is used for computation (or rather 90% of what OpenCL returns)
 
 constexpr auto DEFAULT_BUILD_FLAG = "-cl-std=CL2.0";
 
-constexpr auto N_CL_OUT_ITEMS = 7;
-// Indices in the array
-constexpr auto N_ITEMS_IDX = 0;
-constexpr auto M1_IDX = 1;
-constexpr auto M2_IDX = 2;
-constexpr auto M3_IDX = 3;
-constexpr auto M4_IDX = 4;
-constexpr auto INTEGER_ONLY_IDX = 5;
-constexpr auto MIN_IDX = 6;
+// Devices without double precision often only support OpenCL 1.2, which is all the fp32 kernel needs
+constexpr auto FP32_BUILD_FLAG = "-cl-std=CL1.2";
+
+// Number of work groups launched for each compute unit of the device
+constexpr auto CL_WORK_GROUPS_PER_COMPUTE_UNIT = 4;
+
+// Minimum number of values per work item - smaller jobs are processed by fewer work groups
+constexpr auto CL_MIN_VALUES_PER_WORK_ITEM = 1024ULL;
+
+// Number of batches that can be in flight at once - the host reads the next batch while the device works on the
+// previous one. Transfer of a batch overlaps the kernel of the previous one only on devices with a copy engine
+constexpr auto CL_DATA_SLOTS = 2;
+
+// Number of values of the synthetic buffer the device is tuned on
+constexpr auto CL_CALIBRATION_VALUES = 8ULL * 1024 * 1024;
+
+// Number of timed runs of each tuned configuration, the fastest one counts. One more untimed run warms the device up
+constexpr auto CL_CALIBRATION_RUNS = 3;
+
+// Every CL_CALIBRATION_INVALID_PERIOD-th calibration value is NaN, so that the filtering of the variants is exercised
+constexpr auto CL_CALIBRATION_INVALID_PERIOD = 97ULL;
+
+// Maximum relative difference of the mean and variance of a variant from the generic kernel - vector variants sum
+// the values in a different order, so they only differ by rounding
+constexpr auto CL_CALIBRATION_TOLERANCE = 1e-9;
+
+// Numbers of work groups per compute unit tried by the tuner
+constexpr auto CL_TUNER_WORK_GROUPS_PER_COMPUTE_UNIT = std::array<size_t, 5>{1, 2, 4, 8, 16};
+
+// Range of bytes per accumulator tried by the tuner, the size of a job is this times the work group size
+constexpr auto CL_TUNER_MIN_BYTES_PER_ACCUMULATOR = 64ULL * 1024;
+constexpr auto CL_TUNER_MAX_BYTES_PER_ACCUMULATOR = 64ULL * 1024 * 1024;
+
+// Maximum share of the fixed cost of a job (reset, reduction and read back) in the time of the whole job
+constexpr auto CL_TUNER_MAX_JOB_OVERHEAD = 0.01;
+
+// Range of host batch sizes tried by the tuner and the amount of data transferred for each of them
+constexpr auto CL_TUNER_MIN_BATCH_BYTES = 1ULL * 1024 * 1024;
+constexpr auto CL_TUNER_MAX_BATCH_BYTES = 256ULL * 1024 * 1024;
+constexpr auto CL_TUNER_TRANSFER_BYTES = 256ULL * 1024 * 1024;
+
+// Smallest batch whose throughput is at least this share of the best one is used
+constexpr auto CL_TUNER_BATCH_THROUGHPUT_SHARE = 0.95;
+
+// Kernel writes the accumulators in the StatsAccumulatorBatch layout - field f of work item i is at f * nWorkItems + i
+constexpr auto N_CL_OUT_ITEMS = N_BATCH_FIELDS;
 
 /**
  * \brief Custom error for control flow
@@ -47,21 +91,47 @@ public:
 		const std::function<void(std::unique_ptr<Job>, size_t)>& jobFinishedCallback,
 		const std::function<void(size_t)>& notifyWatchdogCallback,
 		const std::function<void(CoordinatorErr)>& errCallback,
+		const std::function<std::unique_ptr<Job>(size_t)>& claimJobCallback,
 		size_t chunkSizeBytes,
 		size_t bytesPerAccumulator,
 		size_t clHostBufferSizeBytes,
 		fs::path& distFilePath,
 		size_t id,
-		cl::Device device);
+		cl::Device device,
+		ClPrecision clPrecision,
+		size_t nDeviceJobs);
+
+	/**
+	 * \brief Recomputes the limits that depend on the chunk size, the compiled program is reused
+	 * \param fileSegments files that are processed in the next run and their chunks
+	 * \param keyFilePath path to the file with keys, not used by OpenCL devices
+	 * \param runChunkSizeBytes chunk size in bytes for the files
+	 */
+	void prepareRun(const std::vector<FileSegment>& fileSegments, const fs::path& keyFilePath,
+	                size_t runChunkSizeBytes) override;
 
 private:
 	cl::Device device; // The actual device
 	cl::Context context; // Cl context
-	cl::CommandQueue commandQueue;
+	cl::CommandQueue commandQueue; // Queue for the kernels, resets and reads of the results
+	cl::CommandQueue transferQueue; // Queue for the transfers and mapping of the data, runs next to the kernels
 	cl::Program program; // Compiled program
+	cl::Kernel kernel; // Kernel of the program, created once and reused by all jobs
+	cl::Kernel reduceKernel; // Kernel merging the accumulators of a job on the device
+	std::unique_ptr<ClBufferPool> bufferPool; // Device and staging buffers reused by all jobs
 	size_t maxWorkGroupSize{}; // Max number of work items in a work group
+	size_t maxWorkGroups{}; // Max number of work groups of a single kernel launch
+	size_t reduceWorkGroupSize{}; // Number of work items of a work group of the reduce kernel
+	size_t kernelVariantIdx = 0; // Index of the kernel variant in CL_KERNEL_VARIANTS
+	size_t nComputeUnits = 1; // Number of compute units of the device
+	size_t workGroupsPerComputeUnit = CL_WORK_GROUPS_PER_COMPUTE_UNIT; // Max number of work groups per compute unit
+	size_t hostBatchBytes = 0; // Max size of a single transfer to the device, 0 if not limited
+	ClPrecision clPrecision; // Requested precision of the computation
+	size_t nDeviceJobs; // Number of coordinators processing jobs on the same device, they share its memory
+	bool useFp32 = false; // Whether the device runs the compensated fp32 kernel
+	ClFp32Converter fp32Converter; // Converts the batches for the fp32 kernel and promotes its accumulators
+	size_t clHostBufferSizeBytes; // Maximum size of the host buffer
 	size_t maxHostChunks;
-	size_t chunksPerAccumulator{};
 	std::string deviceName;
 	std::string deviceType = "GPU";
 
@@ -70,9 +140,90 @@ private:
 	 * \param source string containing source code to be compiled
 	 * \param programName name of the program
 	 * \param deviceContext device context
+	 * \param buildFlags build flags of the program
 	 * \return cl::Program instance or throws ClCompileErr if the program cannot be compiled
 	 */
-	auto compile(const std::string& source, const std::string& programName, const cl::Context& deviceContext) const;
+	auto compile(const std::string& source, const std::string& programName, const cl::Context& deviceContext,
+	             const std::string& buildFlags) const;
+
+	/**
+	 * \brief Creates the kernels of the program and sets up the launch configuration of the reduce kernel
+	 */
+	void createKernels();
+
+	/**
+	 * \brief Switches the device to the stored profile
+	 * \param profile stored profile
+	 * \return true if the profile was applied, false if it does not fit the device and the device must be tuned
+	 */
+	bool applyProfile(const ClDeviceProfile& profile);
+
+	/**
+	 * \brief Returns the current launch configuration as a profile
+	 * \return profile of the device
+	 */
+	[[nodiscard]] ClDeviceProfile currentProfile() const;
+
+	/**
+	 * \brief Tunes the kernel variant, work groups, job size and host batch size on a synthetic buffer. Buffers of the
+	 *		  sweep come from a temporary pool, the pool of the jobs is left untouched
+	 */
+	void tuneDevice();
+
+	/**
+	 * \brief Measures the kernel on the data buffer, the fastest of CL_CALIBRATION_RUNS runs counts
+	 * \param timedKernel measured kernel
+	 * \param dataBuffer buffer with the values
+	 * \param nValues number of values in the buffer
+	 * \param workGroupSize number of work items of a work group
+	 * \param nWorkGroups number of work groups
+	 * \return time of the kernel
+	 */
+	std::chrono::microseconds timeKernel(cl::Kernel& timedKernel, const cl::Buffer& dataBuffer, size_t nValues,
+	                                     size_t workGroupSize, size_t nWorkGroups);
+
+	/**
+	 * \brief Runs every kernel variant on the data buffer and switches the program to the fastest one whose
+	 *		  results match the generic kernel. Variants which fail to compile or produce different results are skipped
+	 * \param dataBuffer buffer with the synthetic values
+	 * \param nValues number of values in the buffer
+	 */
+	void calibrateKernelVariant(const cl::Buffer& dataBuffer, size_t nValues);
+
+	/**
+	 * \brief Chooses the fastest work group size and then the fastest number of work groups per compute unit
+	 * \param dataBuffer buffer with the synthetic values
+	 * \param nValues number of values in the buffer
+	 * \return time of the kernel with the chosen configuration
+	 */
+	std::chrono::microseconds tuneWorkGroups(const cl::Buffer& dataBuffer, size_t nValues);
+
+	/**
+	 * \brief Chooses the smallest job size whose fixed cost is negligible compared to the computation
+	 * \param kernelBytes number of bytes processed by the kernel in kernelTime
+	 * \param kernelTime time of the kernel with the chosen configuration
+	 */
+	void tuneJobSize(size_t kernelBytes, std::chrono::microseconds kernelTime);
+
+	/**
+	 * \brief Chooses the smallest host batch size which transfers close to the best throughput
+	 */
+	void tuneHostBatchSize();
+
+	/**
+	 * \brief Schedules reset of the accumulators to the empty state
+	 * \param accumulatorsBuffer buffer with the accumulators
+	 * \param nAccumulators number of accumulators in the buffer
+	 * \return events of the reset
+	 */
+	std::vector<cl::Event> resetAccumulators(const cl::Buffer& accumulatorsBuffer, size_t nAccumulators);
+
+	/**
+	 * \brief Returns number of work groups processing given number of values
+	 * \param nValues number of values
+	 * \return number of work groups
+	 */
+	[[nodiscard]] size_t workGroupsForValues(size_t nValues) const;
 
 	/**
 	 * \brief Sets up the device, throwing ClCompileErr if something goes wrong
@@ -86,12 +237,50 @@ private:
 	 */
 	void estimateWorkgroupSize();
 
+	/**
+	 * \brief Computes the maximum job size, job granularity and host buffer size for the current chunk size
+	 */
+	void configureChunks();
+
 	/**
 	 * \brief Sets up job for processing
-	 * \param clStatus status of the OpenCL operation
 	 * \return tuple of values for setup
 	 */
-	auto performJobSetup(cl_int& clStatus);
+	auto performJobSetup();
+
+	/**
+	 * \brief Sets up the compensated fp32 kernel - it is neither tuned nor reduced on the device
+	 */
+	void setupFp32();
+
+	/**
+	 * \brief Reads the accumulators of the fp32 kernel and promotes them to regular accumulators
+	 * \param accumulatorsBuffer buffer with the accumulators
+	 * \param nAccumulators number of accumulators in the buffer
+	 * \param dependencies events after which the accumulators are final
+	 * \return batch with the promoted accumulators
+	 */
+	StatsAccumulatorBatch readFp32Accumulators(const cl::Buffer& accumulatorsBuffer, size_t nAccumulators,
+	                                           const std::vector<cl::Event>& dependencies);
+
+	/**
+	 * \brief Records time between the start of the first and the end of the last command as latency of the stage,
+	 *		  does nothing unless profiling is compiled in. Both commands must be complete
+	 * \param stage pipeline stage
+	 * \param first event of the first command
+	 * \param last event of the last command
+	 */
+	void recordEventTime(PipelineStage stage, const cl::Event& first, const cl::Event& last);
+
+	/**
+	 * \brief Merges the accumulators of the job on the device, so that only a single accumulator is read back
+	 * \param accumulatorsBuffer buffer with the accumulators
+	 * \param nAccumulators number of accumulators in the buffer
+	 * \param dependencies events after which the accumulators are final
+	 * \return batch with the merged accumulator
+	 */
+	StatsAccumulatorBatch reduceAccumulators(const cl::Buffer& accumulatorsBuffer, size_t nAccumulators,
+	                                         const std::vector<cl::Event>& dependencies);
 
 protected:
 	/**
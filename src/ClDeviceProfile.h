@@ -0,0 +1,143 @@
+#pragma once
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include "ClConfig.h"
+#include "ClProgramCache.h"
+
+namespace fs = std::filesystem;
+
+/**
+ * \brief Launch configuration of an OpenCL device found by the auto-tuner
+ */
+struct ClDeviceProfile {
+	size_t KernelVariantIdx = 0; // index of the kernel variant in CL_KERNEL_VARIANTS
+	size_t WorkGroupSize = 0; // number of work items of a work group
+	size_t WorkGroupsPerComputeUnit = 0; // max number of work groups launched for each compute unit
+	size_t BytesPerAccumulator = 0; // number of bytes of a job for each work item of a work group
+	size_t HostBatchBytes = 0; // max size of a single transfer to the device, 0 if not limited
+};
+
+namespace ClDeviceProfiles {
+
+	// Name of the profile directory in the temporary directory of the system
+	constexpr auto PROFILE_DIR_NAME = "pprsolver_cl_profiles";
+
+	// First line of each profile file - bump the version if the format of the file or the meaning of a value changes
+	constexpr auto PROFILE_FILE_MAGIC = "PPRCLPROFILE 1";
+
+	/**
+	 * \brief Builds key of the profile - the profile is only valid for the same device, driver and kernel source
+	 * \param device profiled device
+	 * \param source source code of the program
+	 * \return key of the profile
+	 */
+	inline std::string buildKey(const cl::Device& device, const std::string& source) {
+		// Build flags differ by the kernel variant, which is a part of the profile itself
+		return ClProgramCache::buildKey(device, "", source);
+	}
+
+	/**
+	 * \brief Returns path of the profile file for the key
+	 * \param key key of the profile
+	 * \return path of the profile file
+	 */
+	inline fs::path profileFilePath(const std::string& key) {
+		auto fileName = std::stringstream();
+		fileName << std::hex << ClProgramCache::fnv1a(key) << ".txt";
+		return fs::temp_directory_path() / PROFILE_DIR_NAME / fileName.str();
+	}
+
+	/**
+	 * \brief Loads the profile of the device
+	 * \param key key of the profile
+	 * \return profile, empty if the device was not profiled yet or the file belongs to a different key
+	 */
+	inline std::optional<ClDeviceProfile> load(const std::string& key) {
+		auto errorCode = std::error_code();
+		const auto filePath = profileFilePath(key);
+		if (!fs::exists(filePath, errorCode)) {
+			return std::nullopt;
+		}
+
+		auto file = std::ifstream(filePath);
+		auto magic = std::string();
+		auto storedKey = std::string();
+		if (!std::getline(file, magic) || magic != PROFILE_FILE_MAGIC || !std::getline(file, storedKey) ||
+			storedKey != key) {
+			return std::nullopt;
+		}
+
+		auto profile = ClDeviceProfile();
+		auto name = std::string();
+		auto value = size_t{};
+		while (file >> name >> value) {
+			if (name == "kernel_variant") {
+				profile.KernelVariantIdx = value;
+			}
+			else if (name == "work_group_size") {
+				profile.WorkGroupSize = value;
+			}
+			else if (name == "work_groups_per_compute_unit") {
+				profile.WorkGroupsPerComputeUnit = value;
+			}
+			else if (name == "bytes_per_accumulator") {
+				profile.BytesPerAccumulator = value;
+			}
+			else if (name == "host_batch_bytes") {
+				profile.HostBatchBytes = value;
+			}
+		}
+
+		if (profile.WorkGroupSize == 0 || profile.WorkGroupsPerComputeUnit == 0 || profile.BytesPerAccumulator == 0) {
+			return std::nullopt;
+		}
+
+		return profile;
+	}
+
+	/**
+	 * \brief Stores the profile of the device. The file is written under a temporary name and renamed, so that
+	 *		  concurrently running processes never read a partially written profile. Failures are ignored, the device
+	 *		  is simply tuned again next time
+	 * \param key key of the profile
+	 * \param profile profile of the device
+	 * \return true if the profile was stored
+	 */
+	inline bool store(const std::string& key, const ClDeviceProfile& profile) {
+		auto errorCode = std::error_code();
+		const auto filePath = profileFilePath(key);
+		fs::create_directories(filePath.parent_path(), errorCode);
+		if (errorCode) {
+			return false;
+		}
+
+		auto tmpFilePath = filePath;
+		tmpFilePath += "." + std::to_string(std::random_device()()) + ".tmp";
+		{
+			auto file = std::ofstream(tmpFilePath);
+			file << PROFILE_FILE_MAGIC << "\n" << key << "\n"
+				<< "kernel_variant " << profile.KernelVariantIdx << "\n"
+				<< "work_group_size " << profile.WorkGroupSize << "\n"
+				<< "work_groups_per_compute_unit " << profile.WorkGroupsPerComputeUnit << "\n"
+				<< "bytes_per_accumulator " << profile.BytesPerAccumulator << "\n"
+				<< "host_batch_bytes " << profile.HostBatchBytes << "\n";
+			if (!file) {
+				fs::remove(tmpFilePath, errorCode);
+				return false;
+			}
+		}
+
+		fs::rename(tmpFilePath, filePath, errorCode);
+		if (errorCode) {
+			fs::remove(tmpFilePath, errorCode);
+			return false;
+		}
+
+		return true;
+	}
+}
@@ -0,0 +1,244 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <tbb/tbb.h>
+#include <vector>
+
+#include "ClSources.h"
+#include "StatsAccumulator.h"
+#include "StatsAccumulatorBatch.h"
+#include "StatUtils.h"
+
+// Range of the scaled deviations processed by the fp32 kernel. Fourth powers of larger deviations would overflow the
+// float sums and smaller ones would lose their low part to denormals - such values are accumulated by the host
+constexpr auto CL_FP32_MIN_DEVIATION = 0x1p-24;
+constexpr auto CL_FP32_MAX_DEVIATION = 0x1p24;
+
+// Number of values converted by a single task
+constexpr auto CL_FP32_CONVERT_BLOCK_VALUES = size_t{1} << 16;
+
+// Maximum distance of the mean of a block from the shift in units of the scale. Data drifting away from the first
+// batch would make the central moments cancel catastrophically on the host, therefore blocks whose mean is further
+// away are accumulated by the host in double precision instead
+constexpr auto CL_FP32_MAX_MEAN_DRIFT = 4.0;
+
+// Error bound of the fp32 kernel. Each double-float operation is accurate to about 2^-44 relative, so a work item
+// summing m values is off by at most m * 2^-44 of the sum of the absolute powers. The central moments are derived from
+// the sums on the host - since the mean of the values sent to the device stays within CL_FP32_MAX_MEAN_DRIFT scales
+// of the shift (the mean of the first batch), the cancellation costs at most a few bits and the mean (relative to the
+// standard deviation), variance, skewness and kurtosis differ from the fp64 kernel by at most
+// m * CL_FP32_RELATIVE_ERROR_PER_VALUE
+constexpr auto CL_FP32_RELATIVE_ERROR_PER_VALUE = 0x1p-40;
+
+/**
+ * \brief Host part of the fp32 OpenCL path. Batches of a job are converted in place into the input of the fp32 kernel
+ *		  - each value becomes its deviation from the shift of the job in units of the scale, split into a pair of
+ *		  floats occupying the same 8 bytes. Minimum and integer-only flag are tracked here since the floats cannot
+ *		  represent them exactly, invalid values and values out of the range of the kernel are replaced by NaN and the
+ *		  latter are accumulated by the host in double precision, as are whole blocks whose mean drifted too far from
+ *		  the shift. Accumulators of the device are finally promoted to regular accumulators
+ */
+class ClFp32Converter {
+
+	/**
+	 * \brief Partial result of a single block of values
+	 */
+	struct BlockResult {
+		StatsAccumulator HostStats;
+		double Min = std::numeric_limits<double>::infinity();
+		bool IntegerOnly = true;
+	};
+
+	/**
+	 * \brief Whether the shift and the scale were already chosen for the job
+	 */
+	bool isCalibrated = false;
+
+	/**
+	 * \brief Value subtracted from each value before it is sent to the device, mean of the first batch
+	 */
+	double shift = 0.0;
+
+	/**
+	 * \brief Unit of the deviations sent to the device, power of two close to the standard deviation of the first batch
+	 */
+	double scale = 1.0;
+
+	/**
+	 * \brief Values of the job out of the range of the kernel
+	 */
+	StatsAccumulator hostStats;
+
+	/**
+	 * \brief Minimum of all valid values of the job
+	 */
+	double minValue = std::numeric_limits<double>::infinity();
+
+	/**
+	 * \brief Whether all valid values of the job are integers
+	 */
+	bool integerOnly = true;
+
+public:
+	/**
+	 * \brief Prepares the converter for a new job
+	 */
+	void reset() {
+		*this = ClFp32Converter();
+	}
+
+	/**
+	 * \brief Converts batch of values in place into pairs of floats for the fp32 kernel. The first batch of the job
+	 *		  determines the shift and the scale
+	 * \param values values of the batch, overwritten by the converted pairs
+	 * \param nValues number of values
+	 */
+	void convert(double* values, const size_t nValues) {
+		if (!isCalibrated) {
+			calibrate(values, nValues);
+		}
+
+		const auto inverseScale = 1.0 / scale;
+		const auto nBlocks = (nValues + CL_FP32_CONVERT_BLOCK_VALUES - 1) / CL_FP32_CONVERT_BLOCK_VALUES;
+		auto blockResults = std::vector<BlockResult>(nBlocks);
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, nBlocks), [&](const tbb::blocked_range<size_t> r) {
+			for (auto block = r.begin(); block < r.end(); block += 1) {
+				auto& result = blockResults[block];
+				const auto begin = block * CL_FP32_CONVERT_BLOCK_VALUES;
+				const auto end = std::min(nValues, (block + 1) * CL_FP32_CONVERT_BLOCK_VALUES);
+				const auto isDrifted = blockDrifted(values + begin, end - begin, inverseScale);
+				for (auto i = begin; i < end; i += 1) {
+					const auto x = values[i];
+					float pair[2] = {std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN()};
+					if (StatUtils::valueNormalOrZero(x)) {
+						result.Min = std::min(result.Min, x);
+						result.IntegerOnly = result.IntegerOnly && StatUtils::isValueInteger(x);
+
+						const auto deviation = (x - shift) * inverseScale;
+						const auto absDeviation = std::abs(deviation);
+						if (!isDrifted && (deviation == 0.0 ||
+							(absDeviation >= CL_FP32_MIN_DEVIATION && absDeviation <= CL_FP32_MAX_DEVIATION))) {
+							pair[0] = static_cast<float>(deviation);
+							pair[1] = static_cast<float>(deviation - pair[0]);
+						}
+						else {
+							result.HostStats.push(x);
+						}
+					}
+
+					// Pair overwrites the value it was made of
+					std::memcpy(values + i, pair, sizeof(pair));
+				}
+			}
+		});
+
+		for (auto& result : blockResults) {
+			hostStats = StatUtils::mergeValid(hostStats, result.HostStats);
+			minValue = std::min(minValue, result.Min);
+			integerOnly = integerOnly && result.IntegerOnly;
+		}
+	}
+
+	/**
+	 * \brief Turns accumulators of the fp32 kernel into regular accumulators
+	 * \param accumulators fields of the accumulators as read from the device
+	 * \param nAccumulators number of accumulators of the device
+	 * \return batch with an item for each accumulator of the device and the last item for the values of the host
+	 */
+	[[nodiscard]] StatsAccumulatorBatch promote(const std::vector<float>& accumulators,
+	                                            const size_t nAccumulators) const {
+		auto items = std::vector<StatsAccumulator>();
+		items.reserve(nAccumulators + 1);
+		for (auto i = size_t{0}; i < nAccumulators; i += 1) {
+			auto count = uint32_t{};
+			std::memcpy(&count, &accumulators[i], sizeof(count));
+			if (count == 0) {
+				items.emplace_back();
+				continue;
+			}
+
+			const auto sum = [&](const size_t field) {
+				return static_cast<double>(accumulators[field * nAccumulators + i]) +
+					static_cast<double>(accumulators[(field + 1) * nAccumulators + i]);
+			};
+			const auto n = static_cast<double>(count);
+			const auto s1 = sum(1);
+			const auto s2 = sum(3);
+			const auto s3 = sum(5);
+			const auto s4 = sum(7);
+
+			// Power sums about the shift to sums of powers of deviations from the mean, in units of the scale
+			const auto delta = s1 / n;
+			const auto m2 = std::max(0.0, s2 - n * delta * delta);
+			const auto m3 = s3 - 3.0 * delta * s2 + 2.0 * n * delta * delta * delta;
+			const auto m4 = std::max(0.0, s4 - 4.0 * delta * s3 + 6.0 * delta * delta * s2 -
+			                         3.0 * n * delta * delta * delta * delta);
+			const auto scale2 = scale * scale;
+			items.emplace_back(count, shift + scale * delta, scale2 * m2, scale2 * scale * m3, scale2 * scale2 * m4,
+			                   integerOnly, minValue);
+		}
+
+		items.push_back(hostStats);
+		return StatsAccumulatorBatch(items);
+	}
+
+private:
+	/**
+	 * \brief Checks whether mean of the valid values of the block is more than CL_FP32_MAX_MEAN_DRIFT scales away from
+	 *		  the shift
+	 * \param values values of the block
+	 * \param nValues number of values
+	 * \param inverseScale inverse of the scale
+	 * \return true if the block must be accumulated by the host
+	 */
+	[[nodiscard]] bool blockDrifted(const double* values, const size_t nValues, const double inverseScale) const {
+		auto deviationSum = 0.0;
+		auto nValid = size_t{0};
+		for (auto i = size_t{0}; i < nValues; i += 1) {
+			if (StatUtils::valueNormalOrZero(values[i])) {
+				deviationSum += (values[i] - shift) * inverseScale;
+				nValid += 1;
+			}
+		}
+
+		// Overflowing sum means the block is far away as well
+		return nValid > 0 && !(std::abs(deviationSum) <= CL_FP32_MAX_MEAN_DRIFT * static_cast<double>(nValid));
+	}
+
+	/**
+	 * \brief Chooses the shift and the scale of the job from the batch. Scale is a power of two so that scaling does
+	 *		  not round. Batch without any valid value leaves the converter uncalibrated
+	 * \param values values of the batch
+	 * \param nValues number of values
+	 */
+	void calibrate(const double* values, const size_t nValues) {
+		const auto nBlocks = (nValues + CL_FP32_CONVERT_BLOCK_VALUES - 1) / CL_FP32_CONVERT_BLOCK_VALUES;
+		auto blockStats = std::vector<StatsAccumulator>(nBlocks);
+		tbb::parallel_for(tbb::blocked_range<size_t>(0, nBlocks), [&](const tbb::blocked_range<size_t> r) {
+			for (auto block = r.begin(); block < r.end(); block += 1) {
+				const auto end = std::min(nValues, (block + 1) * CL_FP32_CONVERT_BLOCK_VALUES);
+				for (auto i = block * CL_FP32_CONVERT_BLOCK_VALUES; i < end; i += 1) {
+					blockStats[block].push(values[i]);
+				}
+			}
+		});
+
+		auto batchStats = StatsAccumulator();
+		for (auto& stats : blockStats) {
+			batchStats = StatUtils::mergeValid(batchStats, stats);
+		}
+
+		if (batchStats.getN() == 0 || !std::isfinite(batchStats.getMean())) {
+			return;
+		}
+
+		shift = batchStats.getMean();
+		const auto deviation = std::sqrt(batchStats.getVariance());
+		const auto unit = std::isfinite(deviation) && deviation > 0.0 ? deviation : std::abs(shift);
+		scale = unit > 0.0 && std::isfinite(unit) ? std::ldexp(1.0, std::ilogb(unit)) : 1.0;
+		isCalibrated = true;
+	}
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <array>
+#include <string>
+
+/**
+ * \brief Variant of the computeStats kernel. Options are passed to the OpenCL compiler as defines, therefore each
+ *		  variant is a separate program specialized for the access pattern it uses - see ClSources.h
+ */
+struct ClKernelVariant {
+	unsigned VectorWidth; // Number of values loaded by a single vector load (1, 2, 4 or 8)
+	unsigned Unroll; // Number of grid strides loaded before they are accumulated, used by scalar loads only
+	bool BranchlessFilter; // Whether invalid values are dropped by select instead of a branch
+	bool TruncIntegerCheck; // Whether integers are detected by trunc instead of the generic modf
+
+	/**
+	 * \brief Returns compiler options selecting the variant
+	 * \return defines of the variant
+	 */
+	[[nodiscard]] std::string buildFlags() const {
+		return "-DVECTOR_WIDTH=" + std::to_string(VectorWidth) + " -DUNROLL=" + std::to_string(Unroll) +
+			" -DBRANCHLESS_FILTER=" + std::to_string(BranchlessFilter) + " -DTRUNC_INTEGER_CHECK=" +
+			std::to_string(TruncIntegerCheck);
+	}
+
+	/**
+	 * \brief Returns human readable description of the variant
+	 * \return description of the variant
+	 */
+	[[nodiscard]] std::string name() const {
+		return (VectorWidth > 1 ? "double" + std::to_string(VectorWidth) + " loads" : "scalar loads") +
+			(Unroll > 1 ? ", unrolled " + std::to_string(Unroll) + "x" : std::string()) +
+			(BranchlessFilter ? ", branchless filter" : ", branching filter") +
+			(TruncIntegerCheck ? ", trunc integer check" : ", modf integer check");
+	}
+};
+
+// Variants tried by the calibration. The first one is the generic kernel - it is always built and its results are
+// the reference the other variants are checked against
+constexpr auto CL_KERNEL_VARIANTS = std::array<ClKernelVariant, 6>{
+	{
+		{1, 1, false, false},
+		{1, 1, true, true},
+		{1, 4, true, true},
+		{4, 1, false, true},
+		{4, 1, true, true},
+		{8, 1, true, true},
+	}
+};
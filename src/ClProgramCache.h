@@ -0,0 +1,134 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "ClConfig.h"
+
+namespace fs = std::filesystem;
+
+namespace ClProgramCache {
+
+	// Name of the cache directory in the temporary directory of the system
+	constexpr auto CACHE_DIR_NAME = "pprsolver_cl_cache";
+
+	// First line of each cache file - bump the version if the format of the file changes
+	constexpr auto CACHE_FILE_MAGIC = "PPRCLBIN 1";
+
+	/**
+	 * \brief 64-bit FNV-1a hash - cheap and stable across compilers and runs, unlike std::hash
+	 * \param data data to hash
+	 * \return hash of the data
+	 */
+	inline uint64_t fnv1a(const std::string& data) {
+		auto hash = 0xCBF29CE484222325ULL;
+		for (const auto c : data) {
+			hash ^= static_cast<unsigned char>(c);
+			hash *= 0x100000001B3ULL;
+		}
+
+		return hash;
+	}
+
+	/**
+	 * \brief Builds key of the program - the binary can only be reused if the device, its driver, the build flags and
+	 *		  the source are all the same
+	 * \param device device the program is built for
+	 * \param buildFlags build flags
+	 * \param source source code of the program
+	 * \return key of the program
+	 */
+	inline std::string buildKey(const cl::Device& device, const std::string& buildFlags, const std::string& source) {
+		auto key = std::stringstream();
+		key << device.getInfo<CL_DEVICE_PLATFORM>().getInfo<CL_PLATFORM_NAME>() << "|"
+			<< device.getInfo<CL_DEVICE_NAME>() << "|"
+			<< device.getInfo<CL_DEVICE_VENDOR>() << "|"
+			<< device.getInfo<CL_DEVICE_VERSION>() << "|"
+			<< device.getInfo<CL_DRIVER_VERSION>() << "|"
+			<< buildFlags << "|"
+			<< std::hex << fnv1a(source);
+		return key.str();
+	}
+
+	/**
+	 * \brief Returns path of the cache file for the key
+	 * \param key key of the program
+	 * \return path of the cache file
+	 */
+	inline fs::path cacheFilePath(const std::string& key) {
+		auto fileName = std::stringstream();
+		fileName << std::hex << fnv1a(key) << ".bin";
+		return fs::temp_directory_path() / CACHE_DIR_NAME / fileName.str();
+	}
+
+	/**
+	 * \brief Loads binary of the program from the cache
+	 * \param key key of the program
+	 * \return binary, empty if the program is not cached or the cached file belongs to a different key
+	 */
+	inline std::optional<std::vector<unsigned char>> load(const std::string& key) {
+		auto errorCode = std::error_code();
+		const auto filePath = cacheFilePath(key);
+		if (!fs::exists(filePath, errorCode)) {
+			return std::nullopt;
+		}
+
+		auto file = std::ifstream(filePath, std::ios::binary);
+		auto magic = std::string();
+		auto storedKey = std::string();
+		auto binarySize = size_t{};
+		if (!std::getline(file, magic) || magic != CACHE_FILE_MAGIC || !std::getline(file, storedKey) ||
+			storedKey != key || !(file >> binarySize) || file.get() != '\n' || binarySize == 0) {
+			return std::nullopt;
+		}
+
+		auto binary = std::vector<unsigned char>(binarySize);
+		if (!file.read(reinterpret_cast<char*>(binary.data()), static_cast<std::streamsize>(binarySize))) {
+			return std::nullopt;
+		}
+
+		return binary;
+	}
+
+	/**
+	 * \brief Stores binary of the program in the cache. The file is written under a temporary name and renamed, so
+	 *		  concurrently running processes never read a partially written file. Failures are ignored, the program
+	 *		  is simply compiled from the source next time
+	 * \param key key of the program
+	 * \param binary binary of the program
+	 * \return true if the binary was stored
+	 */
+	inline bool store(const std::string& key, const std::vector<unsigned char>& binary) {
+		auto errorCode = std::error_code();
+		const auto filePath = cacheFilePath(key);
+		fs::create_directories(filePath.parent_path(), errorCode);
+		if (errorCode) {
+			return false;
+		}
+
+		auto tmpFilePath = filePath;
+		tmpFilePath += "." + std::to_string(std::random_device()()) + ".tmp";
+		{
+			auto file = std::ofstream(tmpFilePath, std::ios::binary);
+			file << CACHE_FILE_MAGIC << "\n" << key << "\n" << binary.size() << "\n";
+			file.write(reinterpret_cast<const char*>(binary.data()), static_cast<std::streamsize>(binary.size()));
+			if (!file) {
+				fs::remove(tmpFilePath, errorCode);
+				return false;
+			}
+		}
+
+		fs::rename(tmpFilePath, filePath, errorCode);
+		if (errorCode) {
+			fs::remove(tmpFilePath, errorCode);
+			return false;
+		}
+
+		return true;
+	}
+}
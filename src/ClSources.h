@@ -33,49 +33,352 @@ inline bool valueNormalOrZero(double x) {
     return true;
 }
 
-__kernel void computeStats(__global double* data, __global double* stats, uint64_t numElements) {
+// Number of fields of the accumulator - the order matches StatsAccumulatorBatch
+#define N_STATS_FIELDS 7
+#define N_ITEMS_IDX 0
+#define INTEGER_ONLY_IDX 5
+#define MIN_IDX 6
+
+inline bool momentsValid(const double* stats) {
+    return valueNormalOrZero(stats[1]) && valueNormalOrZero(stats[2]) && valueNormalOrZero(stats[3]) &&
+        valueNormalOrZero(stats[4]);
+}
+
+// Merges accumulator b into accumulator a - the formulas are the same as in StatsAccumulator::operator+ and empty
+// or invalid accumulators are skipped the same way as in StatUtils::mergeValid
+inline void mergeStats(double* a, const double* b) {
+    bool aValid = momentsValid(a);
+    bool bValid = momentsValid(b);
+    bool aUsable = aValid && a[N_ITEMS_IDX] > 0.0;
+    bool bUsable = bValid && b[N_ITEMS_IDX] > 0.0;
+    if (aUsable && bUsable) {
+        double nA = a[N_ITEMS_IDX], nB = b[N_ITEMS_IDX];
+        double nTotal = nA + nB;
+        double delta = b[1] - a[1];
+        double delta2 = delta * delta;
+        double delta3 = delta2 * delta;
+        double delta4 = delta2 * delta2;
+
+        double merged[N_STATS_FIELDS];
+        merged[N_ITEMS_IDX] = nTotal;
+        merged[1] = (a[1] * nA + b[1] * nB) / nTotal;
+        merged[2] = a[2] + b[2] + delta2 * nA * nB / nTotal;
+        merged[3] = a[3] + b[3] + delta3 * nA * nB * (nA - nB) / (nTotal * nTotal) +
+            3.0 * delta * (nA * b[2] - nB * a[2]) / nTotal;
+        merged[4] = a[4] + b[4] + delta4 * nA * nB * (nA * nA - nA * nB + nB * nB) / (nTotal * nTotal * nTotal) +
+            6.0 * delta2 * (nA * nA * b[2] + nB * nB * a[2]) / (nTotal * nTotal) +
+            4.0 * delta * (nA * b[3] - nB * a[3]) / nTotal;
+        merged[INTEGER_ONLY_IDX] = (a[INTEGER_ONLY_IDX] != 0.0 && b[INTEGER_ONLY_IDX] != 0.0) ? 1.0 : 0.0;
+        merged[MIN_IDX] = fmin(a[MIN_IDX], b[MIN_IDX]);
+
+        // Numerical error while merging keeps the left hand side, only the minimum is taken from both
+        if (momentsValid(merged)) {
+            for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+                a[f] = merged[f];
+            }
+        }
+        else {
+            a[MIN_IDX] = merged[MIN_IDX];
+        }
+        return;
+    }
+
+    if (aUsable || (!bUsable && !aValid)) {
+        return;
+    }
+
+    for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+        a[f] = b[f];
+    }
+}
+
+// Merges nItems accumulators into one accumulator per work group. Each work item first merges items globalIdx,
+// globalIdx + nThreads, ... and then the work group merges the results of its work items in a tree in local memory.
+// Result of work group g is stored at f * nGroups + g for each field f
+__kernel void reduceStats(__global const double* stats, uint64_t nItems, __global double* reduced,
+                          __local double* scratch) {
+    size_t localIdx = get_local_id(0);
+    size_t localSize = get_local_size(0);
+
+    double acc[N_STATS_FIELDS] = {0.0, 0.0, 0.0, 0.0, 0.0, 1.0, INFINITY};
+    double item[N_STATS_FIELDS];
+    for (uint64_t i = get_global_id(0); i < nItems; i += get_global_size(0)) {
+        for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+            item[f] = stats[f * nItems + i];
+        }
+        mergeStats(acc, item);
+    }
+
+    for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+        scratch[f * localSize + localIdx] = acc[f];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Each level merges the upper half into the lower half, the middle item of odd-sized level is kept as is
+    for (size_t width = localSize; width > 1; width = width - width / 2) {
+        size_t nPairs = width / 2;
+        size_t offset = width - nPairs;
+        if (localIdx < nPairs) {
+            for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+                acc[f] = scratch[f * localSize + localIdx];
+                item[f] = scratch[f * localSize + localIdx + offset];
+            }
+            mergeStats(acc, item);
+            for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+                scratch[f * localSize + localIdx] = acc[f];
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (localIdx == 0) {
+        size_t nGroups = get_num_groups(0);
+        for (int f = 0; f < N_STATS_FIELDS; f += 1) {
+            reduced[f * nGroups + get_group_id(0)] = scratch[f * localSize];
+        }
+    }
+}
+
+// Kernel variants are selected by the host with -D options, see ClKernelVariant.h. Defaults give the generic kernel
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 1
+#endif
+#ifndef UNROLL
+#define UNROLL 1
+#endif
+#ifndef BRANCHLESS_FILTER
+#define BRANCHLESS_FILTER 0
+#endif
+#ifndef TRUNC_INTEGER_CHECK
+#define TRUNC_INTEGER_CHECK 0
+#endif
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+#define VECTOR_TYPE CONCAT(double, VECTOR_WIDTH)
+#define VLOAD CONCAT(vload, VECTOR_WIDTH)
+#define VSTORE CONCAT(vstore, VECTOR_WIDTH)
+
+// Emulates a RunningStats object
+typedef struct {
+    uint64_t n;
+    double m1, m2, m3, m4, min;
+    bool integerOnly;
+} RunningStats;
+
+inline bool isInteger(double x) {
+#if TRUNC_INTEGER_CHECK
+    return trunc(x) == x;
+#else
+    double intPart = 0.0;
+    return modf(x, &intPart) == 0.0;
+#endif
+}
+
+inline void pushValue(RunningStats* stats, double x) {
+#if BRANCHLESS_FILTER
+    // Update is computed for invalid values too and dropped by select, so work items never diverge. Invalid value is
+    // replaced by the mean, which keeps all intermediate results finite
+    bool valid = valueNormalOrZero(x);
+    x = valid ? x : stats->m1;
+    uint64_t n = stats->n + 1;
+#else
+    if (!valueNormalOrZero(x)) {
+        // Skip if x is NaN, infinity or denormal
+        return;
+    }
+    uint64_t n = stats->n + 1;
+#endif
+
+    double n1 = stats->n;
+    double delta = x - stats->m1;
+    double deltaN = delta / n;
+    double deltaNSquared = deltaN * deltaN;
+    double term1 = delta * deltaN * n1;
+    double m1 = stats->m1 + deltaN;
+    double m4 = stats->m4 + term1 * deltaNSquared * (n * n - 3 * n + 3) + 6 * deltaNSquared * stats->m2 -
+        4 * deltaN * stats->m3;
+    double m3 = stats->m3 + term1 * deltaN * (n - 2) - 3 * deltaN * stats->m2;
+    double m2 = stats->m2 + term1;
+    bool integerOnly = stats->integerOnly && isInteger(x);
+    double min = fmin(stats->min, x);
+
+#if BRANCHLESS_FILTER
+    stats->n = valid ? n : stats->n;
+    stats->m1 = valid ? m1 : stats->m1;
+    stats->m2 = valid ? m2 : stats->m2;
+    stats->m3 = valid ? m3 : stats->m3;
+    stats->m4 = valid ? m4 : stats->m4;
+    stats->integerOnly = valid ? integerOnly : stats->integerOnly;
+    stats->min = valid ? min : stats->min;
+#else
+    stats->n = n;
+    stats->m1 = m1;
+    stats->m2 = m2;
+    stats->m3 = m3;
+    stats->m4 = m4;
+    stats->integerOnly = integerOnly;
+    stats->min = min;
+#endif
+}
+
+// Each work item accumulates values threadIdx, threadIdx + nThreads, threadIdx + 2 * nThreads, ... of the batch. This
+// way neighboring work items read neighboring values and the reads of a work group coalesce into few transactions.
+// Vector variants do the same with vectors of VECTOR_WIDTH values
+__kernel void computeStats(__global const double* data, __global double* stats, uint64_t numElements) {
     size_t threadIdx = get_global_id(0);
-    uint64_t threadOffset = threadIdx * 7;
 
-    // Emulate a RunningStats object
+    // Stats are stored as struct of arrays - field f of this thread is at f * nThreads + threadIdx
+    size_t nThreads = get_global_size(0);
+
     // Load data from stats array
-    uint64_t n = stats[threadOffset];
-    double m1 = stats[threadOffset + 1], m2 = stats[threadOffset + 2], m3 = stats[threadOffset + 3], m4 = stats[threadOffset + 4];
-    bool integerOnly = (bool) stats[threadOffset + 5];
-    double min = stats[threadOffset + 6];
-    double intPart = 0.0;
+    RunningStats acc;
+    acc.n = stats[threadIdx];
+    acc.m1 = stats[nThreads + threadIdx];
+    acc.m2 = stats[2 * nThreads + threadIdx];
+    acc.m3 = stats[3 * nThreads + threadIdx];
+    acc.m4 = stats[4 * nThreads + threadIdx];
+    acc.integerOnly = (bool) stats[5 * nThreads + threadIdx];
+    acc.min = stats[6 * nThreads + threadIdx];
 
-    // Process numElements elements
-    for (uint64_t i = 0; i < numElements; i += 1) {
-        double x = data[threadIdx*numElements+i];
-        if (!valueNormalOrZero(x)) {
-            // Skip if x is NaN, infinity or denormal
-            continue;
+    uint64_t i = threadIdx;
+#if VECTOR_WIDTH > 1
+    uint64_t nVectors = numElements / VECTOR_WIDTH;
+    for (uint64_t vectorIdx = threadIdx; vectorIdx < nVectors; vectorIdx += nThreads) {
+        double values[VECTOR_WIDTH];
+        VSTORE(VLOAD(vectorIdx, data), 0, values);
+        for (int v = 0; v < VECTOR_WIDTH; v += 1) {
+            pushValue(&acc, values[v]);
         }
+    }
 
-        double n1 = n;
+    // Values after the last whole vector are left to the scalar loop
+    i += nVectors * VECTOR_WIDTH;
+#elif UNROLL > 1
+    // Values of UNROLL strides are loaded before any of them is accumulated, so that the loads are in flight at once
+    for (; i + (UNROLL - 1) * nThreads < numElements; i += UNROLL * nThreads) {
+        double values[UNROLL];
+        #pragma unroll
+        for (int u = 0; u < UNROLL; u += 1) {
+            values[u] = data[i + u * nThreads];
+        }
+        #pragma unroll
+        for (int u = 0; u < UNROLL; u += 1) {
+            pushValue(&acc, values[u]);
+        }
+    }
+#endif
 
-        n += 1;
-        integerOnly = integerOnly && modf(x, &intPart) == 0.0;
-
-        double delta = x - m1;
-        double deltaN = delta / n;
-        double deltaNSquared = deltaN * deltaN;
-        double term1 = delta * deltaN * n1;
-        m1 += deltaN;
-        m4 += term1 * deltaNSquared * (n * n - 3 * n + 3) + 6 * deltaNSquared * m2 - 4 * deltaN * m3;
-        m3 += term1 * deltaN * (n - 2) - 3 * deltaN * m2;
-        m2 += term1;
-        min = fmin(min, x);
+    // Grid-stride loop over the remaining elements of the batch
+    for (; i < numElements; i += nThreads) {
+        pushValue(&acc, data[i]);
     }
-    
+
     // Write results to the data
-    stats[threadOffset] = n;
-    stats[threadOffset + 1] = m1;
-    stats[threadOffset + 2] = m2;
-    stats[threadOffset + 3] = m3;
-    stats[threadOffset + 4] = m4;
-    stats[threadOffset + 5] = integerOnly;
-    stats[threadOffset + 6] = min;
+    stats[threadIdx] = acc.n;
+    stats[nThreads + threadIdx] = acc.m1;
+    stats[2 * nThreads + threadIdx] = acc.m2;
+    stats[3 * nThreads + threadIdx] = acc.m3;
+    stats[4 * nThreads + threadIdx] = acc.m4;
+    stats[5 * nThreads + threadIdx] = acc.integerOnly;
+    stats[6 * nThreads + threadIdx] = acc.min;
+}
+)CLC";
+
+// Number of float fields of an accumulator of the fp32 kernel - the count (bits of an uint) and the sums of the first
+// four powers of the deviation, each as a pair of floats (hi, lo). Field f of work item i is at f * nWorkItems + i
+constexpr auto N_CL_FP32_FIELDS = 9;
+
+// Kernel for devices without (fast) double precision. The host sends each value as its scaled deviation from the
+// shift of the job, split into a pair of floats whose sum equals the deviation up to 2^-48 relative. Values the host
+// processes itself are NaN. Sums of the powers of the deviations are accumulated in double-float arithmetic
+// (unevaluated sum of two floats, about 44 bits of mantissa) and the host turns them into central moments in double
+// precision - see ClFp32Converter
+constexpr auto CL_PROGRAM_FP32 = R"CLC(
+#pragma OPENCL FP_CONTRACT OFF
+
+// Double-float number, x is the high and y the low part
+typedef float2 df;
+
+inline df makeDf(float hi, float lo) {
+    df result;
+    result.x = hi;
+    result.y = lo;
+    return result;
+}
+
+// Error-free sum, hi + lo is exactly a + b
+inline df twoSum(float a, float b) {
+    float s = a + b;
+    float bb = s - a;
+    return makeDf(s, (a - (s - bb)) + (b - bb));
+}
+
+// Error-free sum for |a| >= |b|
+inline df quickTwoSum(float a, float b) {
+    float s = a + b;
+    return makeDf(s, b - (s - a));
+}
+
+// Error-free product, hi + lo is exactly a * b
+inline df twoProd(float a, float b) {
+    float p = a * b;
+    return makeDf(p, fma(a, b, -p));
+}
+
+inline df dfAdd(df a, df b) {
+    df s = twoSum(a.x, b.x);
+    df t = twoSum(a.y, b.y);
+    s = quickTwoSum(s.x, s.y + t.x);
+    return quickTwoSum(s.x, s.y + t.y);
+}
+
+inline df dfMul(df a, df b) {
+    df p = twoProd(a.x, b.x);
+    return quickTwoSum(p.x, p.y + (a.x * b.y + a.y * b.x));
+}
+
+inline df loadDf(__global const float* stats, size_t field, size_t nThreads, size_t threadIdx) {
+    return makeDf(stats[field * nThreads + threadIdx], stats[(field + 1) * nThreads + threadIdx]);
+}
+
+inline void storeDf(__global float* stats, size_t field, size_t nThreads, size_t threadIdx, df value) {
+    stats[field * nThreads + threadIdx] = value.x;
+    stats[(field + 1) * nThreads + threadIdx] = value.y;
+}
+
+// Grid-stride loop as in the fp64 kernel, neighboring work items read neighboring values
+__kernel void computeStats(__global const float2* data, __global float* stats, ulong numElements) {
+    size_t threadIdx = get_global_id(0);
+    size_t nThreads = get_global_size(0);
+
+    // Count is stored as bits of an uint, accessed through an uint pointer so that it never passes a float register
+    __global uint* counts = (__global uint*) stats;
+    uint n = counts[threadIdx];
+    df s1 = loadDf(stats, 1, nThreads, threadIdx);
+    df s2 = loadDf(stats, 3, nThreads, threadIdx);
+    df s3 = loadDf(stats, 5, nThreads, threadIdx);
+    df s4 = loadDf(stats, 7, nThreads, threadIdx);
+
+    for (ulong i = threadIdx; i < numElements; i += nThreads) {
+        df d = data[i];
+        if (isnan(d.x)) {
+            // Invalid value or a value processed by the host
+            continue;
+        }
+
+        df d2 = dfMul(d, d);
+        s1 = dfAdd(s1, d);
+        s2 = dfAdd(s2, d2);
+        s3 = dfAdd(s3, dfMul(d2, d));
+        s4 = dfAdd(s4, dfMul(d2, d2));
+        n += 1;
+    }
+
+    counts[threadIdx] = n;
+    storeDf(stats, 1, nThreads, threadIdx, s1);
+    storeDf(stats, 3, nThreads, threadIdx, s2);
+    storeDf(stats, 5, nThreads, threadIdx, s3);
+    storeDf(stats, 7, nThreads, threadIdx, s4);
 }
 )CLC";
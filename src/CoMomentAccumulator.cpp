@@ -0,0 +1,82 @@
+#include <cmath>
+
+#include "CoMomentAccumulator.h"
+#include "StatUtils.h"
+
+CoMomentAccumulator::CoMomentAccumulator(const size_t nColumns):
+	nColumns(nColumns),
+	means(nColumns, .0),
+	coMoments(nColumns * nColumns, .0),
+	deltas(nColumns, .0) {
+}
+
+void CoMomentAccumulator::push(const double* record) {
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		if (!StatUtils::valueNormalOrZero(record[i])) {
+			return;
+		}
+	}
+
+	n += 1;
+	const auto nDouble = static_cast<double>(n);
+
+	// Welford's update - C_ij += (x_i - oldMean_i) * (x_j - newMean_j)
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		deltas[i] = record[i] - means[i];
+		means[i] += deltas[i] / nDouble;
+	}
+
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		for (auto j = 0ULL; j < nColumns; j += 1) {
+			coMoments[i * nColumns + j] += deltas[i] * (record[j] - means[j]);
+		}
+	}
+}
+
+CoMomentAccumulator& CoMomentAccumulator::operator+=(const CoMomentAccumulator& rhs) {
+	if (rhs.n == 0) {
+		return *this;
+	}
+
+	if (n == 0) {
+		*this = rhs;
+		return *this;
+	}
+
+	// Chan et al. pairwise update - C = C_a + C_b + delta_i * delta_j * n_a * n_b / n
+	const auto nA = static_cast<double>(n);
+	const auto nB = static_cast<double>(rhs.n);
+	const auto nTotal = nA + nB;
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		deltas[i] = rhs.means[i] - means[i];
+	}
+
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		for (auto j = 0ULL; j < nColumns; j += 1) {
+			coMoments[i * nColumns + j] += rhs.coMoments[i * nColumns + j] + deltas[i] * deltas[j] * nA * nB / nTotal;
+		}
+	}
+
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		means[i] += deltas[i] * nB / nTotal;
+	}
+
+	n += rhs.n;
+	return *this;
+}
+
+size_t CoMomentAccumulator::getNColumns() const {
+	return nColumns;
+}
+
+size_t CoMomentAccumulator::getN() const {
+	return n;
+}
+
+double CoMomentAccumulator::getCovariance(const size_t i, const size_t j) const {
+	return coMoments[i * nColumns + j] / (static_cast<double>(n) - 1.0);
+}
+
+double CoMomentAccumulator::getCorrelation(const size_t i, const size_t j) const {
+	return coMoments[i * nColumns + j] / std::sqrt(coMoments[i * nColumns + i] * coMoments[j * nColumns + j]);
+}
@@ -0,0 +1,83 @@
+#pragma once
+#include <vector>
+
+/**
+ * \brief Object for accumulating co-moments of multi-column records - i.e. records of K doubles. Together with
+ *		  per-column StatsAccumulator objects this gives covariance and correlation matrix in a single pass.
+ *		  Only records where all values are valid (FP_NORMAL or FP_ZERO) are accumulated
+ */
+class CoMomentAccumulator {
+
+	/**
+	 * \brief Number of columns in each record
+	 */
+	size_t nColumns = 1;
+
+	/**
+	 * \brief Number of processed (valid) records
+	 */
+	size_t n = 0;
+
+	/**
+	 * \brief Mean of each column
+	 */
+	std::vector<double> means;
+
+	/**
+	 * \brief Co-moment matrix (sum of (x_i - mean_i) * (x_j - mean_j)) stored in row-major order
+	 */
+	std::vector<double> coMoments;
+
+	/**
+	 * \brief Temporary storage for deltas so that push does not allocate
+	 */
+	std::vector<double> deltas;
+
+public:
+	/**
+	 * \brief Creates new CoMomentAccumulator
+	 * \param nColumns number of columns in each record
+	 */
+	explicit CoMomentAccumulator(size_t nColumns = 1);
+
+	/**
+	 * \brief Pushes new record to the accumulator. Record is skipped if it contains any invalid value
+	 * \param record pointer to the first value of the record, must point to at least nColumns values
+	 */
+	void push(const double* record);
+
+	/**
+	 * \brief Adds another accumulator to this one
+	 * \param rhs right hand side
+	 * \return result of the addition
+	 */
+	CoMomentAccumulator& operator+=(const CoMomentAccumulator& rhs);
+
+	/**
+	 * \brief Returns number of columns
+	 * \return number of columns
+	 */
+	[[nodiscard]] size_t getNColumns() const;
+
+	/**
+	 * \brief Returns number of valid records
+	 * \return number of valid records
+	 */
+	[[nodiscard]] size_t getN() const;
+
+	/**
+	 * \brief Returns sample covariance of two columns
+	 * \param i index of the first column
+	 * \param j index of the second column
+	 * \return covariance
+	 */
+	[[nodiscard]] double getCovariance(size_t i, size_t j) const;
+
+	/**
+	 * \brief Returns Pearson correlation coefficient of two columns
+	 * \param i index of the first column
+	 * \param j index of the second column
+	 * \return correlation
+	 */
+	[[nodiscard]] double getCorrelation(size_t i, size_t j) const;
+};
@@ -25,6 +25,20 @@ namespace ConcurrencyUtils {
 			count -= 1;
 		}
 
+		/**
+		 * \brief Acquire operation that never blocks
+		 * \return true if the count was decremented, false if it was 0
+		 */
+		bool tryAcquire() {
+			auto lock = std::scoped_lock(mutex);
+			if (count == 0) {
+				return false;
+			}
+
+			count -= 1;
+			return true;
+		}
+
 		/**
 		 * \brief Release operation is always nonblocking and increments count by one.
 		 *		  If there is a thread waiting on the semaphore, it will be woken up
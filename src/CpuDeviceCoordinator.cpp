@@ -1,19 +1,25 @@
-#define NOMINMAX
 #include <tbb/tbb.h>
 
 #include "CpuDeviceCoordinator.h"
 #include "Logging.h"
 
+// Number of values pushed to the group table by a single task - the tables are thread-local so this only needs to
+// amortize the task overhead
+constexpr auto GROUP_BY_GRAIN_SIZE = 64ULL * 1024;
 
 CpuDeviceCoordinator::CpuDeviceCoordinator(const CoordinatorType coordinatorType,
                                            const ProcessingMode processingMode,
                                            const std::function<void(std::unique_ptr<Job>, size_t)>& jobFinishedCallback,
                                            const std::function<void(size_t)>& notifyWatchdogCallback,
                                            const std::function<void(CoordinatorErr)>& errCallback,
+                                           const std::function<std::unique_ptr<Job>(size_t)>& claimJobCallback,
                                            const size_t chunkSizeBytes,
                                            const size_t bytesPerAccumulator,
                                            const size_t cpuBufferSizeBytes,
                                            fs::path& distFilePath,
+                                           const fs::path& keyFilePath,
+                                           const int numaNodeId,
+                                           const int maxConcurrency,
                                            const size_t id
 ) :
 	DeviceCoordinator(
@@ -22,21 +28,96 @@ CpuDeviceCoordinator::CpuDeviceCoordinator(const CoordinatorType coordinatorType
 		jobFinishedCallback,
 		notifyWatchdogCallback,
 		errCallback,
+		claimJobCallback,
 		chunkSizeBytes,
 		bytesPerAccumulator,
 		distFilePath,
-		id) {
+		id),
+	arena(tbb::task_arena::constraints(numaNodeId, maxConcurrency)),
+	numaNodeId(numaNodeId),
+	cpuBufferSizeBytes(cpuBufferSizeBytes),
+	readAheadLoader(distFilePath, chunkSizeBytes) {
 	maxNumberOfChunksPerJob = (cpuBufferSizeBytes / bytesPerAccumulator * bytesPerAccumulator) / chunkSizeBytes;
+	jobGranularityChunks = bytesPerAccumulator / chunkSizeBytes;
 	if (processingMode == ProcessingMode::OPENCL_DEVICES) {
 		return;
 	}
 
+	if (!keyFilePath.empty()) {
+		keyLoader = std::make_unique<DataLoader>(keyFilePath, chunkSizeBytes);
+	}
+
 	startCoordinatorThread();
 }
 
+void CpuDeviceCoordinator::prepareRun(const std::vector<FileSegment>& fileSegments, const fs::path& keyFilePath,
+                                      const size_t runChunkSizeBytes) {
+	DeviceCoordinator::prepareRun(fileSegments, keyFilePath, runChunkSizeBytes);
+	readAheadLoader.open(fileSegments, runChunkSizeBytes);
+	readAheadBuffer = {};
+	readAheadJobId = SIZE_MAX;
+
+	keyLoader = keyFilePath.empty() ? nullptr : std::make_unique<DataLoader>(keyFilePath, runChunkSizeBytes);
+	groupTables.clear();
+
+	maxNumberOfChunksPerJob = (cpuBufferSizeBytes / bytesPerAccumulator * bytesPerAccumulator) / runChunkSizeBytes;
+	jobGranularityChunks = bytesPerAccumulator / runChunkSizeBytes;
+}
+
+std::vector<double> CpuDeviceCoordinator::loadJobData() {
+	auto readTimer = ScopedStageTimer(stageProfiler, STAGE_READ);
+	auto buffer = readAheadJobId == currentJob->Id && readAheadBuffer.valid()
+		              ? readAheadBuffer.get()
+		              : dataLoader.loadJobDataIntoVector(*currentJob);
+
+	if (const auto nextJob = reserveNextJob()) {
+		readAheadJobId = nextJob->first;
+		// The buffer is allocated and filled within the arena so that its pages are local to the NUMA node
+		readAheadBuffer = std::async(std::launch::async, [this, chunkIdxRange = nextJob->second] {
+			return arena.execute([&] {
+				return readAheadLoader.loadChunksIntoVector(chunkIdxRange);
+			});
+		});
+	}
+
+	return buffer;
+}
+
+std::vector<Histogram>& CpuDeviceCoordinator::localHistograms() {
+	auto& histograms = threadHistograms.local();
+	if (histograms.size() != currentJob->NColumns) {
+		histograms = std::vector<Histogram>(currentJob->NColumns);
+	}
+
+	return histograms;
+}
+
+void CpuDeviceCoordinator::moveThreadHistogramsToJob() {
+	for (auto& histograms : threadHistograms) {
+		for (auto column = 0ULL; column < std::min(histograms.size(), jobHistograms.size()); column += 1) {
+			jobHistograms[column] += histograms[column];
+			histograms[column].clear();
+		}
+	}
+}
+
 void CpuDeviceCoordinator::onProcessJob() {
+	arena.execute([this] {
+		computeJob();
+	});
+}
+
+void CpuDeviceCoordinator::computeJob() {
 	log(INFO, "[SMP] Processing job with id " + std::to_string(currentJob->Id));
-	const auto buffer = dataLoader.loadJobDataIntoVector(*currentJob);
+	const auto buffer = loadJobData();
+	auto accumulateTimer = ScopedStageTimer(stageProfiler, STAGE_ACCUMULATE);
+	if (currentJob->NColumns > 1) {
+		processColumns(buffer);
+		return;
+	}
+
+	processGroups(buffer);
+
 	const auto doublesPerAccumulator = bytesPerAccumulator / sizeof(double);
 	const auto nAccumulators = buffer.size() / doublesPerAccumulator;
 	auto accumulators = std::vector<StatsAccumulator>(nAccumulators);
@@ -48,27 +129,120 @@ void CpuDeviceCoordinator::onProcessJob() {
 		auto accumulator = StatsAccumulator();
 		for (auto i = 0ULL; i < buffer.size(); i += 1) {
 			accumulator.push(buffer[i]);
+			jobHistograms[0].push(buffer[i]);
 		}
 		accumulators.push_back(accumulator);
 		notifyWatchdogCallback(buffer.size() * sizeof(double));
 	}
 	else {
 		log(DEBUG, "[SMP] Job split into " + std::to_string(nAccumulators) + " accumulators");
+		// Each thread gathers its own histogram, these are combined once the job is done
 		tbb::parallel_for(tbb::blocked_range<size_t>(0, nAccumulators),
 		                  [&](const tbb::blocked_range<size_t> r) {
+			                  auto& histogram = localHistograms()[0];
 			                  for (auto accumulatorId = r.begin(); accumulatorId < r.end(); accumulatorId += 1) {
+				                  // Job does not have to be a multiple of the accumulator size, the last accumulator
+				                  // takes the remaining values
 				                  const auto jobStart = accumulatorId * doublesPerAccumulator;
-				                  const auto jobEnd = (accumulatorId + 1) * doublesPerAccumulator;
+				                  const auto jobEnd = accumulatorId + 1 == nAccumulators
+					                                      ? buffer.size()
+					                                      : (accumulatorId + 1) * doublesPerAccumulator;
 				                  for (auto i = jobStart; i < jobEnd; i += 1) {
 					                  accumulators[accumulatorId].push(buffer[i]);
+					                  histogram.push(buffer[i]);
 				                  }
 								  notifyWatchdogCallback((jobEnd - jobStart) * sizeof(double));
 			                  }
 		                  });
+		moveThreadHistogramsToJob();
 	}
 	
-	currentJob->Items = accumulators;
+	currentJob->Items = StatsAccumulatorBatch(accumulators);
 	log(DEBUG,
 	    "[SMP] Finished computing job with id " + std::to_string(currentJob->Id) + ". Computed " + std::to_string(
 		    currentJob->getNChunks()) + " chunks. Chunk size is " + std::to_string(chunkSizeBytes) + " bytes");
 }
+
+void CpuDeviceCoordinator::processColumns(const std::vector<double>& buffer) {
+	const auto nColumns = currentJob->NColumns;
+	const auto nRecords = buffer.size() / nColumns;
+	const auto recordsPerAccumulator = bytesPerAccumulator / (nColumns * sizeof(double));
+
+	// Small jobs are processed by a single accumulator, the last accumulator takes the remaining records
+	// Accumulators of column c are stored in c-th block so that the columns can be merged separately
+	const auto nAccumulators = std::max<size_t>(1, nRecords / recordsPerAccumulator);
+	auto accumulators = std::vector<StatsAccumulator>(nAccumulators * nColumns);
+	auto coMoments = std::vector<CoMomentAccumulator>(nAccumulators, CoMomentAccumulator(nColumns));
+
+	log(DEBUG, "[SMP] Job with " + std::to_string(nColumns) + " columns split into " +
+	    std::to_string(nAccumulators) + " accumulators");
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, nAccumulators),
+	                  [&](const tbb::blocked_range<size_t> r) {
+		                  auto& histograms = localHistograms();
+		                  for (auto accumulatorId = r.begin(); accumulatorId < r.end(); accumulatorId += 1) {
+			                  const auto recordStart = accumulatorId * recordsPerAccumulator;
+			                  const auto recordEnd = accumulatorId + 1 == nAccumulators
+				                                         ? nRecords
+				                                         : recordStart + recordsPerAccumulator;
+			                  for (auto recordIdx = recordStart; recordIdx < recordEnd; recordIdx += 1) {
+				                  const auto* record = &buffer[recordIdx * nColumns];
+				                  for (auto column = 0ULL; column < nColumns; column += 1) {
+					                  accumulators[column * nAccumulators + accumulatorId].push(record[column]);
+					                  histograms[column].push(record[column]);
+				                  }
+				                  coMoments[accumulatorId].push(record);
+			                  }
+			                  notifyWatchdogCallback((recordEnd - recordStart) * nColumns * sizeof(double));
+		                  }
+	                  });
+
+	moveThreadHistogramsToJob();
+
+	// Co-moments are merged via parallel reduction
+	currentJob->CoMoments = tbb::parallel_reduce(
+		tbb::blocked_range<size_t>(0, nAccumulators),
+		CoMomentAccumulator(nColumns),
+		[&](const tbb::blocked_range<size_t>& r, CoMomentAccumulator result) {
+			for (auto i = r.begin(); i < r.end(); i += 1) {
+				result += coMoments[i];
+			}
+			return result;
+		},
+		[](CoMomentAccumulator lhs, const CoMomentAccumulator& rhs) {
+			lhs += rhs;
+			return lhs;
+		});
+
+	currentJob->Items = StatsAccumulatorBatch(accumulators);
+	log(DEBUG,
+	    "[SMP] Finished computing job with id " + std::to_string(currentJob->Id) + ". Computed " + std::to_string(
+		    currentJob->getNChunks()) + " chunks. Chunk size is " + std::to_string(chunkSizeBytes) + " bytes");
+}
+
+void CpuDeviceCoordinator::processGroups(const std::vector<double>& buffer) {
+	if (!keyLoader) {
+		return;
+	}
+
+	const auto keys = keyLoader->loadJobKeysIntoVector(*currentJob);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, buffer.size(), GROUP_BY_GRAIN_SIZE),
+	                  [&](const tbb::blocked_range<size_t> r) {
+		                  auto& table = groupTables.local();
+		                  for (auto i = r.begin(); i < r.end(); i += 1) {
+			                  table.push(keys[i], buffer[i]);
+		                  }
+	                  });
+}
+
+std::vector<KeyStats> CpuDeviceCoordinator::mergeGroups() {
+	auto tables = std::vector<const GroupTable*>();
+	for (const auto& table : groupTables) {
+		tables.push_back(&table);
+	}
+
+	log(DEBUG, "[SMP] Merging " + std::to_string(tables.size()) + " thread-local group tables of NUMA node " +
+	    std::to_string(numaNodeId));
+	return arena.execute([&] {
+		return mergeGroupTables(tables);
+	});
+}
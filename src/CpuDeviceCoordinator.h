@@ -1,8 +1,11 @@
 #pragma once
 #include <filesystem>
+#include <future>
+#include <tbb/task_arena.h>
 
 #include "ProcessingConfig.h"
 #include "DeviceCoordinator.h"
+#include "GroupTable.h"
 
 
 namespace fs = std::filesystem;
@@ -12,6 +15,48 @@ namespace fs = std::filesystem;
  *        to compute the data
  */
 class CpuDeviceCoordinator : public DeviceCoordinator {
+
+	/**
+	 * \brief Arena where all parallel work of this coordinator runs. If the coordinator is bound to a NUMA node the
+	 *		  threads of the arena are pinned to it
+	 */
+	tbb::task_arena arena;
+
+	/**
+	 * \brief NUMA node of this coordinator, tbb::task_arena::automatic if it is not bound to any
+	 */
+	int numaNodeId;
+
+	/**
+	 * \brief Maximum size of the buffer of a single job in bytes
+	 */
+	size_t cpuBufferSizeBytes;
+
+	/**
+	 * \brief Loader for the key file, nullptr if values are not grouped by key
+	 */
+	std::unique_ptr<DataLoader> keyLoader = nullptr;
+
+	/**
+	 * \brief Group tables of each thread - these are kept for all jobs and merged once the whole file is processed
+	 */
+	tbb::enumerable_thread_specific<GroupTable> groupTables;
+
+	/**
+	 * \brief Separate loader for read-ahead so that it does not share the file stream with the current job
+	 */
+	DataLoader readAheadLoader;
+
+	/**
+	 * \brief Data of the next queued job that are being read while the current job is computed
+	 */
+	std::future<std::vector<double>> readAheadBuffer;
+
+	/**
+	 * \brief Id of the job whose data are in readAheadBuffer
+	 */
+	size_t readAheadJobId = SIZE_MAX;
+
 public:
 	/**
 	 * \brief Creates new CPU device coordinator instance
@@ -20,10 +65,14 @@ public:
 	 * \param jobFinishedCallback callback after job is finished
 	 * \param notifyWatchdogCallback callback for notifying watchdog
 	 * \param errCallback callback for error handling
+	 * \param claimJobCallback callback for claiming the next job
 	 * \param chunkSizeBytes size of the chunk in bytes
 	 * \param bytesPerAccumulator number of bytes processed by each StatsAccumulator
 	 * \param cpuBufferSizeBytes buffer size in bytes
 	 * \param distFilePath path to the file that is being processed
+	 * \param keyFilePath path to the file with keys, empty if values are not grouped by key
+	 * \param numaNodeId NUMA node the threads are bound to, tbb::task_arena::automatic for no binding
+	 * \param maxConcurrency number of threads of this coordinator, tbb::task_arena::automatic for all threads of the node
 	 * \param id id of this coordinator
 	 */
 	CpuDeviceCoordinator(CoordinatorType coordinatorType,
@@ -31,16 +80,91 @@ public:
 	                     const std::function<void(std::unique_ptr<Job>, size_t)>& jobFinishedCallback,
 	                     const std::function<void(size_t)>& notifyWatchdogCallback,
 	                     const std::function<void(CoordinatorErr)>& errCallback,
+	                     const std::function<std::unique_ptr<Job>(size_t)>& claimJobCallback,
 	                     size_t chunkSizeBytes,
 	                     size_t bytesPerAccumulator,
 	                     size_t cpuBufferSizeBytes,
 	                     fs::path& distFilePath,
+	                     const fs::path& keyFilePath,
+	                     int numaNodeId,
+	                     int maxConcurrency,
 	                     size_t id
 	);
 
+	/**
+	 * \brief Merges group tables of all threads of this coordinator within its arena. Must be called once all jobs
+	 *		  are processed
+	 * \return statistics for each key sorted by the key
+	 */
+	std::vector<KeyStats> mergeGroups();
+
+	/**
+	 * \brief Reopens the loaders for the next files, recomputes the job limits for their chunk size and clears the
+	 *		  group tables of the previous run
+	 * \param fileSegments files that are processed in the next run and their chunks
+	 * \param keyFilePath path to the file with keys, empty if values are not grouped by key
+	 * \param runChunkSizeBytes chunk size in bytes for the files
+	 */
+	void prepareRun(const std::vector<FileSegment>& fileSegments, const fs::path& keyFilePath,
+	                size_t runChunkSizeBytes) override;
+
+	/**
+	 * \brief The last accumulator of a CPU job takes the remaining values, therefore any job that fits into the buffer
+	 *		  can be processed
+	 * \param job job
+	 * \return true if the job fits into the buffer, false otherwise
+	 */
+	bool canProcessJob(const Job& job) override {
+		return job.getNChunks() <= getMaxNumberOfChunks();
+	}
+
 protected:
 	/**
-	 * \brief Override for CPU device without AVX2
+	 * \brief Histograms of each thread for each column - these are kept for all jobs, once a job is computed they are
+	 *		  moved into the histograms of the job
+	 */
+	tbb::enumerable_thread_specific<std::vector<Histogram>> threadHistograms;
+
+	/**
+	 * \brief Returns histograms of the calling thread, one for each column of the current job
+	 * \return histograms of the thread
+	 */
+	std::vector<Histogram>& localHistograms();
+
+	/**
+	 * \brief Adds histograms of all threads to the histograms of the current job and clears them for the next job
+	 */
+	void moveThreadHistogramsToJob();
+
+	/**
+	 * \brief Returns data of the current job - either from the read-ahead or loaded right away. Then starts read-ahead
+	 *		  of the next queued job, if there is any
+	 * \return data of the current job
+	 */
+	std::vector<double> loadJobData();
+
+	/**
+	 * \brief Runs computeJob in the arena of this coordinator so that the data are loaded and processed by the threads
+	 *		  of its NUMA node
+	 */
+	void onProcessJob() final;
+
+	/**
+	 * \brief Computes the current job, override for CPU device without AVX2
+	 */
+	virtual void computeJob();
+
+	/**
+	 * \brief Processes job containing interleaved records of multiple columns. Computes StatsAccumulator for each
+	 *		  column and CoMomentAccumulator for the whole record
+	 * \param buffer buffer with the job data
+	 */
+	virtual void processColumns(const std::vector<double>& buffer);
+
+	/**
+	 * \brief Loads keys of the current job and pushes the values into the group table of each thread. Does nothing
+	 *		  if values are not grouped by key
+	 * \param buffer buffer with the job data
 	 */
-	void onProcessJob() override;
+	void processGroups(const std::vector<double>& buffer);
 };
@@ -1,17 +1,57 @@
+#include <algorithm>
+
 #include "DataLoader.h"
 
 DataLoader::DataLoader(const fs::path& filePath, const size_t chunkSizeBytes) : ChunkSizeBytes(chunkSizeBytes) {
-	file.open(filePath, std::ios::in | std::ios::binary);
+	open(filePath, chunkSizeBytes);
+}
+
+void DataLoader::open(const fs::path& filePath, const size_t chunkSizeBytes) {
+	open(std::vector{FileSegment{filePath}}, chunkSizeBytes);
+}
+
+void DataLoader::open(const std::vector<FileSegment>& fileSegments, const size_t chunkSizeBytes) {
+	ChunkSizeBytes = chunkSizeBytes;
+	segments = fileSegments;
+	openSegment(0);
+}
+
+void DataLoader::openSegment(const size_t segmentIdx) {
+	if (file.is_open()) {
+		file.close();
+	}
+
+	openSegmentIdx = segmentIdx;
+	file.clear();
+	file.open(segments[segmentIdx].FilePath, std::ios::in | std::ios::binary);
 	if (!file.is_open()) {
-		throw std::runtime_error("Unable to open file: " + filePath.string());
+		throw std::runtime_error("Unable to open file: " + segments[segmentIdx].FilePath.string());
+	}
+}
+
+void DataLoader::seekChunk(const size_t chunkIdx, const size_t offsetBytes) {
+	// Segments are sorted, the first one ending after the chunk contains it
+	const auto it = std::upper_bound(segments.begin(), segments.end(), chunkIdx,
+	                                 [](const size_t idx, const FileSegment& segment) {
+		                                 return idx < segment.EndChunkIdx;
+	                                 });
+	const auto segmentIdx = std::min<size_t>(it - segments.begin(), segments.size() - 1);
+	if (segmentIdx != openSegmentIdx) {
+		openSegment(segmentIdx);
 	}
+
+	const auto address = (chunkIdx - segments[segmentIdx].StartChunkIdx) * ChunkSizeBytes + offsetBytes;
+	file.seekg(static_cast<int64_t>(address), std::ios::beg);
 }
 
 std::vector<double> DataLoader::loadJobDataIntoVector(const Job& job) {
-	const auto [startIdx, endIdx] = job.ChunkIdxRange;
+	return loadChunksIntoVector(job.ChunkIdxRange);
+}
+
+std::vector<double> DataLoader::loadChunksIntoVector(const std::pair<size_t, size_t> chunkIdxRange) {
+	const auto [startIdx, endIdx] = chunkIdxRange;
 	const auto nChunks = endIdx - startIdx;
 	const auto bytesToRead = nChunks * ChunkSizeBytes;
-	const auto address = startIdx * ChunkSizeBytes;
 
 	// Create memory buffer, note that we assume that chunkSizeBytes is a multiple of sizeof(double)
 	auto buffer = std::vector<double>(bytesToRead / sizeof(double));
@@ -20,7 +60,7 @@ std::vector<double> DataLoader::loadJobDataIntoVector(const Job& job) {
 	}
 
 	// Move to correct address in the file
-	file.seekg(static_cast<int64_t>(address), std::ios::beg);
+	seekChunk(startIdx);
 
 	// Read data into the buffer
 	file.read(reinterpret_cast<char*>(buffer.data()), static_cast<int64_t>(bytesToRead));
@@ -29,40 +69,59 @@ std::vector<double> DataLoader::loadJobDataIntoVector(const Job& job) {
 	return buffer;
 }
 
-void DataLoader::loadChunksIntoDeviceBuffer(
-	const size_t nAccumulators,
-	const size_t nChunks,
-	const size_t startIdx,
-	const size_t bytesProcessedPerAccumulator,
-	const size_t totalBytesPerAccumulator,
-	const cl::Buffer& buffer,
-	const cl::CommandQueue& commandQueue
-) {
-
-	const auto bytesToRead = nChunks * ChunkSizeBytes;
+std::vector<uint32_t> DataLoader::loadJobKeysIntoVector(const Job& job) {
+	const auto [startIdx, endIdx] = job.ChunkIdxRange;
 
-	// Create host buffer
-	auto hostBuffer = std::vector<double>(bytesToRead / sizeof(double));
+	// Keys are matched to the values by their index, a job that splits a value would shift all of its keys
+	if (startIdx * ChunkSizeBytes % sizeof(double) != 0 || endIdx * ChunkSizeBytes % sizeof(double) != 0) {
+		throw std::runtime_error("Job " + std::to_string(job.Id) + " does not start and end at a value boundary, " +
+		                         "its keys cannot be loaded");
+	}
 
-	const auto bytesPerAccumulator = bytesToRead / nAccumulators;
+	const auto nKeys = (endIdx - startIdx) * ChunkSizeBytes / sizeof(double);
+	const auto address = startIdx * ChunkSizeBytes / sizeof(double) * sizeof(uint32_t);
 
-	// Iterate over each accumulator and load data for processing
-	for (auto accumulatorId = 0ULL; accumulatorId < nAccumulators; accumulatorId += 1) {
+	auto buffer = std::vector<uint32_t>(nKeys);
+	if (buffer.empty()) {
+		return buffer;
+	}
 
-		// Compute address for the current accumulator - i.e. start position in the file + accumulatorId * accumulator offset + 
-		const auto address = startIdx * ChunkSizeBytes + accumulatorId * totalBytesPerAccumulator +
-			bytesProcessedPerAccumulator;
+	file.seekg(static_cast<int64_t>(address), std::ios::beg);
+	file.read(reinterpret_cast<char*>(buffer.data()), static_cast<int64_t>(nKeys * sizeof(uint32_t)));
+	return buffer;
+}
 
-		// Move to the address
-		file.seekg(static_cast<int64_t>(address), std::ios::beg);
+void DataLoader::loadChunksIntoHostBuffer(
+	const size_t startIdx,
+	const size_t offsetBytes,
+	const size_t nBytes,
+	double* hostBuffer,
+	Histogram& histogram
+) {
+	// Data are read in the same layout as in the file, therefore the whole range is read at once
+	seekChunk(startIdx, offsetBytes);
+	file.read(reinterpret_cast<char*>(hostBuffer), static_cast<int64_t>(nBytes));
 
-		// Read bytes to the buffer
-		file.read(reinterpret_cast<char*>(hostBuffer.data() + accumulatorId * bytesPerAccumulator / sizeof(double)),
-		          static_cast<int64_t>(bytesPerAccumulator));
+	const auto nValues = nBytes / sizeof(double);
+	for (auto i = 0ULL; i < nValues; i += 1) {
+		histogram.push(hostBuffer[i]);
 	}
+}
+
+void DataLoader::loadChunksIntoDeviceBuffer(
+	const size_t startIdx,
+	const size_t offsetBytes,
+	const size_t nBytes,
+	const cl::Buffer& buffer,
+	double* stagingBuffer,
+	const cl::CommandQueue& commandQueue,
+	Histogram& histogram,
+	cl::Event& transferEvent
+) {
+	loadChunksIntoHostBuffer(startIdx, offsetBytes, nBytes, stagingBuffer, histogram);
 
-	if (const auto returnValue = commandQueue.enqueueWriteBuffer(buffer, CL_TRUE, 0, nChunks * ChunkSizeBytes,
-	                                                             hostBuffer.data());
+	if (const auto returnValue = commandQueue.enqueueWriteBuffer(buffer, CL_FALSE, 0, nBytes, stagingBuffer, nullptr,
+	                                                             &transferEvent);
 		returnValue != CL_SUCCESS) {
 		throw std::runtime_error("Could not allocate memory on the device, the program cannot continue!");
 	}
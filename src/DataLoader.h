@@ -2,26 +2,49 @@
 
 #include <fstream>
 #include <filesystem>
+#include <vector>
 
-#define NOMINMAX
-#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
-#define CL_HPP_TARGET_OPENCL_VERSION 200
-#define CL_TARGET_OPENCL_VERSION 200
-#include <CL/opencl.hpp>
-
+#include "ClConfig.h"
+#include "FileChunkHandler.h"
+#include "Histogram.h"
 #include "Job.h"
 
 namespace fs = std::filesystem;
 
 /**
- * \brief Simple class that wraps file reading
+ * \brief Simple class that wraps file reading. The loader can read several files laid out in a single chunk space,
+ *		  the file containing the requested chunks is opened on demand
  */
 class DataLoader {
 private:
 	std::ifstream file;
 
+	/**
+	 * \brief Files the chunks are read from
+	 */
+	std::vector<FileSegment> segments;
+
+	/**
+	 * \brief Index of the segment whose file is open
+	 */
+	size_t openSegmentIdx = 0;
+
+	/**
+	 * \brief Closes the current file and opens file of the segment
+	 * \param segmentIdx index of the segment
+	 */
+	void openSegment(size_t segmentIdx);
+
+	/**
+	 * \brief Moves the read position to the chunk, the file containing the chunk is opened if it is not open yet.
+	 *		  A single read must not span two files
+	 * \param chunkIdx index of the chunk
+	 * \param offsetBytes offset from the start of the chunk in bytes
+	 */
+	void seekChunk(size_t chunkIdx, size_t offsetBytes = 0);
+
 public:
-	const size_t ChunkSizeBytes;
+	size_t ChunkSizeBytes;
 
 	/**
 	 * \brief Creates new data loader
@@ -30,6 +53,21 @@ public:
 	 */
 	explicit DataLoader(const fs::path& filePath, const size_t chunkSizeBytes);
 
+	/**
+	 * \brief Closes the current file and opens another one, this way the loader can be reused for successive files
+	 * \param filePath path to the file
+	 * \param chunkSizeBytes size of one chunk, must be a multiple of sizeof(double)
+	 */
+	void open(const fs::path& filePath, size_t chunkSizeBytes);
+
+	/**
+	 * \brief Closes the current file and reads the chunks from several files from now on, the first one is opened
+	 *		  right away
+	 * \param fileSegments files laid out one after another in the chunk space
+	 * \param chunkSizeBytes size of one chunk, must be a multiple of sizeof(double)
+	 */
+	void open(const std::vector<FileSegment>& fileSegments, size_t chunkSizeBytes);
+
 	/**
 	 * \brief Loads all job data into buffer and returns it
 	 * \param job job
@@ -38,23 +76,59 @@ public:
 	std::vector<double> loadJobDataIntoVector(const Job& job);
 
 	/**
-	 * \brief Loads chunks into device buffer
-	 * \param nAccumulators number of accumulators to load for
-	 * \param nChunks number of chunks to load
-	 * \param startIdx starting chunk index in the file
-	 * \param bytesProcessedPerAccumulator offset for each accumulator in bytes
-	 * \param totalBytesPerAccumulator total bytes per accumulator
+	 * \brief Loads all data of the chunk range into buffer and returns it
+	 * \param chunkIdxRange start index (inclusive) and end index (exclusive) of the chunks
+	 * \return vector of doubles containing all loaded data
+	 */
+	std::vector<double> loadChunksIntoVector(std::pair<size_t, size_t> chunkIdxRange);
+
+	/**
+	 * \brief Loads uint32 keys aligned with the job data - i.e. this loader must be opened on the key file which
+	 *		  contains one key for each double of the value file. ChunkSizeBytes refers to the value file
+	 * \param job job, must start and end at a value boundary
+	 * \return vector containing key for each double of the job
+	 */
+	std::vector<uint32_t> loadJobKeysIntoVector(const Job& job);
+
+	/**
+	 * \brief Loads contiguous range of bytes into host buffer
+	 * \param startIdx index of the chunk the range is relative to
+	 * \param offsetBytes offset of the range from the start of the chunk in bytes
+	 * \param nBytes number of bytes to load, must be a multiple of sizeof(double)
+	 * \param hostBuffer host buffer, must hold at least nBytes bytes
+	 * \param histogram histogram to which the loaded values are added
+	 */
+	void loadChunksIntoHostBuffer(
+		size_t startIdx,
+		size_t offsetBytes,
+		size_t nBytes,
+		double* hostBuffer,
+		Histogram& histogram
+	);
+
+	/**
+	 * \brief Loads contiguous range of bytes into device buffer
+	 * \param startIdx index of the chunk the range is relative to
+	 * \param offsetBytes offset of the range from the start of the chunk in bytes
+	 * \param nBytes number of bytes to load, must be a multiple of sizeof(double)
 	 * \param buffer device buffer
+	 * \param stagingBuffer host buffer the data are read into before they are written to the device, must hold at
+	 *		  least nBytes bytes
 	 * \param commandQueue command queue for the device
+	 * \param histogram histogram to which the loaded values are added - the data are already in the host memory so
+	 *		  this is done here instead of on the device
+	 * \param transferEvent event of the transfer to the device - the transfer is asynchronous, therefore the staging
+	 *		  buffer must not be modified until the event completes
 	 */
 	void loadChunksIntoDeviceBuffer(
-		size_t nAccumulators,
-		size_t nChunks,
 		size_t startIdx,
-		size_t bytesProcessedPerAccumulator,
-		size_t totalBytesPerAccumulator,
+		size_t offsetBytes,
+		size_t nBytes,
 		const cl::Buffer& buffer,
-		const cl::CommandQueue& commandQueue
+		double* stagingBuffer,
+		const cl::CommandQueue& commandQueue,
+		Histogram& histogram,
+		cl::Event& transferEvent
 	);
 
 };
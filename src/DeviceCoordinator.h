@@ -1,11 +1,19 @@
 #pragma once
+#include <chrono>
+#include <deque>
 #include <functional>
+#include <map>
+#include <optional>
+#include <utility>
 
 #include "ProcessingConfig.h"
 #include "Job.h"
 #include "ConcurrencyUtils.h"
 #include "DataLoader.h"
+#include "Histogram.h"
 #include "Logging.h"
+#include "StageProfiler.h"
+#include "StatUtils.h"
 
 enum CoordinatorType {
 	TBB = 0,
@@ -64,15 +72,79 @@ protected:
 	 */
 	std::function<void(CoordinatorErr)> errCallback;
 
+	/**
+	 * \brief Callback for claiming the next job - coordinators pull the work themselves. Returns nullptr once there
+	 *		  is nothing left to process
+	 */
+	std::function<std::unique_ptr<Job>(size_t)> claimJobCallback;
+
 	bool isEnabled = true;
 	std::unique_ptr<Job> currentJob = nullptr; // Reference to the current job
 
-	std::mutex jobMutex; // Mutex for assigning job
+	/**
+	 * \brief Jobs claimed by this coordinator that wait for processing
+	 */
+	std::deque<std::unique_ptr<Job>> jobQueue;
+
+	/**
+	 * \brief Maximum number of jobs claimed by this coordinator at once - i.e. queued and the one being processed
+	 */
+	size_t queueDepth = 1;
+
+	std::mutex jobMutex; // Mutex for the job queue
+
+	/**
+	 * \brief Id and chunks of the job being processed, empty between the jobs. Guarded by jobMutex
+	 */
+	std::optional<std::pair<size_t, std::pair<size_t, size_t>>> runningJob;
+
+	/**
+	 * \brief Id of the queued job whose data are already being read ahead, such job is never given back to another
+	 *		  coordinator. Guarded by jobMutex
+	 */
+	std::optional<size_t> reservedJobId;
+
+	/**
+	 * \brief Time of the last progress (start of a job or processed data) in nanoseconds of the steady clock
+	 */
+	std::atomic<int64_t> lastProgressNanos = 0;
+
+	/**
+	 * \brief Whether the coordinator stalled and does not get any more jobs
+	 */
+	std::atomic<bool> isQuarantined = false;
+
+	/**
+	 * \brief Time spent processing jobs and time spent waiting for the next job once the first job was started
+	 */
+	std::atomic<int64_t> busyNanos = 0;
+	std::atomic<int64_t> idleNanos = 0;
+
+	/**
+	 * \brief Latencies of the pipeline stages of this coordinator, only recorded if profiling is compiled in
+	 */
+	StageProfiler stageProfiler;
+
+	/**
+	 * \brief Histogram of the values of the current job for each column - allocated once and reused for all jobs
+	 */
+	std::vector<Histogram> jobHistograms;
+
+	/**
+	 * \brief Histograms of all accepted jobs of the run for each file of the run, taken by the scheduler once the run
+	 *		  is finished. Guarded by the coordinator mutex of the scheduler
+	 */
+	std::map<size_t, std::vector<Histogram>> runHistograms;
 
 	/**
-	 * \brief Semaphore used to synchronize access with JobScheduler
+	 * \brief Semaphore used to start the processing of a run or to wake up the thread for termination
 	 */
 	std::shared_ptr<ConcurrencyUtils::Semaphore> semaphore = std::make_shared<ConcurrencyUtils::Semaphore>(0);
+
+	/**
+	 * \brief Released by the thread once it has nothing left to claim in the current run and waits for the next one
+	 */
+	ConcurrencyUtils::Semaphore runFinishedSemaphore = ConcurrencyUtils::Semaphore(0);
 	std::atomic<bool> keepRunning = true; // Whether the coordinator thread should terminate
 	std::thread coordinatorThread; // Thread that is responsible for processing jobs
 
@@ -87,16 +159,16 @@ protected:
 	 */
 	size_t maxNumberOfChunksPerJob{};
 
-
 	/**
-	 * \brief Number of bytes per StatsAccumulator object - this dictates how many StatsAccumulator objects are computed
+	 * \brief Number of chunks processed by a single accumulator of this coordinator - jobs should be a multiple of
+	 *		  this so that the work is split evenly
 	 */
-	size_t bytesPerAccumulator;
+	size_t jobGranularityChunks = 1;
 
 	/**
-	 * \brief Path to the file that is being processed
+	 * \brief Number of bytes per StatsAccumulator object - this dictates how many StatsAccumulator objects are computed
 	 */
-	fs::path& filePath;
+	size_t bytesPerAccumulator;
 
 	/**
 	 * \brief Type of the coordinator - mostly used for debugging
@@ -121,6 +193,7 @@ public:
 	 * \param jobFinishedCallback callback after job is finished
 	 * \param notifyWatchdogCallback callback for notifying watchdog
 	 * \param errCallback error callback for error handling
+	 * \param claimJobCallback callback for claiming the next job
 	 * \param chunkSizeBytes chunk size in bytes
 	 * \param bytesPerAccumulator number of bytes processed by each StatsAccumulator
 	 * \param distFilePath path to the file that is being processed
@@ -131,19 +204,24 @@ public:
 	                  std::function<void(std::unique_ptr<Job>, size_t)> jobFinishedCallback,
 	                  std::function<void(size_t)> notifyWatchdogCallback,
 	                  std::function<void(CoordinatorErr)> errCallback,
+	                  std::function<std::unique_ptr<Job>(size_t)> claimJobCallback,
 	                  const size_t chunkSizeBytes,
 	                  const size_t bytesPerAccumulator,
 	                  fs::path& distFilePath,
 	                  const size_t id):
 		jobFinishedCallback(std::move(jobFinishedCallback)),
-		notifyWatchdogCallback(std::move(notifyWatchdogCallback)),
+		// Each notification of the watchdog is progress of this coordinator as well
+		notifyWatchdogCallback([this, callback = std::move(notifyWatchdogCallback)](const size_t bytesProcessed) {
+			lastProgressNanos = steadyClockNanos();
+			callback(bytesProcessed);
+		}),
 		errCallback(std::move(errCallback)),
+		claimJobCallback(std::move(claimJobCallback)),
 		chunkSizeBytes(chunkSizeBytes),
 		bytesPerAccumulator(bytesPerAccumulator),
-		filePath(distFilePath),
 		coordinatorType(coordinatorType),
 		id(id),
-		dataLoader(filePath, chunkSizeBytes) {
+		dataLoader(distFilePath, chunkSizeBytes) {
 
 		// Depending on the processing mode CPU coordinator may not be used and thus we don't want to create
 		// an unnecessary thread - i.e. we check the coordinator type and processing mode, if they are
@@ -182,14 +260,108 @@ public:
 	}
 
 	/**
-	 * \brief Assigns job to the coordinator
-	 * \param job job to be assigned
+	 * \brief Starts claiming and processing jobs of the next run, the thread waits for this between the runs
 	 */
-	void assignJob(Job job) {
-		currentJob = std::make_unique<Job>(std::move(job));
+	void start() {
 		semaphore->release();
 	}
 
+	/**
+	 * \brief Blocks until the thread finishes the run started by start() - i.e. it has nothing left to claim and it
+	 *		  waits for the next run. Must be called exactly once after each start()
+	 */
+	void waitForRunFinished() {
+		runFinishedSemaphore.acquire();
+	}
+
+	/**
+	 * \brief Non-blocking variant of waitForRunFinished() - used for runs of a quarantined coordinator that nobody
+	 *		  waited for
+	 * \return true if the thread finished the run, false if it is still in it
+	 */
+	bool tryWaitForRunFinished() {
+		return runFinishedSemaphore.tryAcquire();
+	}
+
+	/**
+	 * \brief Prepares the coordinator for processing of other files. Must only be called while the thread waits for
+	 *		  the next run - i.e. before the first start() or after waitForRunFinished(). The key file is only used by
+	 *		  coordinators that group the values by key
+	 * \param fileSegments files that are processed in the next run and their chunks
+	 * \param runChunkSizeBytes chunk size in bytes for the files
+	 */
+	virtual void prepareRun(const std::vector<FileSegment>& fileSegments, const fs::path&,
+	                        const size_t runChunkSizeBytes) {
+		chunkSizeBytes = runChunkSizeBytes;
+		dataLoader.open(fileSegments, chunkSizeBytes);
+		busyNanos = 0;
+		idleNanos = 0;
+		stageProfiler.reset();
+		runHistograms.clear();
+		reservedJobId.reset();
+	}
+
+	/**
+	 * \brief Sets maximum number of jobs claimed by this coordinator at once
+	 * \param depth queue depth, at least 1
+	 */
+	void setQueueDepth(const size_t depth) {
+		queueDepth = std::max<size_t>(1, depth);
+	}
+
+	/**
+	 * \brief Returns maximum number of jobs claimed by this coordinator at once
+	 * \return queue depth
+	 */
+	[[nodiscard]] size_t getQueueDepth() const {
+		return queueDepth;
+	}
+
+	/**
+	 * \brief Returns utilization of the coordinator - i.e. how long it was busy and how long it waited for jobs
+	 * \return formatted string
+	 */
+	[[nodiscard]] std::string getUtilizationInfo() const {
+		const auto busyMs = busyNanos.load() / 1000000;
+		const auto idleMs = idleNanos.load() / 1000000;
+		const auto totalMs = busyMs + idleMs;
+		const auto idlePercent = totalMs > 0 ? 100.0 * static_cast<double>(idleMs) / static_cast<double>(totalMs) : 0.0;
+		return getInfo() + " was busy for " + std::to_string(busyMs) + " ms and idle for " +
+			std::to_string(idleMs) + " ms (" + StatUtils::doubleToStr(idlePercent, 3) + "% idle)";
+	}
+
+	/**
+	 * \brief Returns latencies of the pipeline stages of this coordinator
+	 * \return stage profiler of the coordinator
+	 */
+	StageProfiler& getStageProfiler() {
+		return stageProfiler;
+	}
+
+	/**
+	 * \brief Adds histograms of the finished job to the histograms of its file. Called by the scheduler once it accepts
+	 *		  the job, therefore discarded copies of a re-issued job are not counted
+	 * \param fileIdx index of the file of the run the job belongs to
+	 */
+	void acceptJobHistograms(const size_t fileIdx) {
+		auto& fileHistograms = runHistograms[fileIdx];
+		if (fileHistograms.size() != jobHistograms.size()) {
+			fileHistograms = std::vector<Histogram>(jobHistograms.size());
+		}
+
+		for (auto column = 0ULL; column < jobHistograms.size(); column += 1) {
+			fileHistograms[column] += jobHistograms[column];
+		}
+	}
+
+	/**
+	 * \brief Returns histograms of all accepted jobs of the run and clears them
+	 * \return histogram for each column for each file, files without a job finished by the coordinator are missing
+	 */
+	std::map<size_t, std::vector<Histogram>> takeRunHistograms() {
+		return std::exchange(runHistograms, {});
+	}
+
 	/**
 	 * \brief Terminates running thread by setting keepRunning to false
 	 */
@@ -207,17 +379,173 @@ public:
 		return maxNumberOfChunksPerJob;
 	}
 
+	/**
+	 * \brief Returns number of chunks that job sizes should be a multiple of
+	 * \return job granularity in chunks, at least 1
+	 */
+	[[nodiscard]] size_t getJobGranularity() const {
+		return std::max<size_t>(1, jobGranularityChunks);
+	}
+
+	/**
+	 * \brief Returns whether the job can be processed by this coordinator without losing any data - i.e. it fits into
+	 *		  the job size limit and it is either a multiple of the granularity or smaller than it
+	 * \param job job
+	 * \return true if the job can be processed, false otherwise
+	 */
+	virtual bool canProcessJob(const Job& job) {
+		const auto nChunks = job.getNChunks();
+		const auto granularity = getJobGranularity();
+		return nChunks <= getMaxNumberOfChunks() && (nChunks % granularity == 0 || nChunks < granularity);
+	}
+
+	/**
+	 * \brief Returns number of claimed jobs that wait for processing
+	 * \return number of queued jobs
+	 */
+	[[nodiscard]] size_t getNQueuedJobs() {
+		auto scopedLock = std::scoped_lock(jobMutex);
+		return jobQueue.size();
+	}
+
+	/**
+	 * \brief Returns the job being processed if the coordinator made no progress on it for longer than the timeout
+	 * \param timeout stall timeout
+	 * \return id and chunks of the stalled job, empty if the coordinator is not stalled
+	 */
+	std::optional<std::pair<size_t, std::pair<size_t, size_t>>> getStalledJob(const std::chrono::milliseconds timeout) {
+		auto scopedLock = std::scoped_lock(jobMutex);
+		const auto sinceProgress = std::chrono::nanoseconds{steadyClockNanos() - lastProgressNanos.load()};
+		if (!runningJob || sinceProgress < timeout) {
+			return std::nullopt;
+		}
+
+		return runningJob;
+	}
+
+	/**
+	 * \brief Quarantines the coordinator - it does not get any more jobs and gives back all jobs it did not start yet.
+	 *		  The job being processed is left to finish (if it ever does)
+	 * \return queued jobs that were not started
+	 */
+	std::vector<std::unique_ptr<Job>> quarantine() {
+		isQuarantined = true;
+		auto scopedLock = std::scoped_lock(jobMutex);
+		auto queuedJobs = std::vector<std::unique_ptr<Job>>();
+		while (!jobQueue.empty()) {
+			queuedJobs.push_back(std::move(jobQueue.front()));
+			jobQueue.pop_front();
+		}
+
+		return queuedJobs;
+	}
+
+	/**
+	 * \brief Returns whether the coordinator was quarantined after it stalled
+	 * \return true if the coordinator is quarantined, false otherwise
+	 */
+	[[nodiscard]] bool quarantined() const {
+		return isQuarantined;
+	}
+
+	/**
+	 * \brief Lets the quarantined coordinator get jobs again. Must only be called once its thread finished all runs
+	 *		  it was started for, i.e. its stalled job returned
+	 */
+	void releaseQuarantine() {
+		isQuarantined = false;
+	}
+
+	/**
+	 * \brief Gives back the most recently queued job that was not started yet so that an idle coordinator can process
+	 *		  it instead of waiting until this coordinator finishes its current job. The job whose data are being read
+	 *		  ahead is kept, otherwise the read would be wasted and the next job of this coordinator would wait for it
+	 * \param canProcess whether the coordinator taking the job over can process it
+	 * \return the queued job, nullptr if there is none, it is being read ahead or the other coordinator cannot process
+	 *		   it
+	 */
+	std::unique_ptr<Job> giveBackQueuedJob(const std::function<bool(const Job&)>& canProcess) {
+		auto scopedLock = std::scoped_lock(jobMutex);
+		if (jobQueue.empty() || jobQueue.back()->Id == reservedJobId || !canProcess(*jobQueue.back())) {
+			return nullptr;
+		}
+
+		auto job = std::move(jobQueue.back());
+		jobQueue.pop_back();
+		return job;
+	}
+
 private:
+	/**
+	 * \brief Returns current time of the steady clock in nanoseconds
+	 * \return nanoseconds since the epoch of the steady clock
+	 */
+	static int64_t steadyClockNanos() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/**
+	 * \brief Clears histograms of the previous job, they are only reallocated if the number of columns changes
+	 * \param nColumns number of columns of the job
+	 */
+	void resetJobHistograms(const size_t nColumns) {
+		if (jobHistograms.size() != nColumns) {
+			jobHistograms = std::vector<Histogram>(nColumns);
+			return;
+		}
+
+		for (auto& histogram : jobHistograms) {
+			histogram.clear();
+		}
+	}
+
 	/**
 	 * \brief Main function of the coordinator thread
 	 */
 	void threadMain() {
 		log(DEBUG, "[DEVICECOORDINATOR] Coordinator " + std::to_string(id) + "'s thread started...");
-		while (keepRunning) {
+		while (true) {
+			// Wait until the next run is started or the coordinator is terminated
 			semaphore->acquire();
-			if (!currentJob) {
-				continue;
+			if (!keepRunning) {
+				break;
+			}
+
+			processRun();
+			runFinishedSemaphore.release();
+		}
+	}
+
+	/**
+	 * \brief Claims and processes jobs until there is nothing left to claim
+	 */
+	void processRun() {
+		auto processedAnyJob = false;
+		while (keepRunning) {
+			const auto waitStart = std::chrono::steady_clock::now();
+			fillJobQueue();
+			{
+				auto scopedLock = std::scoped_lock(jobMutex);
+				if (jobQueue.empty()) {
+					// Nothing left to claim
+					break;
+				}
+
+				currentJob = std::move(jobQueue.front());
+				jobQueue.pop_front();
+				runningJob = std::make_pair(currentJob->Id, currentJob->ChunkIdxRange);
+				lastProgressNanos = steadyClockNanos();
+			}
+			resetJobHistograms(currentJob->NColumns);
+
+			// Time before the first job is only the startup, not idling between jobs
+			const auto processingStart = std::chrono::steady_clock::now();
+			const auto waitNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(processingStart - waitStart);
+			if (processedAnyJob) {
+				idleNanos += waitNanos.count();
 			}
+			stageProfiler.record(STAGE_SCHEDULER_WAIT, waitNanos.count());
 
 			try {
 				processJob();
@@ -225,6 +553,40 @@ private:
 			catch (const std::runtime_error& err) {
 				errCallback({currentJob->Id, err.what(), id});
 			}
+
+			{
+				auto scopedLock = std::scoped_lock(jobMutex);
+				runningJob.reset();
+			}
+
+			busyNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - processingStart).count();
+			processedAnyJob = true;
+		}
+
+		log(DEBUG, "[DEVICECOORDINATOR] Coordinator " + std::to_string(id) + " has no more jobs to process");
+	}
+
+	/**
+	 * \brief Claims jobs until the queue is full or there is nothing left to claim. Only the current job is processed,
+	 *		  the queued ones can be read ahead
+	 */
+	void fillJobQueue() {
+		while (true) {
+			{
+				auto scopedLock = std::scoped_lock(jobMutex);
+				if (jobQueue.size() >= queueDepth) {
+					return;
+				}
+			}
+
+			auto job = claimJobCallback(id);
+			if (!job) {
+				return;
+			}
+
+			auto scopedLock = std::scoped_lock(jobMutex);
+			jobQueue.push_back(std::move(job));
 		}
 	}
 
@@ -232,11 +594,29 @@ private:
 	 * \brief Processes given job - calls onProcessJob implementation and then calls jobFinishedCallback
 	 */
 	void processJob() {
+		const auto processingStart = std::chrono::steady_clock::now();
 		onProcessJob();
+		currentJob->ProcessingNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - processingStart).count();
 		jobFinishedCallback(std::move(currentJob), id);
 	}
 
 protected:
+	/**
+	 * \brief Returns id and chunk range of the next queued job, if there is any, and keeps the job from being given
+	 *		  back to another coordinator - used for read-ahead
+	 * \return id and chunk range of the next job
+	 */
+	std::optional<std::pair<size_t, std::pair<size_t, size_t>>> reserveNextJob() {
+		auto scopedLock = std::scoped_lock(jobMutex);
+		if (jobQueue.empty()) {
+			return std::nullopt;
+		}
+
+		reservedJobId = jobQueue.front()->Id;
+		return std::make_pair(jobQueue.front()->Id, jobQueue.front()->ChunkIdxRange);
+	}
+
 	/**
 	 * \brief This method is overriden by given implementation and called in processJob method
 	 *		  Implementation must ensure that Watchdog is periodically notified - e.g. after each operation
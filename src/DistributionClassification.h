@@ -8,6 +8,9 @@
 #include <iomanip>
 #include <numeric>
 #include <sstream>
+#include "CoMomentAccumulator.h"
+#include "GoodnessOfFit.h"
+#include "GroupTable.h"
 #include "StatsAccumulator.h"
 
 using Point2D = std::pair<double, double>;
@@ -139,12 +142,35 @@ inline auto classifyStatsAccumulator(const StatsAccumulator& statsAccumulator) {
 	                      }, classificationNotes);
 }
 
+/**
+ * \brief Prints ranked goodness-of-fit results to the given output stream
+ * \param fits ranked fits
+ * \param output output stream
+ */
+inline void printFits(const std::vector<GoodnessOfFit::FitResult>& fits, std::ostream& output) {
+	if (fits.empty()) {
+		output << "Goodness-of-fit tests could not be evaluated" << "\n";
+		return;
+	}
+
+	output << "Goodness-of-fit (best fit first):" << "\n";
+	for (auto i = 0ULL; i < fits.size(); i += 1) {
+		const auto& fit = fits[i];
+		output << "  " << i + 1 << ". " << DISTRIBUTION_STR_LUT.at(fit.DistributionIdx)
+			<< " - chi-square: " << fit.ChiSquare << " (df = " << fit.DegreesOfFreedom
+			<< ", p-value: " << fit.ChiSquarePValue << ")"
+			<< ", KS: " << fit.KsStatistic << " (p-value: " << fit.KsPValue << ")" << "\n";
+	}
+}
+
 /**
  * \brief Classifies given distribution from passed StatsAccumulator object and writes results to given outputstream
  * \param statsAccumulator stats accumulator to classify
+ * \param histogram histogram of the values used for the goodness-of-fit tests
  * \param output output stream to write to
  */
-inline void classifyDistribution(const StatsAccumulator& statsAccumulator, std::ostream& output = std::cout) {
+inline void classifyDistribution(const StatsAccumulator& statsAccumulator, const Histogram& histogram,
+                                 std::ostream& output = std::cout) {
 	output << "\nResults" << "\n";
 	output << "-------" << "\n";
 
@@ -159,5 +185,114 @@ inline void classifyDistribution(const StatsAccumulator& statsAccumulator, std::
 	// And finally print to the stdout
 	output << "The distribution was classified as: \"" << distributionName << "\"" << "\n" << "\n";
 	printStats(statsAccumulator, classificationResult.Distance, output);
+	output << "\n";
+	printFits(GoodnessOfFit::rankFits(statsAccumulator, histogram), output);
+	output << std::endl;
+}
+
+/**
+ * \brief Prints covariance and correlation matrix of the columns
+ * \param coMoments accumulated co-moments
+ * \param output output stream
+ */
+inline void printCoMoments(const CoMomentAccumulator& coMoments, std::ostream& output) {
+	const auto nColumns = coMoments.getNColumns();
+	output << "Records with all values valid: " << coMoments.getN() << "\n";
+	output << "\nCovariance matrix" << "\n";
+	output << "-----------------" << "\n";
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		for (auto j = 0ULL; j < nColumns; j += 1) {
+			output << std::setw(14) << coMoments.getCovariance(i, j);
+		}
+		output << "\n";
+	}
+
+	output << "\nCorrelation matrix" << "\n";
+	output << "------------------" << "\n";
+	for (auto i = 0ULL; i < nColumns; i += 1) {
+		for (auto j = 0ULL; j < nColumns; j += 1) {
+			output << std::setw(14) << coMoments.getCorrelation(i, j);
+		}
+		output << "\n";
+	}
+	output << std::endl;
+}
+
+/**
+ * \brief Classifies each column of multi-column records separately and prints their covariance and correlation
+ * \param columnStats merged stats accumulator for each column
+ * \param histograms histogram for each column
+ * \param coMoments co-moments of the columns
+ * \param output output stream
+ */
+inline void classifyColumns(const std::vector<StatsAccumulator>& columnStats,
+                            const std::vector<Histogram>& histograms,
+                            const CoMomentAccumulator& coMoments,
+                            std::ostream& output = std::cout) {
+	for (auto column = 0ULL; column < columnStats.size(); column += 1) {
+		output << "\nColumn " << column << "\n";
+		output << "========" << "\n";
+		classifyDistribution(columnStats[column], histograms.at(column), output);
+	}
+
+	printCoMoments(coMoments, output);
+}
+
+/**
+ * \brief Prints statistics and classified distribution for each key
+ * \param groups statistics for each key sorted by the key
+ * \param output output stream
+ * \param limit maximum number of printed keys, the rest is only counted
+ */
+inline void printGroups(const std::vector<KeyStats>& groups, std::ostream& output,
+                        const size_t limit = std::numeric_limits<size_t>::max()) {
+	output << "\nResults per key (" << groups.size() << " keys)" << "\n";
+	output << "-------------------" << "\n";
+	output << std::setw(12) << "Key" << std::setw(14) << "N" << std::setw(14) << "Mean" << std::setw(14)
+		<< "Std. dev." << std::setw(14) << "Min" << std::setw(14) << "Skewness" << std::setw(14) << "Kurtosis"
+		<< "  Distribution" << "\n";
+
+	for (auto i = 0ULL; i < std::min(limit, groups.size()); i += 1) {
+		const auto& [key, statsAccumulator] = groups[i];
+		const auto [classificationResult, classificationNotes] = classifyStatsAccumulator(statsAccumulator);
+		output << std::setw(12) << key << std::setw(14) << statsAccumulator.getN() << std::setw(14)
+			<< statsAccumulator.getMean() << std::setw(14) << statsAccumulator.getStandardDeviation()
+			<< std::setw(14) << statsAccumulator.getMin() << std::setw(14) << statsAccumulator.getSkewness()
+			<< std::setw(14) << statsAccumulator.getKurtosis() << "  "
+			<< DISTRIBUTION_STR_LUT.at(classificationResult.DistributionIdx) << "\n";
+	}
+
+	if (groups.size() > limit) {
+		output << "... " << groups.size() - limit << " more keys, use output file to get all of them" << "\n";
+	}
 	output << std::endl;
 }
+
+/**
+ * \brief Prints all results of a run - classification of the distribution or of each column, and statistics per key
+ * \param columnStats merged stats accumulator for each column
+ * \param histograms histogram for each column
+ * \param coMoments co-moments of the columns, only printed for multiple columns
+ * \param groups statistics for each key sorted by the key
+ * \param groupByKey whether values were grouped by key
+ * \param output output stream
+ * \param groupLimit maximum number of printed keys
+ */
+inline void printResults(const std::vector<StatsAccumulator>& columnStats,
+                         const std::vector<Histogram>& histograms,
+                         const CoMomentAccumulator& coMoments,
+                         const std::vector<KeyStats>& groups,
+                         const bool groupByKey,
+                         std::ostream& output = std::cout,
+                         const size_t groupLimit = std::numeric_limits<size_t>::max()) {
+	if (columnStats.size() > 1) {
+		classifyColumns(columnStats, histograms, coMoments, output);
+	}
+	else {
+		classifyDistribution(columnStats[0], histograms.at(0), output);
+	}
+
+	if (groupByKey) {
+		printGroups(groups, output, groupLimit);
+	}
+}
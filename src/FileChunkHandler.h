@@ -2,10 +2,43 @@
 #include <filesystem>
 #include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <numeric>
+#include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 
+// Byte range covering the whole file - the end is clamped to the file size
+constexpr auto WHOLE_FILE_RANGE = std::pair<size_t, size_t>{0, SIZE_MAX};
+
+/**
+ * \brief File processed in a run and the chunks it occupies. Several files can be processed in a single run, they are
+ *		  laid out one after another in a single chunk space
+ */
+struct FileSegment {
+	fs::path FilePath; // path to the file
+	size_t StartChunkIdx = 0; // chunk the file starts at
+	size_t EndChunkIdx = SIZE_MAX; // end (exclusive) chunk of the file
+};
+
+/**
+ * \brief Contiguous part of the file with its own cursor
+ */
+struct FileRegion {
+	size_t StartChunkIdx = 0; // first chunk of the region
+	size_t EndChunkIdx = 0; // end (exclusive) chunk of the region
+	std::atomic<size_t> NextChunkIdx = 0; // next chunk to claim
+	size_t FileIdx = 0; // index of the file of the run the region belongs to
+};
+
+/**
+ * \brief Splits the file into chunks and hands them out to the coordinators. Chunks are claimed through an atomic
+ *		  cursor, therefore coordinators can claim work concurrently without any lock. The file can be split into
+ *		  several contiguous regions - each coordinator claims from its preferred region first and only then from the
+ *		  others
+ */
 class FileChunkHandler {
 
 public:
@@ -16,33 +49,144 @@ public:
 	 * \brief Default constructor for the object
 	 * \param distFilePath path to the file that is being processed
 	 * \param chunkSizeBytes chunk size in bytes
+	 * \param nRegions number of contiguous regions the file is split into, at least 1
+	 * \param byteRange range of bytes [first, second) to process, only whole chunks within the range are processed.
+	 *		  The range is clamped to the file
+	 * \param regionAlignmentChunks number of chunks the boundaries between the regions are a multiple of (relative to
+	 *		  the start of the range), at least 1
 	 */
-	FileChunkHandler(fs::path distFilePath, const size_t chunkSizeBytes) :
+	FileChunkHandler(fs::path distFilePath, const size_t chunkSizeBytes, const size_t nRegions = 1,
+	                 const std::pair<size_t, size_t> byteRange = WHOLE_FILE_RANGE,
+	                 const size_t regionAlignmentChunks = 1) :
 		ChunkSizeBytes(chunkSizeBytes),
 		distFilePath(std::move(distFilePath)),
 		fileSize(fs::file_size(this->distFilePath)),
 		// We throw away the last chunk if it is smaller than chunkSizeBytes
 		// The thrown away data are small enough so it won't affect the derived distribution
 		chunkCount(static_cast<size_t>(floor(static_cast<double>(fileSize) / static_cast<double>(chunkSizeBytes)))),
-		chunkSizeBytes(chunkSizeBytes) {
+		chunkSizeBytes(chunkSizeBytes),
+		regions(std::max<size_t>(1, nRegions)) {
+		// Chunk indices stay absolute within the file, therefore loaders do not need to know about the range
+		const auto rangeStart = std::min<size_t>(byteRange.first, fileSize);
+		const auto firstChunkIdx = std::min(chunkCount, (rangeStart + chunkSizeBytes - 1) / chunkSizeBytes);
+		const auto endChunkIdx = std::max(firstChunkIdx, std::min(chunkCount, byteRange.second / chunkSizeBytes));
+		const auto nChunks = endChunkIdx - firstChunkIdx;
+
+		// Regions must not split a record or leave a job smaller than an accumulator in the middle of the file,
+		// therefore the boundaries are rounded down to the alignment and the last region takes the remainder
+		const auto alignment = std::max<size_t>(1, regionAlignmentChunks);
+		const auto regionBoundary = [&](const size_t regionIdx) {
+			if (regionIdx == regions.size()) {
+				return endChunkIdx;
+			}
+
+			return firstChunkIdx + nChunks * regionIdx / regions.size() / alignment * alignment;
+		};
+		for (auto regionIdx = 0ULL; regionIdx < regions.size(); regionIdx += 1) {
+			regions[regionIdx].StartChunkIdx = regionBoundary(regionIdx);
+			regions[regionIdx].EndChunkIdx = regionBoundary(regionIdx + 1);
+			regions[regionIdx].NextChunkIdx = regions[regionIdx].StartChunkIdx;
+		}
+	}
+
+	/**
+	 * \brief Creates handler for several files processed in a single run - each file is one region, therefore claimed
+	 *		  chunks never span two files
+	 * \param fileSegments files of the run laid out one after another, each must consist of whole chunks
+	 * \param chunkSizeBytes chunk size in bytes
+	 */
+	FileChunkHandler(const std::vector<FileSegment>& fileSegments, const size_t chunkSizeBytes) :
+		ChunkSizeBytes(chunkSizeBytes),
+		distFilePath(fileSegments.front().FilePath),
+		fileSize(fileSegments.back().EndChunkIdx * chunkSizeBytes),
+		chunkCount(fileSegments.back().EndChunkIdx),
+		chunkSizeBytes(chunkSizeBytes),
+		regions(fileSegments.size()) {
+		for (auto fileIdx = 0ULL; fileIdx < fileSegments.size(); fileIdx += 1) {
+			regions[fileIdx].StartChunkIdx = fileSegments[fileIdx].StartChunkIdx;
+			regions[fileIdx].EndChunkIdx = fileSegments[fileIdx].EndChunkIdx;
+			regions[fileIdx].NextChunkIdx = fileSegments[fileIdx].StartChunkIdx;
+			regions[fileIdx].FileIdx = fileIdx;
+		}
 	}
 
 	[[nodiscard]] bool allChunksProcessed() const {
-		return nextChunkIdx == chunkCount;
+		return getRemainingChunks() == 0;
+	}
+
+	/**
+	 * \brief Claims up to n next chunks. The claim is rounded down to a multiple of granularity, remainder of the region
+	 *		  smaller than granularity is claimed as a whole. Safe to call from multiple threads
+	 * \param n number of chunks to claim, should be a multiple of granularity
+	 * \param granularity number of chunks the claim must be a multiple of, at least 1
+	 * \param preferredRegionIdx region to claim from first, the other regions are tried in order once it is exhausted
+	 * \return pair of start and end (exclusive) chunk index, empty range if all chunks were already claimed
+	 */
+	std::pair<size_t, size_t> claimChunks(const size_t n, const size_t granularity = 1,
+	                                      const size_t preferredRegionIdx = 0) {
+		for (auto i = 0ULL; i < regions.size(); i += 1) {
+			const auto result = claimChunksFromRegion(regions[(preferredRegionIdx + i) % regions.size()], n,
+			                                          granularity);
+			if (result.first != result.second) {
+				return result;
+			}
+		}
+
+		return {chunkCount, chunkCount};
 	}
 
 	/**
-	 * \brief Return next N chunks to process - as a pair of start and end index
-	 * \param n number of chunks to add
-	 * \return pair of start and end (exclusive) chunk index
+	 * \brief Returns number of chunks that were not claimed yet
+	 * \return number of remaining chunks
 	 */
-	auto getNextNChunks(const size_t n) {
-		const auto actualChunksAdded = nextChunkIdx + n > chunkCount ? chunkCount - nextChunkIdx : n;
-		auto result = std::pair<size_t, size_t>(nextChunkIdx, nextChunkIdx + actualChunksAdded);
-		nextChunkIdx += actualChunksAdded;
+	[[nodiscard]] size_t getRemainingChunks() const {
+		auto result = 0ULL;
+		for (const auto& region : regions) {
+			result += region.EndChunkIdx - std::min(region.NextChunkIdx.load(), region.EndChunkIdx);
+		}
+
 		return result;
 	}
 
+	/**
+	 * \brief Returns number of regions
+	 * \return number of regions
+	 */
+	[[nodiscard]] size_t getNRegions() const {
+		return regions.size();
+	}
+
+	/**
+	 * \brief Returns first chunk of the region
+	 * \param regionIdx index of the region
+	 * \return first chunk of the region
+	 */
+	[[nodiscard]] size_t getRegionStart(const size_t regionIdx) const {
+		return regions[regionIdx].StartChunkIdx;
+	}
+
+	/**
+	 * \brief Returns index of the file of the run the region belongs to
+	 * \param regionIdx index of the region
+	 * \return index of the file, always 0 if the run processes a single file
+	 */
+	[[nodiscard]] size_t getRegionFileIdx(const size_t regionIdx) const {
+		return regions[regionIdx].FileIdx;
+	}
+
+	/**
+	 * \brief Returns index of the region that contains the chunk
+	 * \param chunkIdx index of the chunk
+	 * \return index of the region
+	 */
+	[[nodiscard]] size_t getRegionIdx(const size_t chunkIdx) const {
+		const auto it = std::upper_bound(regions.begin(), regions.end(), chunkIdx,
+		                                 [](const size_t idx, const FileRegion& region) {
+			                                 return idx < region.EndChunkIdx;
+		                                 });
+		return std::min<size_t>(it - regions.begin(), regions.size() - 1);
+	}
+
 	/**
 	 * \brief Returns size of chunk in bytes
 	 * \return size of chunk in bytes
@@ -52,6 +196,31 @@ public:
 	}
 
 private:
+	/**
+	 * \brief Claims chunks from the region
+	 * \param region region to claim from
+	 * \param n number of chunks to claim
+	 * \param granularity number of chunks the claim must be a multiple of
+	 * \return pair of start and end (exclusive) chunk index, empty range if the region is exhausted
+	 */
+	static std::pair<size_t, size_t> claimChunksFromRegion(FileRegion& region, const size_t n,
+	                                                       const size_t granularity) {
+		// Compare-exchange instead of fetch-add so that the cursor never moves past the end of the region and the
+		// granularity is kept even for the last claims
+		auto start = region.NextChunkIdx.load();
+		while (start < region.EndChunkIdx) {
+			const auto remaining = region.EndChunkIdx - start;
+			const auto count = remaining <= granularity
+				                   ? remaining
+				                   : std::min(std::max(n, granularity), remaining / granularity * granularity);
+			if (region.NextChunkIdx.compare_exchange_weak(start, start + count)) {
+				return {start, start + count};
+			}
+		}
+
+		return {region.EndChunkIdx, region.EndChunkIdx};
+	}
+
 	/**
 	 * \brief Filesystem path to the file
 	 */
@@ -73,8 +242,8 @@ private:
 	size_t chunkSizeBytes;
 
 	/**
-	 * \brief Index of the next chunk
+	 * \brief Contiguous regions of the file, each with its own cursor
 	 */
-	size_t nextChunkIdx = 0;
+	std::vector<FileRegion> regions;
 
 };
@@ -0,0 +1,313 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "Histogram.h"
+#include "StatsAccumulator.h"
+
+/**
+ * \brief Goodness-of-fit tests of the candidate distributions. The tests are evaluated from the Histogram gathered
+ *		  during the same scan as the moments, therefore no additional read of the file is needed
+ */
+namespace GoodnessOfFit {
+
+	constexpr auto GAUSSIAN_IDX = 0;
+	constexpr auto EXPONENTIAL_IDX = 1;
+	constexpr auto UNIFORM_IDX = 2;
+	constexpr auto POISSON_IDX = 3;
+
+	/**
+	 * \brief Minimum expected count in a cell for the chi-square test - smaller cells are merged with their neighbours
+	 */
+	constexpr auto MIN_EXPECTED_CELL_COUNT = 5.0;
+
+	/**
+	 * \brief Number of fitted parameters for each candidate distribution - indexed same as DISTRIBUTION_STR_LUT
+	 */
+	constexpr auto N_FITTED_PARAMETERS = std::array<size_t, 4>{2, 2, 2, 1};
+
+	constexpr auto GAMMA_MAX_ITERATIONS = 1000;
+	constexpr auto GAMMA_EPSILON = 1e-14;
+
+	/**
+	 * \brief Result of goodness-of-fit tests for one candidate distribution
+	 */
+	struct FitResult {
+		size_t DistributionIdx;
+		double ChiSquare;
+		size_t DegreesOfFreedom;
+		double ChiSquarePValue;
+		double KsStatistic;
+		double KsPValue;
+
+		FitResult(const size_t distributionIdx, const double chiSquare, const size_t degreesOfFreedom,
+		          const double chiSquarePValue, const double ksStatistic, const double ksPValue)
+			: DistributionIdx(distributionIdx),
+			  ChiSquare(chiSquare),
+			  DegreesOfFreedom(degreesOfFreedom),
+			  ChiSquarePValue(chiSquarePValue),
+			  KsStatistic(ksStatistic),
+			  KsPValue(ksPValue) {
+		}
+	};
+
+	/**
+	 * \brief Regularized upper incomplete gamma function Q(a, x)
+	 *		  Adapted from Numerical Recipes (series expansion for x < a + 1, continued fraction otherwise)
+	 * \param a parameter a > 0
+	 * \param x parameter x >= 0
+	 * \return Q(a, x)
+	 */
+	inline double regularizedUpperGamma(const double a, const double x) {
+		if (x <= 0.0) {
+			return 1.0;
+		}
+
+		const auto logGammaA = std::lgamma(a);
+		if (x < a + 1.0) {
+			// Series representation of P(a, x), Q = 1 - P
+			auto ap = a;
+			auto sum = 1.0 / a;
+			auto delta = sum;
+			for (auto i = 0; i < GAMMA_MAX_ITERATIONS; i += 1) {
+				ap += 1.0;
+				delta *= x / ap;
+				sum += delta;
+				if (std::abs(delta) < std::abs(sum) * GAMMA_EPSILON) {
+					break;
+				}
+			}
+
+			return 1.0 - sum * std::exp(-x + a * std::log(x) - logGammaA);
+		}
+
+		// Continued fraction representation of Q(a, x) - modified Lentz's method
+		constexpr auto tiny = std::numeric_limits<double>::min() / GAMMA_EPSILON;
+		auto b = x + 1.0 - a;
+		auto c = 1.0 / tiny;
+		auto d = 1.0 / b;
+		auto h = d;
+		for (auto i = 1; i < GAMMA_MAX_ITERATIONS; i += 1) {
+			const auto an = -i * (i - a);
+			b += 2.0;
+			d = an * d + b;
+			d = std::abs(d) < tiny ? tiny : d;
+			c = b + an / c;
+			c = std::abs(c) < tiny ? tiny : c;
+			d = 1.0 / d;
+			const auto delta = d * c;
+			h *= delta;
+			if (std::abs(delta - 1.0) < GAMMA_EPSILON) {
+				break;
+			}
+		}
+
+		return std::exp(-x + a * std::log(x) - logGammaA) * h;
+	}
+
+	/**
+	 * \brief Returns p-value of the chi-square statistic
+	 * \param chiSquare chi-square statistic
+	 * \param degreesOfFreedom degrees of freedom
+	 * \return p-value
+	 */
+	inline double chiSquarePValue(const double chiSquare, const size_t degreesOfFreedom) {
+		if (degreesOfFreedom == 0) {
+			return std::numeric_limits<double>::quiet_NaN();
+		}
+
+		return regularizedUpperGamma(static_cast<double>(degreesOfFreedom) / 2.0, chiSquare / 2.0);
+	}
+
+	/**
+	 * \brief Returns asymptotic p-value of the Kolmogorov-Smirnov statistic (Stephens' approximation)
+	 * \param ksStatistic KS statistic D
+	 * \param n number of samples
+	 * \return p-value
+	 */
+	inline double ksPValue(const double ksStatistic, const double n) {
+		const auto sqrtN = std::sqrt(n);
+		const auto lambda = (sqrtN + 0.12 + 0.11 / sqrtN) * ksStatistic;
+		if (lambda < 1e-3) {
+			return 1.0;
+		}
+
+		auto sum = 0.0;
+		auto sign = 1.0;
+		for (auto j = 1; j <= 100; j += 1) {
+			const auto term = sign * std::exp(-2.0 * j * j * lambda * lambda);
+			sum += term;
+			if (std::abs(term) < 1e-12) {
+				break;
+			}
+			sign = -sign;
+		}
+
+		return std::clamp(2.0 * sum, 0.0, 1.0);
+	}
+
+	/**
+	 * \brief Returns function computing P(X < x) for the candidate distribution with parameters estimated from
+	 *		  the moments
+	 * \param distributionIdx index of the distribution
+	 * \param statsAccumulator accumulated statistics
+	 * \return P(X < x) as a function
+	 */
+	inline std::function<double(double)> getCdf(const size_t distributionIdx,
+	                                             const StatsAccumulator& statsAccumulator) {
+		const auto mean = statsAccumulator.getMean();
+		const auto sd = statsAccumulator.getStandardDeviation();
+		const auto min = statsAccumulator.getMin();
+
+		switch (distributionIdx) {
+		case GAUSSIAN_IDX:
+			return [mean, sd](const double x) {
+				return 0.5 * std::erfc(-(x - mean) / (sd * std::sqrt(2.0)));
+			};
+		case EXPONENTIAL_IDX:
+			// Shifted exponential - location is the minimum and scale is the distance of the mean from the minimum
+			return [min, scale = mean - min](const double x) {
+				return x <= min ? 0.0 : -std::expm1(-(x - min) / scale);
+			};
+		case UNIFORM_IDX:
+			// Boundaries estimated by the method of moments
+			return [a = mean - std::sqrt(3.0) * sd, b = mean + std::sqrt(3.0) * sd](const double x) {
+				return std::clamp((x - a) / (b - a), 0.0, 1.0);
+			};
+		default:
+			// Poisson - P(X < x) = P(X <= ceil(x) - 1) = Q(ceil(x), lambda)
+			return [lambda = mean](const double x) {
+				const auto k = std::ceil(x);
+				return k <= 0.0 ? 0.0 : regularizedUpperGamma(k, lambda);
+			};
+		}
+	}
+
+	/**
+	 * \brief Evaluates chi-square and Kolmogorov-Smirnov statistics for one candidate distribution.
+	 *		  Since only binned counts are available KS statistic is evaluated at the bin edges, which makes it a lower
+	 *		  bound of the exact statistic
+	 * \param distributionIdx index of the distribution
+	 * \param statsAccumulator accumulated statistics
+	 * \param bins ordered bins of the histogram
+	 * \param n total number of values
+	 * \return fit result
+	 */
+	inline FitResult evaluateFit(const size_t distributionIdx,
+	                             const StatsAccumulator& statsAccumulator,
+	                             const std::vector<std::tuple<double, double, uint64_t>>& bins,
+	                             const double n) {
+		const auto cdf = getCdf(distributionIdx, statsAccumulator);
+
+		// Cells for the chi-square test as pairs of (observed, expected) counts
+		auto cells = std::vector<std::pair<double, double>>();
+		auto cellObserved = 0.0;
+		auto cellExpected = 0.0;
+
+		auto ksStatistic = 0.0;
+		auto observedCumulative = 0.0;
+
+		// Mass below the first bin is merged into the first cell
+		auto previousCdf = 0.0;
+		for (auto i = 0ULL; i < bins.size(); i += 1) {
+			const auto& [lower, upper, count] = bins[i];
+
+			// Mass above the last bin is merged into the last cell
+			const auto currentCdf = i + 1 == bins.size() ? 1.0 : cdf(upper);
+			cellObserved += static_cast<double>(count);
+			cellExpected += (currentCdf - previousCdf) * n;
+			previousCdf = currentCdf;
+
+			observedCumulative += static_cast<double>(count);
+			ksStatistic = std::max(ksStatistic, std::abs(observedCumulative / n - currentCdf));
+
+			// Close the cell once it is large enough
+			if (cellExpected >= MIN_EXPECTED_CELL_COUNT) {
+				cells.emplace_back(cellObserved, cellExpected);
+				cellObserved = 0.0;
+				cellExpected = 0.0;
+			}
+		}
+
+		// Remainder is merged into the last cell so that it does not blow up the statistic
+		if (cells.empty()) {
+			cells.emplace_back(cellObserved, cellExpected);
+		}
+		else {
+			cells.back().first += cellObserved;
+			cells.back().second += cellExpected;
+		}
+
+		auto chiSquare = 0.0;
+		for (const auto& [observed, expected] : cells) {
+			if (expected > 0.0) {
+				chiSquare += (observed - expected) * (observed - expected) / expected;
+			}
+			else if (observed > 0.0) {
+				// Observed values where the distribution has no support
+				chiSquare = std::numeric_limits<double>::infinity();
+			}
+		}
+
+		const auto nCells = cells.size();
+		const auto nParameters = N_FITTED_PARAMETERS.at(distributionIdx);
+		const auto degreesOfFreedom = nCells > nParameters + 1 ? nCells - nParameters - 1 : 0;
+
+		return {
+			distributionIdx,
+			chiSquare,
+			degreesOfFreedom,
+			chiSquarePValue(chiSquare, degreesOfFreedom),
+			ksStatistic,
+			ksPValue(ksStatistic, n)
+		};
+	}
+
+	/**
+	 * \brief Evaluates goodness-of-fit for each candidate distribution and ranks them from the best fit to the worst.
+	 *		  The candidates are filtered the same way as in the classification (integer-only data are tested only
+	 *		  against Poisson and Uniform distribution)
+	 * \param statsAccumulator accumulated statistics
+	 * \param histogram histogram gathered during the scan
+	 * \return ranked list of fits
+	 */
+	inline std::vector<FitResult> rankFits(const StatsAccumulator& statsAccumulator, const Histogram& histogram) {
+		const auto bins = histogram.getOrderedBins();
+		const auto n = static_cast<double>(histogram.getN());
+		auto results = std::vector<FitResult>();
+		if (bins.empty() || !statsAccumulator.valid() || !(statsAccumulator.getVariance() > 0.0)) {
+			return results;
+		}
+
+		const auto integersOnly = statsAccumulator.integerDistribution();
+		for (auto i = 0ULL; i < N_FITTED_PARAMETERS.size(); i += 1) {
+			const auto applicable = integersOnly
+				                        ? i == POISSON_IDX || i == UNIFORM_IDX
+				                        : i != POISSON_IDX;
+			if (!applicable) {
+				continue;
+			}
+
+			results.push_back(evaluateFit(i, statsAccumulator, bins, n));
+		}
+
+		// For large files all p-values tend to underflow to zero, therefore ties are broken by the KS statistic
+		std::sort(results.begin(), results.end(), [](const FitResult& lhs, const FitResult& rhs) {
+			const auto lhsPValue = std::isnan(lhs.ChiSquarePValue) ? 0.0 : lhs.ChiSquarePValue;
+			const auto rhsPValue = std::isnan(rhs.ChiSquarePValue) ? 0.0 : rhs.ChiSquarePValue;
+			if (lhsPValue != rhsPValue) {
+				return lhsPValue > rhsPValue;
+			}
+
+			return lhs.KsStatistic < rhs.KsStatistic;
+		});
+
+		return results;
+	}
+}
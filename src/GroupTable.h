@@ -0,0 +1,283 @@
+#pragma once
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include <tbb/tbb.h>
+
+#include "StatsAccumulator.h"
+#include "StatUtils.h"
+
+// Initial number of slots of the table, must be a power of two
+constexpr auto GROUP_TABLE_INITIAL_CAPACITY = 1024ULL;
+
+// The table grows once it is filled to MAX_LOAD_NUMERATOR / MAX_LOAD_DENOMINATOR - linear probing degrades quickly
+// when the table is almost full
+constexpr auto GROUP_TABLE_MAX_LOAD_NUMERATOR = 7ULL;
+constexpr auto GROUP_TABLE_MAX_LOAD_DENOMINATOR = 10ULL;
+
+// Number of hash bits used to select the partition in the parallel merge - i.e. 2^6 = 64 partitions
+constexpr auto GROUP_MERGE_PARTITION_BITS = 6;
+
+/**
+ * \brief Key with its accumulated statistics
+ */
+using KeyStats = std::pair<uint32_t, StatsAccumulator>;
+
+/**
+ * \brief Open-addressing hash table (linear probing) mapping uint32 keys to StatsAccumulator objects. Each thread
+ *		  fills its own table without any synchronization, the tables are merged once all data are processed
+ */
+class GroupTable {
+
+	/**
+	 * \brief Key stored in each slot
+	 */
+	std::vector<uint32_t> keys;
+
+	/**
+	 * \brief Accumulator stored in each slot
+	 */
+	std::vector<StatsAccumulator> accumulators;
+
+	/**
+	 * \brief Whether the slot is occupied - uint8_t instead of bool to avoid the bit-packed vector specialization
+	 */
+	std::vector<uint8_t> occupied;
+
+	/**
+	 * \brief Number of occupied slots
+	 */
+	size_t nKeys = 0;
+
+	/**
+	 * \brief Shift of the hash to get the slot index - 64 - log2(capacity)
+	 */
+	int slotShift;
+
+public:
+	/**
+	 * \brief Creates new empty table
+	 * \param capacity initial number of slots, must be a power of two
+	 */
+	explicit GroupTable(const size_t capacity = GROUP_TABLE_INITIAL_CAPACITY) :
+		keys(capacity),
+		accumulators(capacity),
+		occupied(capacity, 0),
+		slotShift(64 - log2(capacity)) {
+	}
+
+	/**
+	 * \brief Fibonacci hash of the key - multiplicative hashing spreads consecutive ids (typical for sensors) across
+	 *		  the whole table. Top bits are used both for the slot and for the merge partition
+	 * \param key key
+	 * \return hash of the key
+	 */
+	static uint64_t hash(const uint32_t key) {
+		return static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ULL;
+	}
+
+	/**
+	 * \brief Returns index of the partition the key belongs to in the parallel merge
+	 * \param key key
+	 * \return partition index
+	 */
+	static size_t partitionIdx(const uint32_t key) {
+		return static_cast<size_t>(hash(key) >> (64 - GROUP_MERGE_PARTITION_BITS));
+	}
+
+	/**
+	 * \brief Returns accumulator for the key, inserting new empty one if the key is not present
+	 * \param key key
+	 * \return reference to the accumulator, valid until the next insertion
+	 */
+	StatsAccumulator& get(const uint32_t key) {
+		if ((nKeys + 1) * GROUP_TABLE_MAX_LOAD_DENOMINATOR > keys.size() * GROUP_TABLE_MAX_LOAD_NUMERATOR) {
+			grow();
+		}
+
+		const auto slot = findSlot(key);
+		if (!occupied[slot]) {
+			occupied[slot] = 1;
+			keys[slot] = key;
+			nKeys += 1;
+		}
+
+		return accumulators[slot];
+	}
+
+	/**
+	 * \brief Pushes value for the key - invalid values are skipped without inserting the key
+	 * \param key key
+	 * \param x value
+	 */
+	void push(const uint32_t key, const double x) {
+		if (!StatUtils::valueNormalOrZero(x)) {
+			return;
+		}
+
+		get(key).push(x);
+	}
+
+	/**
+	 * \brief Merges accumulator into the accumulator of the key
+	 * \param key key
+	 * \param accumulator accumulator to merge
+	 */
+	void add(const uint32_t key, StatsAccumulator& accumulator) {
+		get(key) += accumulator;
+	}
+
+	/**
+	 * \brief Returns number of keys in the table
+	 * \return number of keys
+	 */
+	[[nodiscard]] size_t size() const {
+		return nKeys;
+	}
+
+	/**
+	 * \brief Calls fn(key, accumulator) for each key in the table
+	 * \param fn function to call
+	 */
+	template <typename Fn>
+	void forEach(Fn&& fn) const {
+		for (auto slot = 0ULL; slot < keys.size(); slot += 1) {
+			if (occupied[slot]) {
+				fn(keys[slot], accumulators[slot]);
+			}
+		}
+	}
+
+private:
+	static int log2(size_t capacity) {
+		auto result = 0;
+		while (capacity > 1) {
+			capacity >>= 1;
+			result += 1;
+		}
+
+		return result;
+	}
+
+	/**
+	 * \brief Finds slot of the key or the first empty slot where it should be inserted
+	 * \param key key
+	 * \return slot index
+	 */
+	[[nodiscard]] size_t findSlot(const uint32_t key) const {
+		const auto mask = keys.size() - 1;
+		auto slot = static_cast<size_t>(hash(key) >> slotShift);
+		while (occupied[slot] && keys[slot] != key) {
+			slot = (slot + 1) & mask;
+		}
+
+		return slot;
+	}
+
+	/**
+	 * \brief Doubles the capacity and reinserts all keys
+	 */
+	void grow() {
+		auto oldKeys = std::move(keys);
+		auto oldAccumulators = std::move(accumulators);
+		auto oldOccupied = std::move(occupied);
+
+		const auto capacity = oldKeys.size() * 2;
+		keys = std::vector<uint32_t>(capacity);
+		accumulators = std::vector<StatsAccumulator>(capacity);
+		occupied = std::vector<uint8_t>(capacity, 0);
+		slotShift -= 1;
+
+		for (auto i = 0ULL; i < oldKeys.size(); i += 1) {
+			if (!oldOccupied[i]) {
+				continue;
+			}
+
+			const auto slot = findSlot(oldKeys[i]);
+			occupied[slot] = 1;
+			keys[slot] = oldKeys[i];
+			accumulators[slot] = oldAccumulators[i];
+		}
+	}
+};
+
+/**
+ * \brief Merges thread-local tables into a single list of keys sorted in ascending order. The merge is partitioned by
+ *		  the top bits of the key hash - each table is first scattered into the partitions in parallel, then each
+ *		  partition is merged independently. This way no locking is needed and the merge scales with the number of
+ *		  cores even for millions of keys
+ * \param tables tables to merge
+ * \return merged statistics for each key
+ */
+inline std::vector<KeyStats> mergeGroupTables(const std::vector<const GroupTable*>& tables) {
+	constexpr auto nPartitions = 1ULL << GROUP_MERGE_PARTITION_BITS;
+
+	// Scatter - scattered[tableIdx][partitionIdx]
+	auto scattered = std::vector<std::vector<std::vector<KeyStats>>>(
+		tables.size(), std::vector<std::vector<KeyStats>>(nPartitions));
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, tables.size()), [&](const tbb::blocked_range<size_t> r) {
+		for (auto tableIdx = r.begin(); tableIdx < r.end(); tableIdx += 1) {
+			tables[tableIdx]->forEach([&](const uint32_t key, const StatsAccumulator& accumulator) {
+				scattered[tableIdx][GroupTable::partitionIdx(key)].emplace_back(key, accumulator);
+			});
+		}
+	});
+
+	// Merge each partition
+	auto partitions = std::vector<std::vector<KeyStats>>(nPartitions);
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, nPartitions), [&](const tbb::blocked_range<size_t> r) {
+		for (auto partitionIdx = r.begin(); partitionIdx < r.end(); partitionIdx += 1) {
+			auto table = GroupTable();
+			for (auto& tableScatter : scattered) {
+				for (auto& [key, accumulator] : tableScatter[partitionIdx]) {
+					table.add(key, accumulator);
+				}
+			}
+
+			table.forEach([&](const uint32_t key, const StatsAccumulator& accumulator) {
+				partitions[partitionIdx].emplace_back(key, accumulator);
+			});
+		}
+	});
+
+	auto result = std::vector<KeyStats>();
+	for (auto& partition : partitions) {
+		result.insert(result.end(), partition.begin(), partition.end());
+	}
+
+	tbb::parallel_sort(result.begin(), result.end(), [](const KeyStats& lhs, const KeyStats& rhs) {
+		return lhs.first < rhs.first;
+	});
+
+	return result;
+}
+
+/**
+ * \brief Merges two lists of key statistics sorted by the key into a single sorted list
+ * \param lhs left hand side, sorted by the key
+ * \param rhs right hand side, sorted by the key
+ * \return merged statistics for each key sorted by the key
+ */
+inline std::vector<KeyStats> mergeSortedGroups(const std::vector<KeyStats>& lhs, const std::vector<KeyStats>& rhs) {
+	auto result = std::vector<KeyStats>();
+	result.reserve(std::max(lhs.size(), rhs.size()));
+	auto lhsIt = lhs.begin();
+	auto rhsIt = rhs.begin();
+	while (lhsIt != lhs.end() && rhsIt != rhs.end()) {
+		if (lhsIt->first < rhsIt->first) {
+			result.push_back(*lhsIt++);
+		}
+		else if (rhsIt->first < lhsIt->first) {
+			result.push_back(*rhsIt++);
+		}
+		else {
+			result.emplace_back(lhsIt->first, StatUtils::mergeValid(lhsIt->second, rhsIt->second));
+			++lhsIt;
+			++rhsIt;
+		}
+	}
+
+	result.insert(result.end(), lhsIt, lhs.end());
+	result.insert(result.end(), rhsIt, rhs.end());
+	return result;
+}
@@ -0,0 +1,148 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <tuple>
+#include <vector>
+
+#include "StatUtils.h"
+
+// Number of mantissa bits used to split each power of two into bins - 3 bits means 8 bins per binade
+constexpr auto HISTOGRAM_MANTISSA_BITS = 3;
+
+// Shift to get the bin key (11 exponent bits + HISTOGRAM_MANTISSA_BITS mantissa bits) from the double representation
+constexpr auto HISTOGRAM_BIN_SHIFT = 52 - HISTOGRAM_MANTISSA_BITS;
+
+// Number of bins for each sign
+constexpr auto HISTOGRAM_BINS_PER_SIGN = 1ULL << (11 + HISTOGRAM_MANTISSA_BITS);
+
+/**
+ * \brief Histogram of the processed values. The bins are derived directly from the bit representation of the double
+ *		  (sign, exponent and top mantissa bits), therefore they do not depend on the data and histograms computed
+ *		  by different devices can be simply added together. This way the histogram is computed in the same pass
+ *		  as the moments without knowing the range of the data beforehand
+ */
+class Histogram {
+
+	/**
+	 * \brief Counts for each bin - first HISTOGRAM_BINS_PER_SIGN are for positive values, the rest for negative values
+	 */
+	std::vector<uint64_t> counts;
+
+public:
+	Histogram() : counts(2 * HISTOGRAM_BINS_PER_SIGN, 0) {
+	}
+
+	/**
+	 * \brief Returns index of the bin for value x. Value must be FP_NORMAL or FP_ZERO
+	 * \param x value
+	 * \return index of the bin
+	 */
+	static size_t binIdx(const double x) {
+		auto bits = uint64_t{};
+		std::memcpy(&bits, &x, sizeof(double));
+		const auto sign = bits >> 63;
+		const auto key = (bits & 0x7fffffffffffffffULL) >> HISTOGRAM_BIN_SHIFT;
+		return static_cast<size_t>(sign * HISTOGRAM_BINS_PER_SIGN + key);
+	}
+
+	/**
+	 * \brief Pushes value to the histogram - NaNs, infinities and denormals are skipped same as in StatsAccumulator
+	 * \param x value to be pushed
+	 */
+	void push(const double x) {
+		if (!StatUtils::valueNormalOrZero(x)) {
+			return;
+		}
+
+		counts[binIdx(x)] += 1;
+	}
+
+	/**
+	 * \brief Increments bin with given index - used by vectorized code which computes the indices itself
+	 * \param idx index of the bin
+	 */
+	void pushBinIdx(const size_t idx) {
+		counts[idx] += 1;
+	}
+
+	/**
+	 * \brief Adds counts from other histogram to this one
+	 * \param rhs other histogram
+	 * \return reference to this histogram
+	 */
+	Histogram& operator+=(const Histogram& rhs) {
+		for (auto i = 0ULL; i < counts.size(); i += 1) {
+			counts[i] += rhs.counts[i];
+		}
+
+		return *this;
+	}
+
+	/**
+	 * \brief Removes all values from the histogram
+	 */
+	void clear() {
+		std::fill(counts.begin(), counts.end(), 0);
+	}
+
+	/**
+	 * \brief Returns total number of values in the histogram
+	 * \return total number of values
+	 */
+	[[nodiscard]] uint64_t getN() const {
+		auto n = uint64_t{0};
+		for (const auto count : counts) {
+			n += count;
+		}
+
+		return n;
+	}
+
+	/**
+	 * \brief Returns bins ordered by their value, starting with the first non-empty bin and ending with the last
+	 *		  non-empty bin. Empty bins in between are kept since they are needed for the goodness-of-fit tests
+	 * \return vector of (lower edge, upper edge, count) tuples
+	 */
+	[[nodiscard]] std::vector<std::tuple<double, double, uint64_t>> getOrderedBins() const {
+		auto result = std::vector<std::tuple<double, double, uint64_t>>();
+
+		// Negative values go first, from the most negative (highest key) to zero
+		for (auto key = HISTOGRAM_BINS_PER_SIGN; key > 0; key -= 1) {
+			const auto count = counts[HISTOGRAM_BINS_PER_SIGN + key - 1];
+			result.emplace_back(-getBinEdge(key), -getBinEdge(key - 1), count);
+		}
+
+		for (auto key = 0ULL; key < HISTOGRAM_BINS_PER_SIGN; key += 1) {
+			result.emplace_back(getBinEdge(key), getBinEdge(key + 1), counts[key]);
+		}
+
+		// Strip empty bins from both sides
+		const auto first = std::find_if(result.begin(), result.end(), [](const auto& bin) {
+			return std::get<2>(bin) > 0;
+		});
+		if (first == result.end()) {
+			return {};
+		}
+
+		const auto last = std::find_if(result.rbegin(), result.rend(), [](const auto& bin) {
+			return std::get<2>(bin) > 0;
+		}).base();
+
+		return {first, last};
+	}
+
+private:
+	/**
+	 * \brief Returns lower edge of the bin with given key for positive values
+	 * \param key key of the bin
+	 * \return lower edge of the bin
+	 */
+	static double getBinEdge(const uint64_t key) {
+		// Keys past the largest finite double map to the infinity which is fine as the upper edge
+		const auto bits = key << HISTOGRAM_BIN_SHIFT;
+		auto result = double{};
+		std::memcpy(&result, &bits, sizeof(double));
+		return result;
+	}
+};
@@ -1,5 +1,7 @@
 #pragma once
+#include "CoMomentAccumulator.h"
 #include "StatsAccumulator.h"
+#include "StatsAccumulatorBatch.h"
 
 
 /**
@@ -7,11 +9,16 @@
  */
 struct Job {
 	std::pair<size_t, size_t> ChunkIdxRange; // start index (inclusive) and end index (exclusive)
-	std::vector<StatsAccumulator> Items; // result of the processing
+	StatsAccumulatorBatch Items; // result of the processing, for multiple columns column c occupies c-th block
+	CoMomentAccumulator CoMoments; // co-moments of the columns, only computed if there are multiple columns
+	size_t NColumns; // number of interleaved columns in each record
 	size_t Id; // id of the job
+	int64_t ProcessingNanos = 0; // time the coordinator spent processing the job, used to estimate its throughput
 
-	explicit Job(const std::pair<size_t, size_t> chunkIdxRange, const size_t id):
+	explicit Job(const std::pair<size_t, size_t> chunkIdxRange, const size_t id, const size_t nColumns = 1):
 		ChunkIdxRange(chunkIdxRange),
+		CoMoments(nColumns),
+		NColumns(nColumns),
 		Id(id) {
 	}
 
@@ -32,3 +39,20 @@ struct Job {
 		return ChunkIdxRange.second - ChunkIdxRange.first;
 	}
 };
+
+/**
+ * \brief Reduced result of a single job - accumulators of the job merged into one per column. This is all that is kept
+ *		  of a finished job until it is folded into the total result
+ */
+struct JobResult {
+	std::pair<size_t, size_t> ChunkIdxRange; // chunks of the job, results are folded in the order of the chunks
+	std::vector<StatsAccumulator> Columns; // merged accumulator for each column
+	CoMomentAccumulator CoMoments; // co-moments of the columns
+
+	JobResult(const std::pair<size_t, size_t> chunkIdxRange, std::vector<StatsAccumulator> columns,
+	          CoMomentAccumulator coMoments):
+		ChunkIdxRange(chunkIdxRange),
+		Columns(std::move(columns)),
+		CoMoments(std::move(coMoments)) {
+	}
+};
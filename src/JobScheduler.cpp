@@ -1,22 +1,75 @@
 #include "JobScheduler.h"
 #include "MemoryAllocation.h"
 
-JobScheduler::JobScheduler(ProcessingConfig& processingConfig, size_t chunkSizeBytes) {
-	watchdog = std::make_unique<Watchdog>(std::chrono::milliseconds{processingConfig.WatchdogTimeoutMs});
-	if (const auto fileSize = fs::file_size(processingConfig.DistFilePath);
-		fileSize < chunkSizeBytes || fileSize < SMALL_SIZE_LIMIT) {
-		chunkSizeBytes = 1; // Set chunk size to 1 - this way all bytes are processed
+JobScheduler::JobScheduler(ProcessingConfig& processingConfig, size_t chunkSizeBytes):
+	fileResults(1, FileResult(processingConfig.NColumns)),
+	// ReSharper disable once CppRedundantBooleanExpressionArgument
+	useAvx2(static_cast<bool>(__ISA_AVAILABLE_AVX2) && processingConfig.UseAvx2Instructions),
+	groupByKey(!processingConfig.KeyFilePath.empty()),
+	nColumns(processingConfig.NColumns),
+	baseChunkSizeBytes(chunkSizeBytes),
+	configDistFilePath(processingConfig.DistFilePath),
+	configKeyFilePath(processingConfig.KeyFilePath),
+	configByteRange(processingConfig.ByteRange),
+	stallTimeout(processingConfig.StallTimeoutMs) {
+	// Group tables of a quarantined coordinator hold the values of its accepted jobs mixed with the values of its
+	// stalled job, which may be processed by another coordinator as well. Neither merging nor dropping such tables
+	// is correct, therefore stalled coordinators are not recovered when grouping by key
+	if (groupByKey && stallTimeout.count() > 0) {
+		log(INFO, "[JOBSCHEDULER] Stall recovery is disabled when grouping by key");
+		stallTimeout = std::chrono::milliseconds{0};
 	}
-	fileChunkHandler = std::make_unique<FileChunkHandler>(processingConfig.DistFilePath, chunkSizeBytes);
+
+	watchdog = std::make_unique<Watchdog>(std::chrono::milliseconds{processingConfig.WatchdogTimeoutMs}, [this] {
+		recoverStalledCoordinators();
+	});
+
+	const auto recordSizeBytes = nColumns * sizeof(double);
+	chunkSizeBytes = computeChunkSizeBytes(processingConfig.DistFilePath, processingConfig.ByteRange);
+
+	// One CPU coordinator per NUMA node unless set otherwise, the file is split into one region per CPU coordinator
+	const auto numaNodes = tbb::info::numa_nodes();
+	const auto nCpuCoordinators = processingConfig.ProcessingMode == ProcessingMode::OPENCL_DEVICES
+		                              ? 0
+		                              : processingConfig.NCpuNodes == 0
+		                              ? numaNodes.size()
+		                              : processingConfig.NCpuNodes;
+	log(INFO, "[JOBSCHEDULER] Using " + std::to_string(nCpuCoordinators) + " SMP coordinators on " +
+	    std::to_string(numaNodes.size()) + " NUMA nodes");
+	nRegions = std::max<size_t>(1, nCpuCoordinators);
+	fileChunkHandler = std::make_unique<FileChunkHandler>(processingConfig.DistFilePath, chunkSizeBytes, nRegions);
 
 	// Create memory configuration
 	auto memoryConfig = MemoryAllocation::buildMemoryConfig(processingConfig,
 	                                                        DEFAULT_BYTES_PROCESSED_BY_ACCUMULATOR_CPU,
 	                                                        DEFAULT_BYTES_PROCESSED_BY_ACCUMULATOR_CL,
 	                                                        processingConfig.MemoryLimit);
+
+	// With read-ahead the CPU holds data of two jobs at once, therefore each job gets half of the buffer
+	if (processingConfig.CpuQueueDepth > 1) {
+		memoryConfig.MaxCpuBufferSizeBytes /= 2;
+	}
+
+	// CPU buffer is split between the CPU coordinators
+	if (nCpuCoordinators > 1) {
+		memoryConfig.MaxCpuBufferSizeBytes /= nCpuCoordinators;
+	}
+
+	// Each CPU accumulator must process whole records - AVX2 processes four records at once. Records so wide that four
+	// of them do not fit into the buffer of a job cannot be processed at all
+	const auto accumulatorBlockBytes = 4 * recordSizeBytes;
+	if (nCpuCoordinators > 0 && accumulatorBlockBytes > memoryConfig.MaxCpuBufferSizeBytes) {
+		throw std::runtime_error("Records of " + std::to_string(nColumns) + " columns do not fit into the CPU " +
+		                         "buffer of " + std::to_string(memoryConfig.MaxCpuBufferSizeBytes) + " bytes");
+	}
+	memoryConfig.BytesPerCpuAccumulator = std::max(
+		accumulatorBlockBytes, memoryConfig.BytesPerCpuAccumulator / accumulatorBlockBytes * accumulatorBlockBytes);
 	auto coordinatorId = 0;
-	// Add CL devices
-	for (const auto& device : processingConfig.ClDevices) {
+	// Add CL devices - one coordinator for each concurrent job of the device. The first coordinator of the device tunes
+	// it and stores the profile, the following ones load it
+	for (auto deviceJobIdx = 0ULL; deviceJobIdx < processingConfig.ClDevices.size() * processingConfig.ClJobsPerDevice;
+	     deviceJobIdx += 1) {
+		const auto& device = processingConfig.ClDevices[deviceJobIdx / processingConfig.ClJobsPerDevice];
 		try {
 			clDeviceCoordinators.push_back(std::make_shared<ClDeviceCoordinator>(
 					CoordinatorType::OPEN_CL,
@@ -31,12 +84,17 @@ JobScheduler::JobScheduler(ProcessingConfig& processingConfig, size_t chunkSizeB
 					[this](auto&& ph1) {
 						notifyErrOccurred(std::forward<decltype(ph1)>(ph1));
 					},
+					[this](auto&& ph1) {
+						return claimJob(std::forward<decltype(ph1)>(ph1));
+					},
 					chunkSizeBytes,
 					memoryConfig.BytesPerClAccumulator,
 					memoryConfig.MaxClHostBufferSizeBytes,
 					processingConfig.DistFilePath,
 					coordinatorId,
-					device
+					device,
+					processingConfig.ClPrecision,
+					processingConfig.ClJobsPerDevice
 				)
 			);
 		}
@@ -47,63 +105,52 @@ JobScheduler::JobScheduler(ProcessingConfig& processingConfig, size_t chunkSizeB
 			    ". Error: " + err.what());
 			exit(1);
 		}
+		coordinatorRegions.push_back(coordinatorId % std::max<size_t>(1, nCpuCoordinators));
 		coordinatorId += 1;
 	}
 
-	// Add CPU device coordinator - this will be set to inactive state if OPENCL_DEVICES mode is used
-	// If CPU supports AVX2 then use AVX2 capable coordinator
-	// ReSharper disable once CppRedundantBooleanExpressionArgument
-	cpuDeviceCoordinator = static_cast<bool>(__ISA_AVAILABLE_AVX2) && processingConfig.UseAvx2Instructions
-		                       ? std::make_shared<Avx2CpuDeviceCoordinator>(
-			                       CoordinatorType::TBB,
-			                       processingConfig.ProcessingMode,
-			                       // Use dark magic to pass member function as a callback
-			                       [this](auto&& ph1, auto&& ph2) {
-				                       jobFinishedCallback(std::forward<decltype(ph1)>(ph1),
-				                                           std::forward<decltype(ph2)>(ph2));
-			                       },
-			                       [this](auto&& ph1) {
-				                       notifyWatchdogCallback(std::forward<decltype(ph1)>(ph1));
-			                       },
-			                       [this](auto&& ph1) {
-				                       notifyErrOccurred(std::forward<decltype(ph1)>(ph1));
-			                       },
-			                       chunkSizeBytes,
-			                       memoryConfig.BytesPerCpuAccumulator,
-			                       memoryConfig.MaxCpuBufferSizeBytes,
-			                       processingConfig.DistFilePath,
-			                       coordinatorId
-		                       )
-		                       : std::make_shared<CpuDeviceCoordinator>(
-			                       CoordinatorType::TBB,
-			                       processingConfig.ProcessingMode,
-			                       // Use dark magic to pass member function as a callback
-			                       [this](auto&& ph1, auto&& ph2) {
-				                       jobFinishedCallback(std::forward<decltype(ph1)>(ph1),
-				                                           std::forward<decltype(ph2)>(ph2));
-			                       },
-			                       [this](auto&& ph1) {
-				                       notifyWatchdogCallback(std::forward<decltype(ph1)>(ph1));
-			                       },
-			                       [this](auto&& ph1) {
-				                       notifyErrOccurred(std::forward<decltype(ph1)>(ph1));
-			                       },
-			                       chunkSizeBytes,
-			                       memoryConfig.BytesPerCpuAccumulator,
-			                       memoryConfig.MaxCpuBufferSizeBytes,
-			                       processingConfig.DistFilePath,
-			                       coordinatorId);
-
-	// Allocate coordinator availability array
-	if (processingConfig.ProcessingMode == ProcessingMode::OPENCL_DEVICES) {
-		coordinatorAvailability.resize(clDeviceCoordinators.size(), true);
-	}
-	else {
-		coordinatorAvailability.resize(clDeviceCoordinators.size() + 1, true);
+	// Add CPU device coordinators - one for each NUMA node (or as many as requested), these are not used at all
+	// in OPENCL_DEVICES mode. Each coordinator prefers the region of the file with the same index
+	for (auto cpuIdx = 0ULL; cpuIdx < nCpuCoordinators; cpuIdx += 1) {
+		const auto numaNodeIdx = cpuIdx % numaNodes.size();
+		const auto coordinatorsOnNode = nCpuCoordinators / numaNodes.size() +
+			(numaNodeIdx < nCpuCoordinators % numaNodes.size() ? 1 : 0);
+		const auto maxConcurrency = std::max(1, tbb::info::default_concurrency(numaNodes[numaNodeIdx]) /
+		                                     static_cast<int>(coordinatorsOnNode));
+		cpuDeviceCoordinators.push_back(createCpuDeviceCoordinator(processingConfig, memoryConfig, chunkSizeBytes,
+		                                                           numaNodes[numaNodeIdx], maxConcurrency,
+		                                                           coordinatorId));
+		coordinatorRegions.push_back(cpuIdx);
+		coordinatorId += 1;
+	}
+
+	for (const auto& coordinator : clDeviceCoordinators) {
+		coordinator->setQueueDepth(processingConfig.ClQueueDepth);
+	}
+	for (const auto& coordinator : cpuDeviceCoordinators) {
+		coordinator->setQueueDepth(processingConfig.CpuQueueDepth);
+	}
+
+	// Coordinator ids match their index, CPU coordinators follow the CL ones
+	for (const auto& coordinator : clDeviceCoordinators) {
+		coordinators.push_back(std::dynamic_pointer_cast<DeviceCoordinator>(coordinator));
+	}
+	for (const auto& coordinator : cpuDeviceCoordinators) {
+		coordinators.push_back(std::dynamic_pointer_cast<DeviceCoordinator>(coordinator));
+	}
+
+	runStarts = std::vector<size_t>(coordinators.size(), 0);
+	unfinishedRunStarts = std::vector<size_t>(coordinators.size(), 0);
+	coordinatorThroughputs = std::vector<std::atomic<double>>(coordinators.size());
+	for (auto& throughput : coordinatorThroughputs) {
+		throughput = 0.0;
 	}
 }
 
 JobScheduler::~JobScheduler() {
+	// Threads wait for the next run between the runs, they have to be terminated first
+	terminateDeviceCoordinators();
+
 	// Once JobScheduler is destroyed join all threads allocated by it
 	if (watchdog) {
 		watchdog->join();
@@ -115,60 +162,516 @@ JobScheduler::~JobScheduler() {
 		}
 	}
 
-	cpuDeviceCoordinator->join();
+	for (const auto& coordinator : cpuDeviceCoordinators) {
+		coordinator->join();
+	}
 }
 
-bool JobScheduler::anyCoordinatorAvailable() {
-	auto scopedLock = std::scoped_lock(coordinatorMutex);
-	return std::any_of(coordinatorAvailability.begin(), coordinatorAvailability.end(),
-	                   [](const auto& available) { return available; });
+size_t JobScheduler::computeChunkSizeBytes(const fs::path& distFilePath,
+                                           const std::pair<size_t, size_t> byteRange) const {
+	// Records must not be split between chunks, therefore chunk must be a multiple of the record size
+	const auto chunkSizeBytes = baseChunkSizeBytes * nColumns;
+	const auto fileSize = static_cast<size_t>(fs::file_size(distFilePath));
+	const auto rangeSize = std::min(byteRange.second, fileSize) - std::min(byteRange.first, fileSize);
+	if (rangeSize < chunkSizeBytes || rangeSize < SMALL_SIZE_LIMIT) {
+		return 1; // Set chunk size to 1 - this way all bytes are processed
+	}
+
+	// Only whole chunks are processed, therefore chunks of an explicit range must start and end at its edges. The
+	// largest such chunk divides both edges, it is a multiple of the record size since the edges are whole records
+	if (byteRange != WHOLE_FILE_RANGE) {
+		const auto recordSizeBytes = nColumns * sizeof(double);
+		const auto rangeStart = std::min(byteRange.first, fileSize);
+		auto rangeEnd = std::min(byteRange.second, fileSize);
+		rangeEnd -= rangeEnd % recordSizeBytes;
+		return std::gcd(std::gcd(rangeStart, rangeEnd), chunkSizeBytes);
+	}
+
+	return chunkSizeBytes;
 }
 
-bool JobScheduler::allCoordinatorsAvailable() {
-	auto scopedLock = std::scoped_lock(coordinatorMutex);
-	return std::all_of(coordinatorAvailability.begin(), coordinatorAvailability.end(), [](const auto& available) {
-		return available;
+void JobScheduler::prepareRun(const fs::path& distFilePath, const fs::path& keyFilePath,
+                              const std::pair<size_t, size_t> byteRange) {
+	if (groupByKey != !keyFilePath.empty()) {
+		throw std::runtime_error("Key file must be set if and only if the scheduler was created with one");
+	}
+
+	// Same check as for the files from the command line - there must be one key for each value
+	if (groupByKey && fs::file_size(keyFilePath) * (sizeof(double) / sizeof(uint32_t)) != fs::file_size(distFilePath)) {
+		throw std::runtime_error("Key file " + keyFilePath.string() + " must contain exactly one key for each value");
+	}
+
+	// Chunks of the range may be processed byte by byte, therefore the range itself must not split any record
+	const auto recordSizeBytes = nColumns * sizeof(double);
+	if (byteRange.first % recordSizeBytes != 0 ||
+		(byteRange.second < fs::file_size(distFilePath) && byteRange.second % recordSizeBytes != 0)) {
+		throw std::runtime_error("Byte range must start and end at a record boundary (multiple of " +
+		                         std::to_string(recordSizeBytes) + " bytes)");
+	}
+
+	const auto chunkSizeBytes = computeChunkSizeBytes(distFilePath, byteRange);
+	prepareCoordinators({FileSegment{distFilePath}}, keyFilePath, chunkSizeBytes);
+
+	// Boundaries of the regions are whole records and whole jobs of each coordinator - chunks of small files are single
+	// bytes and any coordinator may claim from any region
+	auto regionAlignmentChunks = recordSizeBytes / std::gcd(recordSizeBytes, chunkSizeBytes);
+	for (const auto& coordinator : coordinators) {
+		if (!coordinator->quarantined()) {
+			regionAlignmentChunks = std::lcm(regionAlignmentChunks, coordinator->getJobGranularity());
+		}
+	}
+	fileChunkHandler = std::make_unique<FileChunkHandler>(distFilePath, chunkSizeBytes, nRegions, byteRange,
+	                                                      regionAlignmentChunks);
+	resetRunResults(1);
+}
+
+void JobScheduler::prepareRun(const std::vector<fs::path>& filePaths) {
+	if (groupByKey) {
+		throw std::runtime_error("Several files cannot be processed in a single run when grouping by key");
+	}
+
+	if (filePaths.empty() || filePaths.size() > MAX_FILES_PER_RUN) {
+		throw std::runtime_error("Run must process between 1 and " + std::to_string(MAX_FILES_PER_RUN) + " files");
+	}
+
+	// Chunk is a single record - the files follow each other in the chunk space and only whole records are processed
+	const auto recordSizeBytes = nColumns * sizeof(double);
+	auto fileSegments = std::vector<FileSegment>();
+	auto nextChunkIdx = size_t{0};
+	for (const auto& filePath : filePaths) {
+		const auto fileSize = static_cast<size_t>(fs::file_size(filePath));
+		if (fileSize % recordSizeBytes != 0) {
+			throw std::runtime_error("File " + filePath.string() + " must consist of whole records (multiple of " +
+			                         std::to_string(recordSizeBytes) + " bytes)");
+		}
+
+		fileSegments.push_back({filePath, nextChunkIdx, nextChunkIdx + fileSize / recordSizeBytes});
+		nextChunkIdx = fileSegments.back().EndChunkIdx;
+	}
+
+	prepareCoordinators(fileSegments, {}, recordSizeBytes);
+	fileChunkHandler = std::make_unique<FileChunkHandler>(fileSegments, recordSizeBytes);
+	resetRunResults(filePaths.size());
+}
+
+void JobScheduler::prepareCoordinators(const std::vector<FileSegment>& fileSegments, const fs::path& keyFilePath,
+                                       const size_t chunkSizeBytes) {
+	// Quarantined coordinators are skipped until their threads return, they may still be stuck in an earlier run
+	releaseRecoveredCoordinators();
+	for (const auto& coordinator : coordinators) {
+		if (!coordinator->quarantined()) {
+			coordinator->prepareRun(fileSegments, keyFilePath, chunkSizeBytes);
+		}
+	}
+}
+
+void JobScheduler::resetRunResults(const size_t nFiles) {
+	// Results of each region are folded separately and merged in the order of the regions once all jobs are done
+	regionResults.clear();
+	for (auto regionIdx = 0ULL; regionIdx < fileChunkHandler->getNRegions(); regionIdx += 1) {
+		const auto regionStart = fileChunkHandler->getRegionStart(regionIdx);
+		regionResults.emplace_back(std::make_pair(regionStart, regionStart), std::vector<StatsAccumulator>(nColumns),
+		                           CoMomentAccumulator(nColumns));
+	}
+
+	// Measured throughputs are kept - the devices are the same, so the first jobs of the run are sized well already
+	pendingResults.clear();
+	fileResults = std::vector<FileResult>(nFiles, FileResult(nColumns));
+	groups.clear();
+	speculativeJobs.clear();
+	reissuedJobs.clear();
+	lastErr = nullptr;
+	nextJobId = 0;
+	jobsInFlight = 0;
+}
+
+std::shared_ptr<CpuDeviceCoordinator> JobScheduler::createCpuDeviceCoordinator(
+	ProcessingConfig& processingConfig, const MemoryAllocation::MemoryConfig& memoryConfig,
+	const size_t chunkSizeBytes, const int numaNodeId, const int maxConcurrency, const size_t coordinatorId) {
+	// If CPU supports AVX2 then use AVX2 capable coordinator
+	// ReSharper disable once CppRedundantBooleanExpressionArgument
+	if (static_cast<bool>(__ISA_AVAILABLE_AVX2) && processingConfig.UseAvx2Instructions) {
+		return std::make_shared<Avx2CpuDeviceCoordinator>(
+			CoordinatorType::TBB,
+			processingConfig.ProcessingMode,
+			// Use dark magic to pass member function as a callback
+			[this](auto&& ph1, auto&& ph2) {
+				jobFinishedCallback(std::forward<decltype(ph1)>(ph1), std::forward<decltype(ph2)>(ph2));
+			},
+			[this](auto&& ph1) {
+				notifyWatchdogCallback(std::forward<decltype(ph1)>(ph1));
+			},
+			[this](auto&& ph1) {
+				notifyErrOccurred(std::forward<decltype(ph1)>(ph1));
+			},
+			[this](auto&& ph1) {
+				return claimJob(std::forward<decltype(ph1)>(ph1));
+			},
+			chunkSizeBytes,
+			memoryConfig.BytesPerCpuAccumulator,
+			memoryConfig.MaxCpuBufferSizeBytes,
+			processingConfig.DistFilePath,
+			processingConfig.KeyFilePath,
+			numaNodeId,
+			maxConcurrency,
+			coordinatorId
+		);
+	}
+
+	return std::make_shared<CpuDeviceCoordinator>(
+		CoordinatorType::TBB,
+		processingConfig.ProcessingMode,
+		// Use dark magic to pass member function as a callback
+		[this](auto&& ph1, auto&& ph2) {
+			jobFinishedCallback(std::forward<decltype(ph1)>(ph1), std::forward<decltype(ph2)>(ph2));
+		},
+		[this](auto&& ph1) {
+			notifyWatchdogCallback(std::forward<decltype(ph1)>(ph1));
+		},
+		[this](auto&& ph1) {
+			notifyErrOccurred(std::forward<decltype(ph1)>(ph1));
+		},
+		[this](auto&& ph1) {
+			return claimJob(std::forward<decltype(ph1)>(ph1));
+		},
+		chunkSizeBytes,
+		memoryConfig.BytesPerCpuAccumulator,
+		memoryConfig.MaxCpuBufferSizeBytes,
+		processingConfig.DistFilePath,
+		processingConfig.KeyFilePath,
+		numaNodeId,
+		maxConcurrency,
+		coordinatorId
+	);
+}
+
+std::unique_ptr<Job> JobScheduler::claimJob(const size_t coordinatorIdx) {
+	if (coordinators[coordinatorIdx]->quarantined()) {
+		jobFinishedSemaphore.release();
+		return nullptr;
+	}
+
+	// Re-issued jobs are counted already and they hold up the end of the run, therefore they go first
+	if (auto job = takeReissuedJob(coordinatorIdx)) {
+		return job;
+	}
+
+	// The claim is counted before the chunks are taken so that the scheduler never sees all chunks claimed while
+	// the job is not counted yet
+	jobsInFlight += 1;
+	const auto chunkRange = fileChunkHandler->claimChunks(getJobSizeChunks(coordinatorIdx),
+	                                                      coordinators[coordinatorIdx]->getJobGranularity(),
+	                                                      coordinatorRegions[coordinatorIdx]);
+	if (chunkRange.first == chunkRange.second) {
+		// Taken over job is already counted
+		jobsInFlight -= 1;
+		if (auto job = takeOverQueuedJob(coordinatorIdx)) {
+			return job;
+		}
+
+		jobFinishedSemaphore.release();
+		return nullptr;
+	}
+
+	return std::make_unique<Job>(chunkRange, nextJobId++, nColumns);
+}
+
+std::unique_ptr<Job> JobScheduler::takeOverQueuedJob(const size_t coordinatorIdx) {
+	const auto& thief = coordinators[coordinatorIdx];
+
+	// Only idle coordinators take over - otherwise the coordinators would keep passing the queued jobs around
+	if (thief->getNQueuedJobs() > 0) {
+		return nullptr;
+	}
+
+	auto victims = std::vector<size_t>();
+	for (auto victimIdx = 0ULL; victimIdx < coordinators.size(); victimIdx += 1) {
+		if (victimIdx != coordinatorIdx) {
+			victims.push_back(victimIdx);
+		}
+	}
+	std::sort(victims.begin(), victims.end(), [this](const size_t lhs, const size_t rhs) {
+		return coordinatorThroughputs[lhs].load() < coordinatorThroughputs[rhs].load();
 	});
+
+	for (const auto victimIdx : victims) {
+		if (coordinators[victimIdx]->quarantined()) {
+			continue;
+		}
+
+		auto job = coordinators[victimIdx]->giveBackQueuedJob([&thief](const Job& queuedJob) {
+			return thief->canProcessJob(queuedJob);
+		});
+		if (job) {
+			log(DEBUG, "[JOBSCHEDULER] Coordinator " + std::to_string(coordinatorIdx) + " took over job " +
+			    std::to_string(job->Id) + " queued by coordinator " + std::to_string(victimIdx));
+			return job;
+		}
+	}
+
+	return nullptr;
+}
+
+std::unique_ptr<Job> JobScheduler::takeReissuedJob(const size_t coordinatorIdx) {
+	auto scopedLock = std::scoped_lock(reissueMutex);
+	for (auto it = reissuedJobs.begin(); it != reissuedJobs.end(); ++it) {
+		if (coordinators[coordinatorIdx]->canProcessJob(**it)) {
+			auto job = std::move(*it);
+			reissuedJobs.erase(it);
+			log(INFO, "[JOBSCHEDULER] Coordinator " + std::to_string(coordinatorIdx) + " took re-issued job " +
+			    std::to_string(job->Id));
+			return job;
+		}
+	}
+
+	return nullptr;
 }
 
-std::pair<size_t, std::shared_ptr<DeviceCoordinator>> JobScheduler::getNextAvailableDeviceCoordinator() {
-	// We prioritize CL devices over SMP
-	for (auto coordinatorId = 0ULL; coordinatorId < coordinatorAvailability.size(); coordinatorId += 1) {
-		if (!coordinatorAvailability[coordinatorId]) {
+void JobScheduler::recoverStalledCoordinators() {
+	if (stallTimeout.count() == 0) {
+		return;
+	}
+
+	auto scopedLock = std::scoped_lock(coordinatorMutex);
+	if (!isRunInProgress) {
+		return;
+	}
+
+	for (auto coordinatorIdx = 0ULL; coordinatorIdx < coordinators.size(); coordinatorIdx += 1) {
+		const auto& coordinator = coordinators[coordinatorIdx];
+		if (coordinator->quarantined()) {
+			continue;
+		}
+
+		const auto stalledJob = coordinator->getStalledJob(stallTimeout);
+		if (!stalledJob) {
 			continue;
 		}
 
-		if (coordinatorId < clDeviceCoordinators.size()) {
-			return {coordinatorId, std::dynamic_pointer_cast<DeviceCoordinator>(clDeviceCoordinators[coordinatorId])};
+		// Without another coordinator there is nobody to take over the job
+		const auto nHealthy = std::count_if(coordinators.begin(), coordinators.end(), [](const auto& other) {
+			return !other->quarantined();
+		});
+		if (nHealthy <= 1) {
+			log(WARNING, "[JOBSCHEDULER] " + coordinator->getInfo() + " stalled but there is no other coordinator " +
+			    "to take over its job");
+			continue;
 		}
 
-		return {coordinatorId, std::dynamic_pointer_cast<DeviceCoordinator>(cpuDeviceCoordinator)};
+		const auto& [jobId, chunkRange] = *stalledJob;
+		log(WARNING, "[JOBSCHEDULER] " + coordinator->getInfo() + " made no progress on job " +
+		    std::to_string(jobId) + " for " + std::to_string(stallTimeout.count()) +
+		    " ms, the job is re-issued and the coordinator is quarantined");
+
+		// The queued jobs were never started, they are moved to the other coordinators as they are. The stalled
+		// job keeps running, so its copy shares the job id and whichever finishes first is accepted
+		auto queuedJobs = coordinator->quarantine();
+		auto& speculativeJob = speculativeJobs[jobId];
+		if (speculativeJob.NCopies == 0) {
+			speculativeJob.NCopies = 1; // The stalled copy
+		}
+		{
+			auto reissueLock = std::scoped_lock(reissueMutex);
+			for (auto& queuedJob : queuedJobs) {
+				reissuedJobs.push_back(std::move(queuedJob));
+			}
+
+			if (!speculativeJob.IsFinished) {
+				reissuedJobs.push_back(std::make_unique<Job>(chunkRange, jobId, nColumns));
+				speculativeJob.NCopies += 1;
+			}
+		}
+
+		// Coordinators that already ran out of work wait for the next run, start them again for the re-issued jobs
+		for (auto otherIdx = 0ULL; otherIdx < coordinators.size(); otherIdx += 1) {
+			if (!coordinators[otherIdx]->quarantined()) {
+				runStarts[otherIdx] += 1;
+				coordinators[otherIdx]->start();
+			}
+		}
 	}
+}
 
-	// No coordinator available
-	return {0, nullptr};
+void JobScheduler::releaseRecoveredCoordinators() {
+	for (auto coordinatorIdx = 0ULL; coordinatorIdx < coordinators.size(); coordinatorIdx += 1) {
+		const auto& coordinator = coordinators[coordinatorIdx];
+		if (!coordinator->quarantined()) {
+			continue;
+		}
+
+		auto& nUnfinished = unfinishedRunStarts[coordinatorIdx];
+		while (nUnfinished > 0 && coordinator->tryWaitForRunFinished()) {
+			nUnfinished -= 1;
+		}
 
+		if (nUnfinished == 0) {
+			coordinator->releaseQuarantine();
+			log(INFO, "[JOBSCHEDULER] " + coordinator->getInfo() + " finished its stalled job and is used again");
+		}
+	}
 }
 
-void JobScheduler::addProcessedJob(const std::unique_ptr<Job> job) {
-	processedJobs.push_back(*job);
+bool JobScheduler::acceptJobCopy(const size_t jobId, const size_t coordinatorIdx) {
+	const auto it = speculativeJobs.find(jobId);
+	if (it == speculativeJobs.end()) {
+		// Quarantined coordinator may finish a job of an earlier run once it recovers, such result is stale
+		return !coordinators[coordinatorIdx]->quarantined();
+	}
+
+	auto& speculativeJob = it->second;
+	speculativeJob.NCopies -= 1;
+	const auto accepted = !speculativeJob.IsFinished;
+	speculativeJob.IsFinished = true;
+	if (accepted) {
+		// Copy that was not claimed yet is not needed anymore
+		auto reissueLock = std::scoped_lock(reissueMutex);
+		const auto copyIt = std::find_if(reissuedJobs.begin(), reissuedJobs.end(), [jobId](const auto& job) {
+			return job->Id == jobId;
+		});
+		if (copyIt != reissuedJobs.end()) {
+			reissuedJobs.erase(copyIt);
+			speculativeJob.NCopies -= 1;
+		}
+	}
+
+	if (speculativeJob.NCopies == 0) {
+		speculativeJobs.erase(it);
+	}
+
+	if (!accepted) {
+		log(INFO, "[JOBSCHEDULER] Discarding result of job " + std::to_string(jobId) + " from coordinator " +
+		    std::to_string(coordinatorIdx) + ", another copy finished first");
+	}
+
+	return accepted;
+}
+
+void JobScheduler::addProcessedJob(const std::unique_ptr<Job> job, JobResult jobResult) {
+	const auto regionIdx = fileChunkHandler->getRegionIdx(job->ChunkIdxRange.first);
+	pendingResults.emplace(job->ChunkIdxRange.first, std::move(jobResult));
+	foldPendingResults(regionIdx);
 	log(INFO, "[JOBSCHEDULER] Job " + std::to_string(job->Id) + " was successfully processed");
 }
 
+void JobScheduler::foldPendingResults(const size_t regionIdx) {
+	auto& regionResult = regionResults[regionIdx];
+	auto it = pendingResults.find(regionResult.ChunkIdxRange.second);
+	while (it != pendingResults.end()) {
+		auto& jobResult = it->second;
+		for (auto column = 0ULL; column < nColumns; column += 1) {
+			regionResult.Columns[column] = StatUtils::mergeValid(regionResult.Columns[column],
+			                                                     jobResult.Columns[column]);
+		}
+		regionResult.CoMoments += jobResult.CoMoments;
+		regionResult.ChunkIdxRange.second = jobResult.ChunkIdxRange.second;
+
+		pendingResults.erase(it);
+		it = pendingResults.find(regionResult.ChunkIdxRange.second);
+	}
+}
+
+void JobScheduler::foldRegionResults() {
+	for (auto regionIdx = 0ULL; regionIdx < regionResults.size(); regionIdx += 1) {
+		const auto& regionResult = regionResults[regionIdx];
+		auto& fileResult = fileResults[fileChunkHandler->getRegionFileIdx(regionIdx)];
+		for (auto column = 0ULL; column < nColumns; column += 1) {
+			fileResult.Columns[column] = StatUtils::mergeValid(fileResult.Columns[column],
+			                                                   regionResult.Columns[column]);
+		}
+		fileResult.CoMoments += regionResult.CoMoments;
+	}
+}
+
+void JobScheduler::foldLeftoverResults() {
+	if (pendingResults.empty()) {
+		return;
+	}
+
+	log(WARNING, "[JOBSCHEDULER] Chunk " + std::to_string(pendingResults.begin()->first) +
+	    " was processed after a lost job, merging " + std::to_string(pendingResults.size()) +
+	    " remaining job results");
+
+	// Leftovers of different files must not be merged together
+	auto fileLeftovers = std::map<size_t, std::vector<const JobResult*>>();
+	for (const auto& [firstChunkIdx, jobResult] : pendingResults) {
+		const auto fileIdx = fileChunkHandler->getRegionFileIdx(fileChunkHandler->getRegionIdx(firstChunkIdx));
+		fileLeftovers[fileIdx].push_back(&jobResult);
+	}
+
+	for (const auto& [fileIdx, jobResults] : fileLeftovers) {
+		// Leftovers are laid out the same way as the accumulators of a multi-column job - column c in c-th block
+		auto& fileResult = fileResults[fileIdx];
+		auto leftovers = StatsAccumulatorBatch(jobResults.size() * nColumns);
+		for (auto jobIdx = 0ULL; jobIdx < jobResults.size(); jobIdx += 1) {
+			for (auto column = 0ULL; column < nColumns; column += 1) {
+				leftovers.set(column * jobResults.size() + jobIdx, jobResults[jobIdx]->Columns[column]);
+			}
+			fileResult.CoMoments += jobResults[jobIdx]->CoMoments;
+		}
+
+		const auto merged = leftovers.mergeBlocks(nColumns, useAvx2);
+		for (auto column = 0ULL; column < nColumns; column += 1) {
+			fileResult.Columns[column] = StatUtils::mergeValid(fileResult.Columns[column], merged[column]);
+		}
+	}
+	pendingResults.clear();
+}
+
 void JobScheduler::jobFinishedCallback(std::unique_ptr<Job> job, const size_t coordinatorIdx) {
-	auto scopedLock = std::scoped_lock(coordinatorMutex);
-	coordinatorAvailability[coordinatorIdx] = true;
-	addProcessedJob(std::move(job));
+	// The job is reduced before the lock is taken so that the coordinators do not wait for each other
+	auto mergeTimer = std::make_optional<ScopedStageTimer>(coordinators[coordinatorIdx]->getStageProfiler(),
+	                                                       STAGE_MERGE);
+	auto jobResult = JobResult(job->ChunkIdxRange, job->Items.mergeBlocks(nColumns, useAvx2),
+	                           std::move(job->CoMoments));
+	mergeTimer.reset();
+
+	auto scopedLock = lockCoordinatorMutex(coordinatorIdx);
+	if (!acceptJobCopy(job->Id, coordinatorIdx)) {
+		// The job is counted only once for all of its copies
+		jobFinishedSemaphore.release();
+		return;
+	}
+
+	updateThroughput(coordinatorIdx, *job);
+	const auto regionIdx = fileChunkHandler->getRegionIdx(job->ChunkIdxRange.first);
+	coordinators[coordinatorIdx]->acceptJobHistograms(fileChunkHandler->getRegionFileIdx(regionIdx));
+	addProcessedJob(std::move(job), std::move(jobResult));
+	jobsInFlight -= 1;
 	jobFinishedSemaphore.release();
 }
 
 void JobScheduler::notifyWatchdogCallback(const size_t bytesProcessed) {
-	auto scopedLock = std::scoped_lock(coordinatorMutex);
+	// Watchdog counter is atomic, therefore no lock is needed
 	watchdog->updateCounter(bytesProcessed);
 }
 
 void JobScheduler::notifyErrOccurred(const CoordinatorErr& err) {
-	auto scopedLock = std::scoped_lock(coordinatorMutex);
+	auto scopedLock = lockCoordinatorMutex(err.CoordinatorId);
+	if (const auto it = speculativeJobs.find(err.JobId); it != speculativeJobs.end()) {
+		// Failed copy of a re-issued job is only lost if no other copy finished or can still finish
+		auto& speculativeJob = it->second;
+		speculativeJob.NCopies -= 1;
+		if (speculativeJob.IsFinished || speculativeJob.NCopies > 0) {
+			log(WARNING, "[JOBSCHEDULER] Copy of job " + std::to_string(err.JobId) + " failed on coordinator " +
+			    std::to_string(err.CoordinatorId) + ": " + err.What);
+			if (speculativeJob.NCopies == 0) {
+				speculativeJobs.erase(it);
+			}
+			jobFinishedSemaphore.release();
+			return;
+		}
+
+		speculativeJobs.erase(it);
+	}
+	else if (coordinators[err.CoordinatorId]->quarantined()) {
+		log(WARNING, "[JOBSCHEDULER] Quarantined coordinator " + std::to_string(err.CoordinatorId) +
+		    " encountered an error: " + err.What);
+		jobFinishedSemaphore.release();
+		return;
+	}
+
+	// The job of the error is lost, it is not in flight anymore
+	jobsInFlight -= 1;
 	jobFinishedSemaphore.release();
 	if (!lastErr) {
 		// If there is no last erorr we can set this
@@ -194,23 +697,122 @@ void JobScheduler::terminateDeviceCoordinators() const {
 		}
 	}
 
-	if (cpuDeviceCoordinator) {
-		cpuDeviceCoordinator->terminate();
+	for (const auto& cpuCoordinator : cpuDeviceCoordinators) {
+		cpuCoordinator->terminate();
 	}
 }
 
-void JobScheduler::assignJob() {
-	checkForErrors();
+void JobScheduler::startDeviceCoordinators() {
 	auto scopedLock = std::scoped_lock(coordinatorMutex);
+	isRunInProgress = true;
+	for (auto coordinatorIdx = 0ULL; coordinatorIdx < coordinators.size(); coordinatorIdx += 1) {
+		runStarts[coordinatorIdx] = 0;
+		if (!coordinators[coordinatorIdx]->quarantined()) {
+			runStarts[coordinatorIdx] = 1;
+			coordinators[coordinatorIdx]->start();
+		}
+	}
+}
+
+void JobScheduler::updateThroughput(const size_t coordinatorIdx, const Job& job) {
+	if (job.ProcessingNanos <= 0) {
+		return;
+	}
+
+	const auto throughput = static_cast<double>(job.getSizeBytes(fileChunkHandler->getChunkSizeBytes())) /
+		(static_cast<double>(job.ProcessingNanos) / 1e9);
+	const auto average = coordinatorThroughputs[coordinatorIdx].load();
+	coordinatorThroughputs[coordinatorIdx] = average == 0.0
+		                                         ? throughput
+		                                         : THROUGHPUT_SMOOTHING_FACTOR * throughput +
+		                                         (1.0 - THROUGHPUT_SMOOTHING_FACTOR) * average;
+}
+
+size_t JobScheduler::getJobSizeChunks(const size_t coordinatorIdx) {
+	const auto& coordinator = coordinators[coordinatorIdx];
+	const auto remainingChunks = fileChunkHandler->getRemainingChunks();
+	const auto granularity = coordinator->getJobGranularity();
+
+	// Remainder smaller than a single accumulator is claimed as a whole
+	if (remainingChunks <= granularity) {
+		return granularity;
+	}
+
+	// Coordinators that did not finish any job yet are assumed to be as fast as the average measured one
+	auto totalThroughput = 0.0;
+	auto nMeasured = 0ULL;
+	auto nHealthy = 0ULL;
+	for (auto otherIdx = 0ULL; otherIdx < coordinators.size(); otherIdx += 1) {
+		if (coordinators[otherIdx]->quarantined()) {
+			continue;
+		}
+
+		nHealthy += 1;
+		if (const auto throughput = coordinatorThroughputs[otherIdx].load(); throughput > 0.0) {
+			totalThroughput += throughput;
+			nMeasured += 1;
+		}
+	}
+
+	const auto averageThroughput = nMeasured > 0 ? totalThroughput / static_cast<double>(nMeasured) : 1.0;
+	totalThroughput += averageThroughput * static_cast<double>(nHealthy - nMeasured);
+	const auto ownThroughput = coordinatorThroughputs[coordinatorIdx].load();
+	const auto throughput = ownThroughput > 0.0 ? ownThroughput : averageThroughput;
+
+	const auto share = throughput / totalThroughput;
+	const auto guidedChunks = static_cast<size_t>(
+		std::ceil(static_cast<double>(remainingChunks) * share / GUIDED_SCHEDULING_DIVISOR));
+
+	// Round to the granularity - the data that do not fill the whole accumulator are left for the last job
+	const auto maxChunks = std::max(granularity, coordinator->getMaxNumberOfChunks() / granularity * granularity);
+	const auto jobChunks = std::clamp(guidedChunks / granularity * granularity, granularity, maxChunks);
+	log(DEBUG, "[JOBSCHEDULER] Coordinator " + std::to_string(coordinatorIdx) + " gets " +
+	    std::to_string(jobChunks) + " chunks (" + StatUtils::doubleToStr(share * 100.0, 3) +
+	    "% of the throughput, " + std::to_string(remainingChunks) + " chunks remaining)");
+	return jobChunks;
+}
+
+void JobScheduler::logCoordinatorUtilization() {
+	for (const auto& coordinator : coordinators) {
+		log(INFO, "[JOBSCHEDULER] " + coordinator->getUtilizationInfo());
+	}
+}
+
+void JobScheduler::logStageProfiles() {
+	if constexpr (!STAGE_PROFILING_ENABLED) {
+		return;
+	}
+
+	for (const auto& coordinator : coordinators) {
+		for (auto stage = 0; stage < N_PIPELINE_STAGES; stage += 1) {
+			if (const auto summary = coordinator->getStageProfiler().stageSummary(static_cast<PipelineStage>(stage));
+				!summary.empty()) {
+				log(INFO, "[PROFILE] " + coordinator->getInfo() + " " + summary);
+			}
+		}
+	}
+}
 
-	// Get the coordinator
-	const auto [coordinatorId, coordinator] = getNextAvailableDeviceCoordinator();
-	coordinatorAvailability[coordinatorId] = false;
+std::unique_lock<std::mutex> JobScheduler::lockCoordinatorMutex(const size_t coordinatorIdx) {
+	// Timer stops once the lock is constructed, i.e. acquired
+	auto waitTimer = ScopedStageTimer(coordinators[coordinatorIdx]->getStageProfiler(), STAGE_LOCK_WAIT);
+	return std::unique_lock(coordinatorMutex);
+}
 
-	// Build and assign new job for them
-	const auto chunkRange = fileChunkHandler->getNextNChunks(coordinator->getMaxNumberOfChunks());
-	coordinator->assignJob(Job(chunkRange, currentJobId));
-	currentJobId += 1;
+void JobScheduler::writeStageProfiles(std::ostream& output, const std::string& runName) const {
+	output << "{";
+	if (!runName.empty()) {
+		output << "\"run\":\"" << escapeJson(runName) << "\",";
+	}
+	output << "\"coordinators\":[";
+	for (auto coordinatorIdx = 0ULL; coordinatorIdx < coordinators.size(); coordinatorIdx += 1) {
+		const auto& coordinator = coordinators[coordinatorIdx];
+		output << (coordinatorIdx > 0 ? "," : "") << "{\"id\":" << coordinatorIdx << ",\"name\":\""
+			<< escapeJson(coordinator->getInfo()) << "\",\"stages\":";
+		coordinator->getStageProfiler().writeJson(output);
+		output << "}";
+	}
+	output << "]}\n";
 }
 
 void JobScheduler::checkForErrors() {
@@ -224,6 +826,7 @@ void JobScheduler::checkForErrors() {
 		    "[JOBSCHEDULER] Coordinator " + std::to_string(lastErr->CoordinatorId) + " encountered an error: " +
 		    lastErr->What);
 		terminateDeviceCoordinators();
+		hasFatalError = true;
 		throw std::runtime_error("Error occurred during computation, the program cannot continue");
 	}
 
@@ -234,52 +837,84 @@ void JobScheduler::checkForErrors() {
 }
 
 std::vector<StatsAccumulator> JobScheduler::run() {
-	log(DEBUG, "[JOBSCHEDULER] Starting Job Scheduler");
-	// Start the watchdog - by this time all device coordinators are waiting for jobs
+	return run(configDistFilePath, configKeyFilePath, configByteRange);
+}
+
+std::vector<StatsAccumulator> JobScheduler::run(const fs::path& distFilePath, const fs::path& keyFilePath,
+                                                const std::pair<size_t, size_t> byteRange) {
+	log(DEBUG, "[JOBSCHEDULER] Starting Job Scheduler on file: \"" + distFilePath.string() + "\"");
+	prepareRun(distFilePath, keyFilePath, byteRange);
+	executeRun();
+	return fileResults.front().Columns;
+}
+
+const std::vector<FileResult>& JobScheduler::runFiles(const std::vector<fs::path>& filePaths) {
+	log(DEBUG, "[JOBSCHEDULER] Starting Job Scheduler on " + std::to_string(filePaths.size()) + " files");
+	prepareRun(filePaths);
+	executeRun();
+	return fileResults;
+}
+
+void JobScheduler::executeRun() {
+	// Start the watchdog - by this time all device coordinators are waiting for the run
 	watchdog->start();
+
+	// Coordinators claim the jobs themselves, the scheduler only supervises errors and completion
+	startDeviceCoordinators();
 	while (true) {
 		checkForErrors();
+		if (allJobsFinished()) {
+			break;
+		}
 
-		// Check if there is a job available
-		if (!jobRemaining()) {
-			// If there is not check if all coordinators have finished (i.e. are available)
-			if (allCoordinatorsAvailable()) {
-				break; // All coordinators are done - break the loop
-			}
+		jobFinishedSemaphore.acquire();
+	}
+	log(DEBUG, "[JOBSCHEDULER] All Jobs finished, waiting for device coordinators to become idle.");
+	auto nRunStarts = std::vector<size_t>();
+	{
+		auto scopedLock = std::scoped_lock(coordinatorMutex);
+		isRunInProgress = false;
+		nRunStarts = runStarts;
+	}
+	watchdog->stop();
 
-			// Wait for coordinators to finish
-			jobFinishedSemaphore.acquire();
+	// Coordinators are kept alive for the next run, wait until each of them stops claiming. Quarantined ones may
+	// never finish, therefore they are not waited for - their runs are checked before the next run instead
+	for (auto coordinatorIdx = 0ULL; coordinatorIdx < coordinators.size(); coordinatorIdx += 1) {
+		if (coordinators[coordinatorIdx]->quarantined()) {
+			unfinishedRunStarts[coordinatorIdx] += nRunStarts[coordinatorIdx];
 			continue;
 		}
 
-		// Else there is job available
-		// Select best device available (prioritize GPU over CPU)
-		if (!anyCoordinatorAvailable()) {
-			jobFinishedSemaphore.acquire();
-			continue;
+		for (auto i = 0ULL; i < nRunStarts[coordinatorIdx]; i += 1) {
+			coordinators[coordinatorIdx]->waitForRunFinished();
 		}
-
-		assignJob();
 	}
-	log(DEBUG, "[JOBSCHEDULER] All Jobs finished, terminating device coordinators and watchdog.");
-	auto scopedLock = std::scoped_lock(coordinatorMutex);
-	// Terminate watchdog
-	watchdog->terminate();
-
-	// Terminate all coordinators
-	terminateDeviceCoordinators();
 
-	auto accumulators = std::vector<StatsAccumulator>();
-
-	// Sort the processed jobs by their id
-	std::sort(processedJobs.begin(), processedJobs.end(), [](const auto& lhs, const auto& rhs) {
-		return lhs.Id < rhs.Id;
-		});
+	auto scopedLock = std::scoped_lock(coordinatorMutex);
+	logCoordinatorUtilization();
+	logStageProfiles();
+
+	// Histograms only contain counts, therefore the coordinators gather them over the whole run and they are added
+	// once here. Quarantined coordinators count their accepted jobs as well
+	for (const auto& coordinator : coordinators) {
+		for (const auto& [fileIdx, runHistograms] : coordinator->takeRunHistograms()) {
+			for (auto column = 0ULL; column < runHistograms.size(); column += 1) {
+				fileResults[fileIdx].Histograms[column] += runHistograms[column];
+			}
+		}
+	}
 
-	// Collect the stats from the jobs
-	for (const auto& job : processedJobs) {
-		accumulators.insert(accumulators.end(), job.Items.begin(), job.Items.end());
+	if (groupByKey) {
+		// Hierarchical merge - tables of each node are merged within the node first, then the nodes are merged. No
+		// coordinator is quarantined when grouping by key, therefore the tables hold each job exactly once
+		for (const auto& cpuCoordinator : cpuDeviceCoordinators) {
+			groups = mergeSortedGroups(groups, cpuCoordinator->mergeGroups());
+		}
+		log(INFO, "[JOBSCHEDULER] Computed statistics for " + std::to_string(groups.size()) + " keys");
 	}
 
-	return accumulators;
+	// Results were folded into their regions as the jobs finished, only results after a lost job remain
+	foldRegionResults();
+	foldLeftoverResults();
 }
@@ -1,8 +1,13 @@
 #pragma once
+#include <atomic>
+#include <deque>
+#include <map>
+
 #include "CpuDeviceCoordinator.h"
 #include "Avx2CpuDeviceCoordinator.h"
 #include "ClDeviceCoordinator.h"
 #include "FileChunkHandler.h"
+#include "MemoryAllocation.h"
 #include "Watchdog.h"
 
 constexpr auto DEFAULT_CHUNK_SIZE = 4096;
@@ -11,6 +16,37 @@ constexpr auto SMALL_SIZE_LIMIT = 1024 * 1024; // 1 MB - limit for small files t
 constexpr auto DEFAULT_BYTES_PROCESSED_BY_ACCUMULATOR_CPU = 1ULL * 512 * 1024 * sizeof(double);
 constexpr auto DEFAULT_BYTES_PROCESSED_BY_ACCUMULATOR_CL = 1ULL * 512 * 1024 * sizeof(double);
 
+// Weight of the latest job in the moving average of coordinator throughput - roughly the last 1 / 0.3 ~ 3 jobs matter
+constexpr auto THROUGHPUT_SMOOTHING_FACTOR = 0.3;
+
+// Maximum number of files processed in a single run by runFiles() - results of all of them are kept until the run ends
+constexpr auto MAX_FILES_PER_RUN = 64;
+
+// Each job gets 1 / GUIDED_SCHEDULING_DIVISOR of the coordinator's share of the remaining data. This way job sizes
+// shrink geometrically as the end of the file approaches and all coordinators finish at about the same time
+constexpr auto GUIDED_SCHEDULING_DIVISOR = 2.0;
+
+/**
+ * \brief Job that was re-issued after its coordinator stalled - several copies of it may be processed at once, the
+ *		  first finished one is accepted and the others are discarded
+ */
+struct SpeculativeJob {
+	size_t NCopies = 0; // number of copies that are queued or being processed
+	bool IsFinished = false; // whether result of any copy was accepted already
+};
+
+/**
+ * \brief Total result of a single file of the run
+ */
+struct FileResult {
+	std::vector<StatsAccumulator> Columns; // statistics of each column
+	std::vector<Histogram> Histograms; // histogram of each column
+	CoMomentAccumulator CoMoments; // co-moments of the columns
+
+	explicit FileResult(const size_t nColumns) : Columns(nColumns), Histograms(nColumns), CoMoments(nColumns) {
+	}
+};
+
 /**
  * \brief This class acts as a load balancer and job manager. It schedules job among available coordinators and accumulates results
  */
@@ -22,23 +58,40 @@ class JobScheduler {
 	std::vector<std::shared_ptr<ClDeviceCoordinator>> clDeviceCoordinators;
 
 	/**
-	 * \brief This vector stores availability of each device coordinator
+	 * \brief All enabled coordinators indexed by their id, cast to DeviceCoordinator once so that claiming a job does
+	 *		  not need any cast
+	 */
+	std::vector<std::shared_ptr<DeviceCoordinator>> coordinators;
+
+	/**
+	 * \brief Moving average of the throughput of each coordinator in bytes per second, 0 if no job was finished yet.
+	 *		  Written under coordinatorMutex, read without the lock when a job is claimed
 	 */
-	std::vector<bool> coordinatorAvailability;
+	std::vector<std::atomic<double>> coordinatorThroughputs;
 
 	/**
-	 * \brief Coordinator for CPU (SMP). This is shared_ptr to allow for polymorphism
+	 * \brief Coordinators for CPU (SMP), one for each NUMA node. These are shared_ptr to allow for polymorphism
 	 */
-	std::shared_ptr<CpuDeviceCoordinator> cpuDeviceCoordinator = nullptr;
+	std::vector<std::shared_ptr<CpuDeviceCoordinator>> cpuDeviceCoordinators;
+
+	/**
+	 * \brief Region of the file each coordinator claims from first
+	 */
+	std::vector<size_t> coordinatorRegions;
+
+	/**
+	 * \brief Number of regions a single file is split into - one for each CPU coordinator
+	 */
+	size_t nRegions;
 
 	/**
 	 * \brief To synchronize with device coordinators we use a semaphore which is incremented by coordinator after
-	 * finishing a job
+	 * finishing a job, after an error or when there is nothing left to claim
 	 */
 	ConcurrencyUtils::Semaphore jobFinishedSemaphore = ConcurrencyUtils::Semaphore(0);
 
 	/**
-	 * \brief Synchronization mutex for coordinators
+	 * \brief Synchronization mutex for results and errors - claiming jobs does not need it
 	 */
 	std::mutex coordinatorMutex;
 
@@ -53,21 +106,188 @@ class JobScheduler {
 	std::unique_ptr<Watchdog> watchdog;
 
 	/**
-	 * \brief Id of the "current" job - i.e. job we are currently assigning 
+	 * \brief Id of the next claimed job
+	 */
+	std::atomic<size_t> nextJobId = 0;
+
+	/**
+	 * \brief Number of jobs that were claimed and are neither finished nor failed. A claim is counted before the chunks
+	 *		  are taken, therefore once all chunks are claimed and this is 0 all work is done
+	 */
+	std::atomic<size_t> jobsInFlight = 0;
+
+	/**
+	 * \brief Results of finished jobs that cannot be folded yet since a job with lower chunks of the same region is
+	 *		  still being processed, keyed by the first chunk of the job. The number of pending results is bounded by
+	 *		  the number of jobs in flight
+	 */
+	std::map<size_t, JobResult> pendingResults;
+
+	/**
+	 * \brief Folded result of each region of the run. Chunk range of the result is the range folded so far, i.e. its
+	 *		  end is the first chunk of the next job to fold. Jobs are folded in the order of their chunks so the result
+	 *		  does not depend on the order in which the coordinators finish
+	 */
+	std::vector<JobResult> regionResults;
+
+	/**
+	 * \brief Total result of each file of the run, complete once the run returns. Regions of a file are folded into
+	 *		  it in the order of the regions
+	 */
+	std::vector<FileResult> fileResults;
+
+	/**
+	 * \brief Whether job results are merged with AVX2 instructions
+	 */
+	bool useAvx2;
+
+	/**
+	 * \brief Whether values are grouped by keys from the key file
+	 */
+	bool groupByKey;
+
+	/**
+	 * \brief Statistics for each key sorted by the key, only computed if values are grouped by key
+	 */
+	std::vector<KeyStats> groups;
+
+	/**
+	 * \brief Number of interleaved columns in each record
+	 */
+	size_t nColumns;
+
+	/**
+	 * \brief Jobs given back by quarantined coordinators and copies of their stalled jobs. These are claimed before
+	 *		  any new chunks. Guarded by reissueMutex
+	 */
+	std::deque<std::unique_ptr<Job>> reissuedJobs;
+
+	/**
+	 * \brief Mutex for the re-issued jobs, must not be locked before coordinatorMutex
+	 */
+	std::mutex reissueMutex;
+
+	/**
+	 * \brief Re-issued copies of stalled jobs by the job id. Guarded by coordinatorMutex
+	 */
+	std::map<size_t, SpeculativeJob> speculativeJobs;
+
+	/**
+	 * \brief Number of times each coordinator was started in the current run - the coordinators are started again
+	 *		  to pick up re-issued jobs. Guarded by coordinatorMutex
+	 */
+	std::vector<size_t> runStarts;
+
+	/**
+	 * \brief Number of runs each quarantined coordinator was started for and that were not waited for since it
+	 *		  stalled. Once its thread finishes all of them the coordinator is used again
+	 */
+	std::vector<size_t> unfinishedRunStarts;
+
+	/**
+	 * \brief Whether the current run was started and not finished yet. Guarded by coordinatorMutex
 	 */
-	size_t currentJobId = 0;
+	bool isRunInProgress = false;
 
 	/**
-	 * \brief Accumulated job results from Device coordinators
+	 * \brief Whether a fatal error terminated the coordinators - the scheduler cannot be used for another run
 	 */
-	std::vector<Job> processedJobs;
+	bool hasFatalError = false;
 
 	/**
 	 * \brief Last execution error, coordinators set this up via notifyErrOccurred callback
 	 */
 	std::unique_ptr<CoordinatorErr> lastErr = nullptr;
 
+	/**
+	 * \brief Chunk size in bytes of a single column requested in the constructor, the actual chunk size is derived
+	 *		  from it for each processed file
+	 */
+	size_t baseChunkSizeBytes;
+
+	/**
+	 * \brief Files of the processing config - processed by run() without arguments
+	 */
+	fs::path configDistFilePath;
+	fs::path configKeyFilePath;
+	std::pair<size_t, size_t> configByteRange;
+
+	/**
+	 * \brief Time without progress after which a coordinator is considered stalled, 0 disables stall recovery. Always
+	 *		  0 when grouping by key
+	 */
+	std::chrono::milliseconds stallTimeout;
+
+	/**
+	 * \brief Computes chunk size for the processed part of the file - records must not be split between chunks,
+	 *		  small parts are processed byte by byte and explicit ranges are processed exactly
+	 * \param distFilePath path to the file
+	 * \param byteRange processed range of the file
+	 * \return chunk size in bytes
+	 */
+	[[nodiscard]] size_t computeChunkSizeBytes(const fs::path& distFilePath,
+	                                           std::pair<size_t, size_t> byteRange = WHOLE_FILE_RANGE) const;
+
+	/**
+	 * \brief Resets the results and prepares the file chunk handler and all coordinators for processing of the file.
+	 *		  Threads, arenas, compiled programs and measured throughputs are kept from the previous run
+	 * \param distFilePath path to the file with values
+	 * \param keyFilePath path to the file with keys, empty if values are not grouped by key
+	 * \param byteRange range of bytes to process, must start at a record boundary
+	 */
+	void prepareRun(const fs::path& distFilePath, const fs::path& keyFilePath, std::pair<size_t, size_t> byteRange);
+
+	/**
+	 * \brief Resets the results and prepares the file chunk handler and all coordinators for processing of several
+	 *		  files in a single run. Each file is a region of its own, therefore no job spans two files
+	 * \param filePaths paths to the files with values, each must consist of whole records
+	 */
+	void prepareRun(const std::vector<fs::path>& filePaths);
+
+	/**
+	 * \brief Prepares the coordinators that are not quarantined for the next run. Quarantined coordinators whose
+	 *		  stalled job returned are released first
+	 * \param fileSegments files of the run and their chunks
+	 * \param keyFilePath path to the file with keys, empty if values are not grouped by key
+	 * \param chunkSizeBytes chunk size in bytes of the run
+	 */
+	void prepareCoordinators(const std::vector<FileSegment>& fileSegments, const fs::path& keyFilePath,
+	                         size_t chunkSizeBytes);
+
+	/**
+	 * \brief Resets the results and the per-run state once the file chunk handler of the run is created
+	 * \param nFiles number of files of the run
+	 */
+	void resetRunResults(size_t nFiles);
+
+	/**
+	 * \brief Processes the prepared run - starts the coordinators, waits until all jobs are finished and folds the
+	 *		  results of each file
+	 */
+	void executeRun();
+
+	/**
+	 * \brief Creates CPU device coordinator - AVX2 capable one if it is available and enabled
+	 * \param processingConfig processing config
+	 * \param memoryConfig memory config
+	 * \param chunkSizeBytes chunk size in bytes
+	 * \param numaNodeId NUMA node the threads of the coordinator are bound to
+	 * \param maxConcurrency number of threads of the coordinator
+	 * \param coordinatorId id of the coordinator
+	 * \return created coordinator
+	 */
+	std::shared_ptr<CpuDeviceCoordinator> createCpuDeviceCoordinator(ProcessingConfig& processingConfig,
+	                                                                  const MemoryAllocation::MemoryConfig& memoryConfig,
+	                                                                  size_t chunkSizeBytes, int numaNodeId,
+	                                                                  int maxConcurrency, size_t coordinatorId);
+
 public:
+	/**
+	 * \brief Creates the scheduler with all coordinator threads and the watchdog thread. These are kept alive until
+	 *		  the scheduler is destroyed, therefore the scheduler can process any number of files one after another
+	 * \param processingConfig processing config
+	 * \param chunkSizeBytes chunk size in bytes of a single column
+	 */
 	explicit JobScheduler(ProcessingConfig& processingConfig, size_t chunkSizeBytes = DEFAULT_CHUNK_SIZE);
 
 	~JobScheduler();
@@ -82,28 +302,83 @@ public:
 	}
 
 	/**
-	 * \brief Returns if there is any coordinator available
-	 * \return true if there is any coordinator available, false otherwise
+	 * \brief Returns whether all chunks were claimed and all claimed jobs are either finished or failed
+	 * \return true if all work is done, false otherwise
 	 */
-	bool anyCoordinatorAvailable();
+	[[nodiscard]] bool allJobsFinished() const {
+		return jobsInFlight.load() == 0 && !jobRemaining();
+	}
+
+	/**
+	 * \brief Callback for device coordinator to claim the next job. Called concurrently by all coordinators without
+	 *		  any lock
+	 * \param coordinatorIdx index of the coordinator
+	 * \return claimed job or nullptr if all chunks were claimed already
+	 */
+	std::unique_ptr<Job> claimJob(size_t coordinatorIdx);
 
 	/**
-	 * \brief Returns if there is any coordinator processing job
-	 * \return true if all coordinators are available, false otherwise
+	 * \brief Takes over a queued job that another coordinator did not start yet. Used once all chunks are claimed, so
+	 *		  that idle coordinators help with the tail of the run instead of waiting for the slowest one. Slowest
+	 *		  coordinators are asked first since their queued jobs would finish last
+	 * \param coordinatorIdx index of the idle coordinator
+	 * \return taken over job or nullptr if there is none the coordinator can process
 	 */
-	bool allCoordinatorsAvailable();
+	std::unique_ptr<Job> takeOverQueuedJob(size_t coordinatorIdx);
 
 	/**
-	 * \brief Gets next best available coordinator. Caller must ensure that there is at least one coordinator available
-	 * \return shared pointer to given coordinator - this is cast to DeviceCoordinator
+	 * \brief Takes the first re-issued job that the coordinator can process
+	 * \param coordinatorIdx index of the coordinator
+	 * \return re-issued job or nullptr if there is none the coordinator can process
 	 */
-	std::pair<size_t, std::shared_ptr<DeviceCoordinator>> getNextAvailableDeviceCoordinator();
+	std::unique_ptr<Job> takeReissuedJob(size_t coordinatorIdx);
+
+	/**
+	 * \brief Checks whether any coordinator stalled. Each stalled coordinator is quarantined - its queued jobs are
+	 *		  re-issued and a copy of its current job is speculatively re-issued to the other coordinators. Called
+	 *		  periodically by the watchdog
+	 */
+	void recoverStalledCoordinators();
+
+	/**
+	 * \brief Releases quarantine of each coordinator whose thread finished all runs it was started for - i.e. its
+	 *		  stalled job returned. Such coordinator is used again from the next run. Called between the runs
+	 */
+	void releaseRecoveredCoordinators();
+
+	/**
+	 * \brief Decides whether a finished copy of a job is accepted - the first finished copy of a re-issued job is
+	 *		  accepted, the others are discarded. Jobs that were not re-issued are always accepted. Must be called with
+	 *		  coordinatorMutex locked
+	 * \param jobId id of the job
+	 * \param coordinatorIdx index of the coordinator that processed the copy
+	 * \return true if the result should be used, false if it should be discarded
+	 */
+	bool acceptJobCopy(size_t jobId, size_t coordinatorIdx);
 
 	/**
 	 * \brief Adds processed job to the accumulated results
 	 * \param job unique pointer to the job
+	 * \param jobResult reduced result of the job
 	 */
-	void addProcessedJob(std::unique_ptr<Job> job);
+	void addProcessedJob(std::unique_ptr<Job> job, JobResult jobResult);
+
+	/**
+	 * \brief Folds pending results into the result of the region as long as they are contiguous in chunks
+	 * \param regionIdx index of the region
+	 */
+	void foldPendingResults(size_t regionIdx);
+
+	/**
+	 * \brief Folds results of all regions into the total result of their files in the order of the regions
+	 */
+	void foldRegionResults();
+
+	/**
+	 * \brief Folds results that remain pending once all jobs are finished - i.e. when some job was lost due to a
+	 *		  non-fatal error. These are merged via tree reduction for each file and folded into its total result
+	 */
+	void foldLeftoverResults();
 
 	/**
 	 * \brief Callback for DeviceCoordinator to notify that job is finished
@@ -130,9 +405,50 @@ public:
 	void terminateDeviceCoordinators() const;
 
 	/**
-	 * \brief Assigns job to available coordinator
+	 * \brief Starts all coordinators that are not quarantined - from now on they claim and process jobs on their own
+	 */
+	void startDeviceCoordinators();
+
+	/**
+	 * \brief Updates moving average of the coordinator throughput with the finished job
+	 * \param coordinatorIdx index of the coordinator
+	 * \param job finished job
+	 */
+	void updateThroughput(size_t coordinatorIdx, const Job& job);
+
+	/**
+	 * \brief Computes number of chunks of the next job for the coordinator. The coordinator gets part of the remaining
+	 *		  data proportional to its share of the total throughput, limited by its maximum job size and rounded to
+	 *		  its job granularity
+	 * \param coordinatorIdx index of the coordinator
+	 * \return number of chunks of the next job
 	 */
-	void assignJob();
+	size_t getJobSizeChunks(size_t coordinatorIdx);
+
+	/**
+	 * \brief Logs how long each coordinator was busy and how long it waited for jobs
+	 */
+	void logCoordinatorUtilization();
+
+	/**
+	 * \brief Logs latencies of the pipeline stages of each coordinator, does nothing unless profiling is compiled in
+	 */
+	void logStageProfiles();
+
+	/**
+	 * \brief Locks the coordinator mutex and records how long the coordinator waited for it
+	 * \param coordinatorIdx index of the coordinator taking the lock
+	 * \return lock of the coordinator mutex
+	 */
+	std::unique_lock<std::mutex> lockCoordinatorMutex(size_t coordinatorIdx);
+
+	/**
+	 * \brief Returns whether a fatal error terminated the coordinators, in which case no other run can be done
+	 * \return true if a fatal error occurred, false otherwise
+	 */
+	[[nodiscard]] bool fatalErrorOccurred() const {
+		return hasFatalError;
+	}
 
 	/**
 	 * \brief Checks for errors and throws an instance of std::runtime_error if any exception (that was fatal) occurred 
@@ -140,7 +456,76 @@ public:
 	void checkForErrors();
 
 	/**
-	 * \brief Runs the job scheduler.
+	 * \brief Runs the job scheduler on the files from the processing config
+	 * \return merged accumulator for each column
 	 */
 	std::vector<StatsAccumulator> run();
+
+	/**
+	 * \brief Runs the job scheduler on given files - can be called repeatedly, the results of the previous run are
+	 *		  replaced. The files must have the same number of columns as the file from the processing config
+	 * \param distFilePath path to the file with values
+	 * \param keyFilePath path to the file with keys, must be set if and only if the processing config has one
+	 * \param byteRange range of bytes [first, second) to process, must start at a record boundary
+	 * \return merged accumulator for each column
+	 */
+	std::vector<StatsAccumulator> run(const fs::path& distFilePath, const fs::path& keyFilePath,
+	                                  std::pair<size_t, size_t> byteRange = WHOLE_FILE_RANGE);
+
+	/**
+	 * \brief Runs the job scheduler on several files at once - the files share the coordinators, therefore small files
+	 *		  keep all devices busy even though each of them has only a few jobs. Not supported when grouping by key.
+	 *		  The getters return results of the first file afterwards
+	 * \param filePaths paths to the files, at most MAX_FILES_PER_RUN files each consisting of whole records
+	 * \return results of each file in the order of the paths, valid until the next run
+	 */
+	const std::vector<FileResult>& runFiles(const std::vector<fs::path>& filePaths);
+
+	/**
+	 * \brief Returns histogram of all processed values, this is complete once run() returns
+	 * \param column index of the column
+	 * \return histogram of the processed values
+	 */
+	[[nodiscard]] const Histogram& getHistogram(const size_t column = 0) const {
+		return fileResults.front().Histograms.at(column);
+	}
+
+	/**
+	 * \brief Returns histograms of all columns, these are complete once run() returns
+	 * \return histograms of the processed values of each column
+	 */
+	[[nodiscard]] const std::vector<Histogram>& getHistograms() const {
+		return fileResults.front().Histograms;
+	}
+
+	/**
+	 * \brief Returns co-moments of all processed records, this is complete once run() returns
+	 * \return co-moments of the processed records
+	 */
+	[[nodiscard]] const CoMomentAccumulator& getCoMoments() const {
+		return fileResults.front().CoMoments;
+	}
+
+	/**
+	 * \brief Returns statistics for each key, this is complete once run() returns
+	 * \return statistics for each key sorted by the key, empty if values are not grouped by key
+	 */
+	[[nodiscard]] const std::vector<KeyStats>& getGroups() const {
+		return groups;
+	}
+
+	/**
+	 * \brief Returns number of interleaved columns in each record
+	 * \return number of columns
+	 */
+	[[nodiscard]] size_t getNColumns() const {
+		return nColumns;
+	}
+
+	/**
+	 * \brief Writes latencies of the pipeline stages of each coordinator from the last run as a single line of JSON
+	 * \param output output stream
+	 * \param runName name of the run written along the latencies, omitted if empty
+	 */
+	void writeStageProfiles(std::ostream& output, const std::string& runName = "") const;
 };
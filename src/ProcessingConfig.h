@@ -1,16 +1,16 @@
 #pragma once
-#define NOMINMAX
-#define CL_USE_DEPRECATED_OPENCL_2_0_APIS
-#define CL_HPP_TARGET_OPENCL_VERSION 200
-#define CL_TARGET_OPENCL_VERSION 200
-
-#include <CL/opencl.hpp>
 #include <filesystem>
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include "ClConfig.h"
+
 
 namespace fs = std::filesystem;
+constexpr auto DEFAULT_CPU_QUEUE_DEPTH = 2;
+constexpr auto DEFAULT_CL_QUEUE_DEPTH = 2;
+constexpr auto DEFAULT_CL_JOBS_PER_DEVICE = 1;
 constexpr auto DEFAULT_MEMORY_LIMIT = 1024ULL * 1024 * 1024;
 
 // This is very naive, but we expect that the system actually gives us 4 GB
@@ -32,6 +32,45 @@ enum ProcessingMode {
 	ALL,
 };
 
+// Extensions which provide double precision on OpenCL devices
+constexpr auto DOUBLE_PRECISION_DEFAULT = "cl_khr_fp64";
+constexpr auto DOUBLE_PRECISION_AMD = "cl_amd_fp64";
+
+/**
+ * \brief Precision of the computation on OpenCL devices
+ */
+enum ClPrecision {
+	/**
+	 * \brief Only devices with double precision are used
+	 */
+	FP64,
+	/**
+	 * \brief Devices without double precision use the compensated fp32 kernel, the others the fp64 kernel
+	 */
+	FP32_FALLBACK,
+	/**
+	 * \brief All devices use the compensated fp32 kernel - for devices whose double precision is much slower
+	 */
+	FP32,
+};
+
+inline const auto CL_PRECISIONS_LUT = std::unordered_map<std::string, ClPrecision>{
+	{"fp64", ClPrecision::FP64},
+	{"fp32_fallback", ClPrecision::FP32_FALLBACK},
+	{"fp32", ClPrecision::FP32},
+};
+
+/**
+ * \brief Returns whether the OpenCL device supports double precision
+ * \param device OpenCL device
+ * \return true if the device has one of the double precision extensions
+ */
+inline bool clDeviceSupportsFp64(const cl::Device& device) {
+	const auto extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+	return extensions.find(DOUBLE_PRECISION_DEFAULT) != std::string::npos ||
+		extensions.find(DOUBLE_PRECISION_AMD) != std::string::npos;
+}
+
 // LUT for processing modes so we don't have to do 20 if statements
 inline const auto PROCESSING_MODES_LUT = std::unordered_map<std::string, ProcessingMode>{
 	{"single_thread", ProcessingMode::SINGLE_THREAD},
@@ -86,5 +125,73 @@ struct ProcessingConfig {
 	 * \brief Timeout for watchdog in milliseconds
 	 */
 	size_t WatchdogTimeoutMs{};
-	
+
+	/**
+	 * \brief Number of interleaved double columns in each record of the file - 1 means the file is a plain sequence
+	 *		  of doubles
+	 */
+	size_t NColumns = 1;
+
+	/**
+	 * \brief Filesystem path to the file with uint32 key for each value - if set, statistics are computed for each key
+	 */
+	fs::path KeyFilePath;
+
+	/**
+	 * \brief Maximum number of jobs assigned to the CPU (SMP) coordinator at once. If more than 1, data of the next job
+	 *		  are read while the current job is computed
+	 */
+	size_t CpuQueueDepth = DEFAULT_CPU_QUEUE_DEPTH;
+
+	/**
+	 * \brief Maximum number of jobs assigned to each OpenCL coordinator at once
+	 */
+	size_t ClQueueDepth = DEFAULT_CL_QUEUE_DEPTH;
+
+	/**
+	 * \brief Number of CPU (SMP) coordinators - each has its own threads bound to a NUMA node and processes its own
+	 *		  region of the file. 0 means one coordinator per NUMA node
+	 */
+	size_t NCpuNodes = 0;
+
+	/**
+	 * \brief Time in milliseconds without any progress of a coordinator after which its job is re-issued to another
+	 *		  coordinator and the stalled coordinator is quarantined until its stalled job returns. 0 disables the
+	 *		  recovery
+	 */
+	size_t StallTimeoutMs = 0;
+
+	/**
+	 * \brief Range of bytes [first, second) of the file to process, the end is clamped to the file size
+	 */
+	std::pair<size_t, size_t> ByteRange = {0, SIZE_MAX};
+
+	/**
+	 * \brief Path of the Unix domain socket to serve requests on - if set, the application runs as a server and keeps
+	 *		  the devices ready between the requests
+	 */
+	fs::path ServerSocketPath;
+
+	/**
+	 * \brief Path of the Unix domain socket of a running server - if set, the file is processed by the server
+	 */
+	fs::path ConnectSocketPath;
+
+	/**
+	 * \brief Whether the file is a list of files (one path per line) which are all processed in one process
+	 */
+	bool IsBatch = false;
+
+	/**
+	 * \brief Precision of the computation on OpenCL devices. The fp32 kernel agrees with the fp64 one within the bound
+	 *		  documented at CL_FP32_RELATIVE_ERROR_PER_VALUE
+	 */
+	ClPrecision ClPrecision = FP64;
+
+	/**
+	 * \brief Number of jobs processed concurrently on each OpenCL device - each job has its own coordinator with its
+	 *		  own command queues and buffers, so that large devices are not left idle while a job is transferred or
+	 *		  reduced
+	 */
+	size_t ClJobsPerDevice = DEFAULT_CL_JOBS_PER_DEVICE;
 };
@@ -0,0 +1,213 @@
+#pragma once
+#include <filesystem>
+#include <sstream>
+#include <tbb/tbb.h>
+
+#include "SocketUtils.h"
+#include "DistributionClassification.h"
+#include "JobScheduler.h"
+#include "Logging.h"
+#include "ProcessingConfig.h"
+#include "Timer.h"
+
+// Requests and responses are plain text. The request consists of "name value" lines terminated by an empty line:
+//   file <path>              - file to process (required)
+//   key <path>               - key file, required if and only if the server was started with one
+//   range <start> <end>      - range of bytes to process, the whole file by default
+// The response starts with SERVER_STATUS_OK or SERVER_STATUS_ERROR followed by the message. Results follow the OK
+// status in the same format as they are printed to the console, the server closes the connection once they are sent
+constexpr auto SERVER_STATUS_OK = "OK";
+constexpr auto SERVER_STATUS_ERROR = "ERROR";
+
+// Requests are served one by one, therefore a client that stops sending its request must not block the server forever.
+// Each receive of the request waits at most this long
+constexpr auto SERVER_RECEIVE_TIMEOUT = std::chrono::milliseconds{10000};
+
+/**
+ * \brief Request to process a file on the server
+ */
+struct ServerRequest {
+	fs::path DistFilePath; // file to process
+	fs::path KeyFilePath; // key file, empty if values are not grouped by key
+	std::pair<size_t, size_t> ByteRange = WHOLE_FILE_RANGE; // range of bytes to process
+};
+
+/**
+ * \brief Serializes the request into lines sent to the server
+ * \param request request
+ * \return serialized request including the terminating empty line
+ */
+inline std::string serializeServerRequest(const ServerRequest& request) {
+	auto result = std::stringstream();
+	result << "file " << request.DistFilePath.string() << "\n";
+	if (!request.KeyFilePath.empty()) {
+		result << "key " << request.KeyFilePath.string() << "\n";
+	}
+	result << "range " << request.ByteRange.first << " " << request.ByteRange.second << "\n";
+	result << "\n";
+	return result.str();
+}
+
+/**
+ * \brief Receives request from the client
+ * \param client connected client
+ * \return parsed request
+ */
+inline ServerRequest receiveServerRequest(SocketUtils::LocalSocket& client) {
+	auto request = ServerRequest();
+	auto line = std::string();
+	while (true) {
+		if (!client.receiveLine(line)) {
+			throw std::runtime_error("Connection was closed or timed out before the end of the request");
+		}
+
+		if (line.empty()) {
+			break;
+		}
+
+		const auto separatorIdx = line.find(' ');
+		const auto name = line.substr(0, separatorIdx);
+		const auto value = separatorIdx == std::string::npos ? std::string() : line.substr(separatorIdx + 1);
+		if (name == "file") {
+			request.DistFilePath = value;
+		}
+		else if (name == "key") {
+			request.KeyFilePath = value;
+		}
+		else if (name == "range") {
+			auto rangeStream = std::stringstream(value);
+			if (!(rangeStream >> request.ByteRange.first >> request.ByteRange.second) ||
+				request.ByteRange.first >= request.ByteRange.second) {
+				throw std::runtime_error("Invalid byte range: " + value);
+			}
+		}
+		else {
+			throw std::runtime_error("Unknown request line: " + line);
+		}
+	}
+
+	if (request.DistFilePath.empty()) {
+		throw std::runtime_error("File path not specified");
+	}
+
+	if (!fs::exists(request.DistFilePath)) {
+		throw std::runtime_error("File path " + request.DistFilePath.string() + " does not exist.");
+	}
+
+	if (!request.KeyFilePath.empty() && !fs::exists(request.KeyFilePath)) {
+		throw std::runtime_error("Key file path " + request.KeyFilePath.string() + " does not exist.");
+	}
+
+	return request;
+}
+
+/**
+ * \brief Processes the request on the scheduler and formats the results
+ * \param jobScheduler job scheduler set up by the server
+ * \param request request
+ * \return results in the same format as printed to the console, followed by the stage latencies of the request as a
+ *		   line of JSON if profiling is compiled in
+ */
+inline std::string processServerRequest(JobScheduler& jobScheduler, const ServerRequest& request) {
+	log(INFO, "[SERVER] Processing file: \"" + request.DistFilePath.string() + "\"");
+	auto timer = Timer();
+	timer.start();
+	const auto result = jobScheduler.run(request.DistFilePath, request.KeyFilePath, request.ByteRange);
+	timer.stop();
+	timer.printResults();
+
+	auto output = std::stringstream();
+	printResults(result, jobScheduler.getHistograms(), jobScheduler.getCoMoments(), jobScheduler.getGroups(),
+	             !request.KeyFilePath.empty(), output);
+
+	// Latencies of the request go to the client along the results, the server may serve many different clients
+	if constexpr (STAGE_PROFILING_ENABLED) {
+		jobScheduler.writeStageProfiles(output, request.DistFilePath.string());
+	}
+	return output.str();
+}
+
+/**
+ * \brief Runs the server - the devices are set up once and then the server processes requests one by one until it
+ *		  is killed. Requests are processed sequentially since a single run already uses all devices
+ * \param config processing configuration, the file of the config is only used to set up the devices
+ */
+inline void runServer(ProcessingConfig& config) {
+	auto tbbThreadControl = tbb::global_control(tbb::global_control::max_allowed_parallelism,
+	                                            config.ProcessingMode == SINGLE_THREAD
+		                                            ? 1
+		                                            : tbb::this_task_arena::max_concurrency()
+	);
+
+	try {
+		log(INFO, "[SERVER] Setting up the devices");
+		auto jobScheduler = std::make_unique<JobScheduler>(config);
+		const auto serverSocket = SocketUtils::LocalSocket::listen(config.ServerSocketPath);
+		log(INFO, "[SERVER] Listening on \"" + config.ServerSocketPath.string() + "\"");
+
+		while (true) {
+			auto client = serverSocket.accept();
+			try {
+				client.setReceiveTimeout(SERVER_RECEIVE_TIMEOUT);
+				const auto request = receiveServerRequest(client);
+				try {
+					const auto results = processServerRequest(*jobScheduler, request);
+					client.sendAll(std::string(SERVER_STATUS_OK) + "\n" + results);
+				}
+				catch (const std::runtime_error& err) {
+					// Fatal error terminates the coordinators, therefore the devices are set up again
+					if (jobScheduler->fatalErrorOccurred()) {
+						log(WARNING, "[SERVER] Setting up the devices again after a fatal error");
+						jobScheduler = std::make_unique<JobScheduler>(config);
+					}
+					throw;
+				}
+			}
+			catch (const std::runtime_error& err) {
+				log(WARNING, std::string("[SERVER] Request failed: ") + err.what());
+				try {
+					client.sendAll(std::string(SERVER_STATUS_ERROR) + " " + err.what() + "\n");
+				}
+				catch (const std::runtime_error&) {
+					// Client is gone already, there is nobody to report the error to
+				}
+			}
+		}
+	}
+	catch (const std::runtime_error& err) {
+		log(CRITICAL, err.what());
+		exit(1); // NOLINT(concurrency-mt-unsafe)
+	}
+}
+
+/**
+ * \brief Sends the file from the config to the server and prints the results
+ * \param config processing configuration of the client
+ */
+inline void runClient(const ProcessingConfig& config) {
+	try {
+		auto server = SocketUtils::LocalSocket::connect(config.ConnectSocketPath);
+		server.sendAll(serializeServerRequest({config.DistFilePath, config.KeyFilePath, config.ByteRange}));
+
+		auto status = std::string();
+		if (!server.receiveLine(status)) {
+			throw std::runtime_error("Server closed the connection without any response");
+		}
+
+		if (status != SERVER_STATUS_OK) {
+			const auto messageIdx = std::min(status.size(), std::string(SERVER_STATUS_ERROR).size() + 1);
+			throw std::runtime_error("Server failed to process the file: " + status.substr(messageIdx));
+		}
+
+		const auto results = server.receiveAll();
+		std::cout << results;
+		if (!config.OutputPath.empty()) {
+			auto file = std::fstream(config.OutputPath, std::ios::out);
+			file << results;
+		}
+	}
+	catch (const std::runtime_error& err) {
+		log(CRITICAL, err.what());
+		exit(1); // NOLINT(concurrency-mt-unsafe)
+	}
+}
@@ -0,0 +1,275 @@
+#pragma once
+#ifdef _WIN32
+#include <winsock2.h>
+#include <afunix.h>
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+namespace fs = std::filesystem;
+
+namespace SocketUtils {
+
+#ifdef _WIN32
+	using SocketHandle = SOCKET;
+	constexpr auto INVALID_SOCKET_HANDLE = INVALID_SOCKET;
+	constexpr auto SEND_FLAGS = 0;
+#else
+	using SocketHandle = int;
+	constexpr auto INVALID_SOCKET_HANDLE = -1;
+	constexpr auto SEND_FLAGS = MSG_NOSIGNAL; // Closed peer is reported as an error instead of SIGPIPE
+#endif
+
+	// Size of the buffer for a single receive call
+	constexpr auto RECEIVE_BUFFER_SIZE = 4096;
+
+	/**
+	 * \brief Initializes the socket library - Winsock must be started before any socket is created, other platforms
+	 *		  do not need anything
+	 */
+	inline void initialize() {
+#ifdef _WIN32
+		static const auto startupResult = [] {
+			auto wsaData = WSADATA{};
+			return WSAStartup(MAKEWORD(2, 2), &wsaData);
+		}();
+		if (startupResult != 0) {
+			throw std::runtime_error("Failed to initialize Winsock, error: " + std::to_string(startupResult));
+		}
+#endif
+	}
+
+	/**
+	 * \brief Builds address of the Unix domain socket
+	 * \param socketPath path of the socket
+	 * \return socket address
+	 */
+	inline sockaddr_un buildAddress(const fs::path& socketPath) {
+		auto address = sockaddr_un{};
+		address.sun_family = AF_UNIX;
+		const auto pathStr = socketPath.string();
+		if (pathStr.size() >= sizeof(address.sun_path)) {
+			throw std::runtime_error("Socket path " + pathStr + " is too long");
+		}
+
+		std::memcpy(address.sun_path, pathStr.c_str(), pathStr.size() + 1);
+		return address;
+	}
+
+	/**
+	 * \brief Stream socket in the Unix domain (local to the machine). The socket is closed once the object is destroyed
+	 */
+	class LocalSocket {
+
+		/**
+		 * \brief Handle of the socket
+		 */
+		SocketHandle handle = INVALID_SOCKET_HANDLE;
+
+		/**
+		 * \brief Received data that were not returned by receiveLine yet
+		 */
+		std::string receiveBuffer;
+
+		explicit LocalSocket(const SocketHandle handle) : handle(handle) {
+		}
+
+		/**
+		 * \brief Creates new socket of the Unix domain
+		 * \return created socket
+		 */
+		static LocalSocket create() {
+			initialize();
+			const auto handle = socket(AF_UNIX, SOCK_STREAM, 0);
+			if (handle == INVALID_SOCKET_HANDLE) {
+				throw std::runtime_error("Failed to create Unix domain socket");
+			}
+
+			return LocalSocket(handle);
+		}
+
+	public:
+		LocalSocket() = default;
+
+		LocalSocket(const LocalSocket&) = delete;
+		LocalSocket& operator=(const LocalSocket&) = delete;
+
+		LocalSocket(LocalSocket&& other) noexcept :
+			handle(other.handle),
+			receiveBuffer(std::move(other.receiveBuffer)) {
+			other.handle = INVALID_SOCKET_HANDLE;
+		}
+
+		LocalSocket& operator=(LocalSocket&& other) noexcept {
+			if (this != &other) {
+				close();
+				handle = other.handle;
+				receiveBuffer = std::move(other.receiveBuffer);
+				other.handle = INVALID_SOCKET_HANDLE;
+			}
+
+			return *this;
+		}
+
+		~LocalSocket() {
+			close();
+		}
+
+		/**
+		 * \brief Creates socket listening on given path, stale socket file of a previous server is removed
+		 * \param socketPath path of the socket
+		 * \return listening socket
+		 */
+		static LocalSocket listen(const fs::path& socketPath) {
+			auto result = create();
+			const auto address = buildAddress(socketPath);
+			std::error_code errorCode;
+			fs::remove(socketPath, errorCode);
+			if (bind(result.handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 ||
+				::listen(result.handle, SOMAXCONN) != 0) {
+				throw std::runtime_error("Failed to listen on socket " + socketPath.string());
+			}
+
+			return result;
+		}
+
+		/**
+		 * \brief Connects to the socket listening on given path
+		 * \param socketPath path of the socket
+		 * \return connected socket
+		 */
+		static LocalSocket connect(const fs::path& socketPath) {
+			auto result = create();
+			const auto address = buildAddress(socketPath);
+			if (::connect(result.handle, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+				throw std::runtime_error("Failed to connect to socket " + socketPath.string() +
+					", is the server running?");
+			}
+
+			return result;
+		}
+
+		/**
+		 * \brief Waits for the next connection on the listening socket
+		 * \return connected socket
+		 */
+		[[nodiscard]] LocalSocket accept() const {
+			const auto clientHandle = ::accept(handle, nullptr, nullptr);
+			if (clientHandle == INVALID_SOCKET_HANDLE) {
+				throw std::runtime_error("Failed to accept connection");
+			}
+
+			return LocalSocket(clientHandle);
+		}
+
+		/**
+		 * \brief Sets how long a single receive call waits for data - once it expires the receive fails the same way
+		 *		  as if the connection was closed
+		 * \param timeout receive timeout, 0 waits forever
+		 */
+		void setReceiveTimeout(const std::chrono::milliseconds timeout) const {
+#ifdef _WIN32
+			const auto timeoutMs = static_cast<DWORD>(timeout.count());
+			const auto result = setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeoutMs),
+			                               sizeof(timeoutMs));
+#else
+			auto timeoutVal = timeval{};
+			timeoutVal.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+			timeoutVal.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+			const auto result = setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &timeoutVal, sizeof(timeoutVal));
+#endif
+			if (result != 0) {
+				throw std::runtime_error("Failed to set receive timeout of the socket");
+			}
+		}
+
+		/**
+		 * \brief Sends all data
+		 * \param data data to send
+		 */
+		void sendAll(const std::string& data) const {
+			auto bytesSent = 0ULL;
+			while (bytesSent < data.size()) {
+				const auto result = send(handle, data.data() + bytesSent, static_cast<int>(data.size() - bytesSent),
+				                         SEND_FLAGS);
+				if (result <= 0) {
+					throw std::runtime_error("Failed to send data, the connection was closed");
+				}
+
+				bytesSent += static_cast<size_t>(result);
+			}
+		}
+
+		/**
+		 * \brief Receives the next line
+		 * \param line received line without the line break
+		 * \return true if the line was received, false if the connection was closed or timed out before the end of
+		 *		   the line
+		 */
+		bool receiveLine(std::string& line) {
+			auto lineEnd = receiveBuffer.find('\n');
+			while (lineEnd == std::string::npos) {
+				if (!receiveChunk()) {
+					return false;
+				}
+
+				lineEnd = receiveBuffer.find('\n');
+			}
+
+			line = receiveBuffer.substr(0, lineEnd);
+			receiveBuffer.erase(0, lineEnd + 1);
+			return true;
+		}
+
+		/**
+		 * \brief Receives everything until the other side closes the connection
+		 * \return received data
+		 */
+		std::string receiveAll() {
+			while (receiveChunk()) {
+			}
+
+			return std::move(receiveBuffer);
+		}
+
+		/**
+		 * \brief Closes the socket, does nothing if it is closed already
+		 */
+		void close() {
+			if (handle == INVALID_SOCKET_HANDLE) {
+				return;
+			}
+
+#ifdef _WIN32
+			closesocket(handle);
+#else
+			::close(handle);
+#endif
+			handle = INVALID_SOCKET_HANDLE;
+		}
+
+	private:
+		/**
+		 * \brief Receives available data into the receive buffer
+		 * \return true if any data were received, false if the connection was closed or the receive timed out
+		 */
+		bool receiveChunk() {
+			char buffer[RECEIVE_BUFFER_SIZE];
+			const auto result = recv(handle, buffer, RECEIVE_BUFFER_SIZE, 0);
+			if (result <= 0) {
+				return false;
+			}
+
+			receiveBuffer.append(buffer, static_cast<size_t>(result));
+			return true;
+		}
+	};
+}
@@ -0,0 +1,326 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include "StatUtils.h"
+
+// Per-stage timing is only compiled in if the build defines PPR_ENABLE_PROFILING=1 (e.g. /DPPR_ENABLE_PROFILING=1),
+// otherwise the timers do not read the clock and the compiler removes them entirely
+#ifndef PPR_ENABLE_PROFILING
+#define PPR_ENABLE_PROFILING 0
+#endif
+
+constexpr auto STAGE_PROFILING_ENABLED = PPR_ENABLE_PROFILING != 0;
+
+/**
+ * \brief Stages of the processing pipeline that are timed separately
+ */
+enum PipelineStage {
+	/**
+	 * \brief Reading the data of a job from the file (including waiting for the read-ahead)
+	 */
+	STAGE_READ,
+	/**
+	 * \brief Transfer of a batch to an OpenCL device, measured by the device
+	 */
+	STAGE_TRANSFER,
+	/**
+	 * \brief Kernel processing a batch on an OpenCL device, measured by the device
+	 */
+	STAGE_KERNEL,
+	/**
+	 * \brief Accumulation of a job on the host - SMP computation and the host part of the fp32 OpenCL path
+	 */
+	STAGE_ACCUMULATE,
+	/**
+	 * \brief Merging the accumulators of a job - on the device for OpenCL and by the scheduler for all coordinators
+	 */
+	STAGE_MERGE,
+	/**
+	 * \brief Time between two jobs of a coordinator - claiming the next job from the scheduler
+	 */
+	STAGE_SCHEDULER_WAIT,
+	/**
+	 * \brief Waiting for the coordinator mutex of the scheduler
+	 */
+	STAGE_LOCK_WAIT,
+	N_PIPELINE_STAGES,
+};
+
+const auto PIPELINE_STAGE_LUT = std::array<std::string, N_PIPELINE_STAGES>{
+	"read", "transfer", "kernel", "accumulate", "merge", "scheduler_wait", "lock_wait"
+};
+
+/**
+ * \brief Escapes the string so that it can be written inside a JSON string literal - quotes, backslashes and control
+ *		  characters are escaped, everything else is copied unchanged
+ * \param value string to escape
+ * \return escaped string without the surrounding quotes
+ */
+inline std::string escapeJson(const std::string& value) {
+	auto result = std::string();
+	result.reserve(value.size());
+	for (const auto c : value) {
+		switch (c) {
+		case '"':
+			result += "\\\"";
+			break;
+		case '\\':
+			result += "\\\\";
+			break;
+		case '\n':
+			result += "\\n";
+			break;
+		case '\r':
+			result += "\\r";
+			break;
+		case '\t':
+			result += "\\t";
+			break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				constexpr auto hexDigits = "0123456789abcdef";
+				result += "\\u00";
+				result += hexDigits[static_cast<unsigned char>(c) >> 4];
+				result += hexDigits[static_cast<unsigned char>(c) & 0xF];
+			}
+			else {
+				result += c;
+			}
+		}
+	}
+
+	return result;
+}
+
+// Latency histograms have power of two buckets - bucket b > 0 holds latencies in [2^(b-1), 2^b) ns, bucket 0 holds
+// zero latencies. The last bucket (2^46 ns, about 20 hours) takes everything above
+constexpr auto N_LATENCY_BUCKETS = 48;
+
+/**
+ * \brief Histogram of latencies with power of two buckets. Recording is lock-free so that any thread can record into
+ *		  the histogram of any coordinator
+ */
+class LatencyHistogram {
+
+	std::array<std::atomic<uint64_t>, N_LATENCY_BUCKETS> buckets;
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> totalNanos;
+	std::atomic<uint64_t> maxNanos;
+
+public:
+	LatencyHistogram() {
+		reset();
+	}
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+	/**
+	 * \brief Records a single latency
+	 * \param nanos latency in nanoseconds, negative latencies are recorded as zero
+	 */
+	void record(const int64_t nanos) {
+		const auto value = static_cast<uint64_t>(std::max<int64_t>(0, nanos));
+		buckets[bucketIdx(value)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		totalNanos.fetch_add(value, std::memory_order_relaxed);
+
+		auto currentMax = maxNanos.load(std::memory_order_relaxed);
+		while (value > currentMax && !maxNanos.compare_exchange_weak(currentMax, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	/**
+	 * \brief Removes all recorded latencies
+	 */
+	void reset() {
+		for (auto& bucket : buckets) {
+			bucket.store(0, std::memory_order_relaxed);
+		}
+		count.store(0, std::memory_order_relaxed);
+		totalNanos.store(0, std::memory_order_relaxed);
+		maxNanos.store(0, std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] uint64_t getCount() const {
+		return count.load(std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] uint64_t getTotalNanos() const {
+		return totalNanos.load(std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] uint64_t getMaxNanos() const {
+		return maxNanos.load(std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] uint64_t getBucket(const size_t bucket) const {
+		return buckets[bucket].load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * \brief Returns upper bound of the quantile - the upper edge of the bucket where the quantile falls, but at most
+	 *		  the maximum recorded latency
+	 * \param quantile quantile in [0, 1]
+	 * \return upper bound of the quantile in nanoseconds, 0 if nothing was recorded
+	 */
+	[[nodiscard]] uint64_t quantileNanos(const double quantile) const {
+		const auto total = getCount();
+		if (total == 0) {
+			return 0;
+		}
+
+		const auto rank = std::max<uint64_t>(
+			1, static_cast<uint64_t>(std::ceil(quantile * static_cast<double>(total))));
+		auto cumulative = uint64_t{0};
+		for (auto bucket = 0ULL; bucket < N_LATENCY_BUCKETS; bucket += 1) {
+			cumulative += getBucket(bucket);
+			if (cumulative >= rank) {
+				return std::min(bucket == 0 ? 0 : uint64_t{1} << bucket, getMaxNanos());
+			}
+		}
+
+		return getMaxNanos();
+	}
+
+private:
+	static size_t bucketIdx(uint64_t nanos) {
+		auto bucket = size_t{0};
+		while (nanos > 0 && bucket < N_LATENCY_BUCKETS - 1) {
+			nanos >>= 1;
+			bucket += 1;
+		}
+
+		return bucket;
+	}
+};
+
+/**
+ * \brief Latency histograms of all pipeline stages of a single coordinator. Does nothing unless profiling is compiled
+ *		  in
+ */
+class StageProfiler {
+
+	std::array<LatencyHistogram, N_PIPELINE_STAGES> stages;
+
+public:
+	/**
+	 * \brief Returns current time of the steady clock in nanoseconds
+	 * \return nanoseconds since the epoch of the steady clock
+	 */
+	static int64_t nowNanos() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/**
+	 * \brief Records latency of the stage
+	 * \param stage pipeline stage
+	 * \param nanos latency in nanoseconds
+	 */
+	void record(const PipelineStage stage, const int64_t nanos) {
+		if constexpr (STAGE_PROFILING_ENABLED) {
+			stages[stage].record(nanos);
+		}
+	}
+
+	/**
+	 * \brief Removes latencies of all stages - called at the start of each run
+	 */
+	void reset() {
+		for (auto& stage : stages) {
+			stage.reset();
+		}
+	}
+
+	[[nodiscard]] const LatencyHistogram& get(const PipelineStage stage) const {
+		return stages[stage];
+	}
+
+	/**
+	 * \brief Returns human readable summary of a stage
+	 * \param stage pipeline stage
+	 * \return formatted string, empty if the stage was never recorded
+	 */
+	[[nodiscard]] std::string stageSummary(const PipelineStage stage) const {
+		const auto& histogram = stages[stage];
+		const auto count = histogram.getCount();
+		if (count == 0) {
+			return "";
+		}
+
+		const auto toMicros = [](const uint64_t nanos) {
+			return StatUtils::doubleToStr(static_cast<double>(nanos) / 1000.0, 6) + " us";
+		};
+		return PIPELINE_STAGE_LUT[stage] + ": " + std::to_string(count) + "x, total " +
+			StatUtils::doubleToStr(static_cast<double>(histogram.getTotalNanos()) / 1e6, 6) + " ms, mean " +
+			toMicros(histogram.getTotalNanos() / count) + ", p50 <= " + toMicros(histogram.quantileNanos(0.5)) +
+			", p99 <= " + toMicros(histogram.quantileNanos(0.99)) + ", max " + toMicros(histogram.getMaxNanos());
+	}
+
+	/**
+	 * \brief Writes all stages as a JSON object - stage name to count, total, max, quantiles and the buckets (trailing
+	 *		  empty buckets are omitted)
+	 * \param output output stream
+	 */
+	void writeJson(std::ostream& output) const {
+		output << "{";
+		for (auto stageIdx = 0ULL; stageIdx < N_PIPELINE_STAGES; stageIdx += 1) {
+			const auto& histogram = stages[stageIdx];
+			output << (stageIdx > 0 ? "," : "") << "\"" << PIPELINE_STAGE_LUT[stageIdx] << "\":{"
+				<< "\"count\":" << histogram.getCount()
+				<< ",\"total_ns\":" << histogram.getTotalNanos()
+				<< ",\"max_ns\":" << histogram.getMaxNanos()
+				<< ",\"p50_ns\":" << histogram.quantileNanos(0.5)
+				<< ",\"p90_ns\":" << histogram.quantileNanos(0.9)
+				<< ",\"p99_ns\":" << histogram.quantileNanos(0.99)
+				<< ",\"buckets\":[";
+
+			auto nBuckets = size_t{N_LATENCY_BUCKETS};
+			while (nBuckets > 0 && histogram.getBucket(nBuckets - 1) == 0) {
+				nBuckets -= 1;
+			}
+			for (auto bucket = 0ULL; bucket < nBuckets; bucket += 1) {
+				output << (bucket > 0 ? "," : "") << histogram.getBucket(bucket);
+			}
+			output << "]}";
+		}
+		output << "}";
+	}
+};
+
+/**
+ * \brief Records the time from its construction to its destruction as latency of the stage. Neither reads the clock
+ *		  unless profiling is compiled in
+ */
+class ScopedStageTimer {
+
+	StageProfiler& profiler;
+	PipelineStage stage;
+	int64_t startNanos = 0;
+
+public:
+	ScopedStageTimer(StageProfiler& profiler, const PipelineStage stage) :
+		profiler(profiler),
+		stage(stage) {
+		if constexpr (STAGE_PROFILING_ENABLED) {
+			startNanos = StageProfiler::nowNanos();
+		}
+	}
+
+	ScopedStageTimer(const ScopedStageTimer&) = delete;
+	ScopedStageTimer& operator=(const ScopedStageTimer&) = delete;
+
+	~ScopedStageTimer() {
+		if constexpr (STAGE_PROFILING_ENABLED) {
+			profiler.record(stage, StageProfiler::nowNanos() - startNanos);
+		}
+	}
+};
@@ -96,6 +96,27 @@ namespace StatUtils {
 		return result;
 	}
 
+	/**
+	 * \brief Merges two accumulators while skipping empty and invalid ones. If neither is usable the invalid one is
+	 *		  returned so that the classifier can inform the user
+	 * \param lhs left hand side
+	 * \param rhs right hand side
+	 * \return merged accumulator
+	 */
+	inline StatsAccumulator mergeValid(StatsAccumulator lhs, StatsAccumulator rhs) {
+		const auto lhsUsable = lhs.valid() && lhs.getN() > 0;
+		const auto rhsUsable = rhs.valid() && rhs.getN() > 0;
+		if (lhsUsable && rhsUsable) {
+			return lhs + rhs;
+		}
+
+		if (lhsUsable || (!rhsUsable && !lhs.valid())) {
+			return lhs;
+		}
+
+		return rhs;
+	}
+
 	/**
 	 * \brief Converts double to string with precision up to "precision" decimal places
 	 * \param value value to be converted
@@ -108,19 +108,25 @@ StatsAccumulator StatsAccumulator::operator+(StatsAccumulator& other) {
 	auto result = StatsAccumulator();
 	result.n = n + other.n;
 
+	// Counts are converted to double first - e.g. (n - other.n) would wrap around for size_t if the right hand side
+	// is larger, which happens in the tree reduction
+	const auto nA = static_cast<double>(n);
+	const auto nB = static_cast<double>(other.n);
+	const auto nTotal = nA + nB;
+
 	const auto delta = other.m1 - m1;
 	const auto delta2 = delta * delta;
 	const auto delta3 = delta2 * delta;
 	const auto delta4 = delta2 * delta2;
-	const auto mean = (m1 * n + other.m1 * other.n) / result.n;
+	const auto mean = (m1 * nA + other.m1 * nB) / nTotal;
 	result.m1 = mean;
-	result.m2 = m2 + other.m2 + delta2 * n * other.n / result.n;
-	result.m3 = m3 + other.m3 + delta3 * n * other.n * (n - other.n) / (result.n * result.n) +
-		3.0 * delta * (n * other.m2 - other.n * m2) / result.n;
-	result.m4 = m4 + other.m4 + delta4 * n * other.n * (n * n - n * other.n + other.n * other.n) /
-		(result.n * result.n * result.n) +
-		6.0 * delta2 * (n * n * other.m2 + other.n * other.n * m2) / (result.n * result.n) +
-		4.0 * delta * (n * other.m3 - other.n * m3) / result.n;
+	result.m2 = m2 + other.m2 + delta2 * nA * nB / nTotal;
+	result.m3 = m3 + other.m3 + delta3 * nA * nB * (nA - nB) / (nTotal * nTotal) +
+		3.0 * delta * (nA * other.m2 - nB * m2) / nTotal;
+	result.m4 = m4 + other.m4 + delta4 * nA * nB * (nA * nA - nA * nB + nB * nB) /
+		(nTotal * nTotal * nTotal) +
+		6.0 * delta2 * (nA * nA * other.m2 + nB * nB * m2) / (nTotal * nTotal) +
+		4.0 * delta * (nA * other.m3 - nB * m3) / nTotal;
 
 	result.isIntegerDistribution = isIntegerDistribution && other.isIntegerDistribution;
 	result.minVal = std::min(minVal, other.minVal);
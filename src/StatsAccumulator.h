@@ -3,6 +3,7 @@
 
 // Forward declaration for friend class
 class Avx2StatsAccumulator;
+class StatsAccumulatorBatch;
 // class StatsMerger;
 
 /**
@@ -10,6 +11,7 @@ class Avx2StatsAccumulator;
  */
 class StatsAccumulator {
 	friend class Avx2StatsAccumulator;
+	friend class StatsAccumulatorBatch;
 	// friend class StatsMerger;
 
 	/**
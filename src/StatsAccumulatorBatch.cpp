@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <tbb/tbb.h>
+
+#include "StatsAccumulatorBatch.h"
+#include "StatUtils.h"
+#include "VectorizationUtils.h"
+
+StatsAccumulatorBatch::StatsAccumulatorBatch(const size_t size) :
+	nItems(size),
+	fields(N_BATCH_FIELDS * size, 0.0) {
+	std::fill_n(field(INTEGER_ONLY_IDX), nItems, 1.0);
+	std::fill_n(field(MIN_IDX), nItems, std::numeric_limits<double>::infinity());
+}
+
+StatsAccumulatorBatch::StatsAccumulatorBatch(const std::vector<StatsAccumulator>& items) :
+	StatsAccumulatorBatch(items.size()) {
+	for (auto i = 0ULL; i < items.size(); i += 1) {
+		set(i, items[i]);
+	}
+}
+
+void StatsAccumulatorBatch::set(const size_t idx, const StatsAccumulator& item) {
+	field(N_ITEMS_IDX)[idx] = static_cast<double>(item.n);
+	field(M1_IDX)[idx] = item.m1;
+	field(M2_IDX)[idx] = item.m2;
+	field(M3_IDX)[idx] = item.m3;
+	field(M4_IDX)[idx] = item.m4;
+	field(INTEGER_ONLY_IDX)[idx] = item.isIntegerDistribution ? 1.0 : 0.0;
+	field(MIN_IDX)[idx] = item.minVal;
+}
+
+StatsAccumulator StatsAccumulatorBatch::get(const size_t idx) const {
+	return {
+		static_cast<size_t>(field(N_ITEMS_IDX)[idx]),
+		field(M1_IDX)[idx],
+		field(M2_IDX)[idx],
+		field(M3_IDX)[idx],
+		field(M4_IDX)[idx],
+		field(INTEGER_ONLY_IDX)[idx] != 0.0,
+		field(MIN_IDX)[idx],
+	};
+}
+
+StatsAccumulator StatsAccumulatorBatch::merge(const size_t begin, const size_t end, const bool useAvx2) const {
+	if (begin >= end) {
+		return {};
+	}
+
+	// Copy the range so that the batch itself is not modified
+	auto scratch = StatsAccumulatorBatch(end - begin);
+	for (auto fieldIdx = 0; fieldIdx < N_BATCH_FIELDS; fieldIdx += 1) {
+		std::copy(field(fieldIdx) + begin, field(fieldIdx) + end, scratch.field(fieldIdx));
+	}
+
+	// Each level merges the upper half into the lower half, the middle item of odd-sized level is kept as is. Pairs of
+	// a level are independent, therefore the level is split into fixed blocks merged in parallel
+	auto width = scratch.size();
+	while (width > 1) {
+		const auto nPairs = width / 2;
+		const auto offset = width - nPairs;
+		const auto nMergeBlocks = (nPairs + MERGE_BLOCK_PAIRS - 1) / MERGE_BLOCK_PAIRS;
+		tbb::parallel_for(size_t{0}, nMergeBlocks, [&](const size_t mergeBlock) {
+			const auto blockBegin = mergeBlock * MERGE_BLOCK_PAIRS;
+			const auto blockEnd = std::min(nPairs, blockBegin + MERGE_BLOCK_PAIRS);
+			if (useAvx2) {
+				scratch.mergePairsAvx2(blockBegin, blockEnd, offset);
+			}
+			else {
+				scratch.mergePairs(blockBegin, blockEnd, offset);
+			}
+		});
+		width = offset;
+	}
+
+	return scratch.get(0);
+}
+
+std::vector<StatsAccumulator> StatsAccumulatorBatch::mergeBlocks(const size_t nBlocks, const bool useAvx2) const {
+	const auto blockSize = nItems / nBlocks;
+	auto result = std::vector<StatsAccumulator>();
+	for (auto block = 0ULL; block < nBlocks; block += 1) {
+		result.push_back(merge(block * blockSize, (block + 1) * blockSize, useAvx2));
+	}
+
+	return result;
+}
+
+void StatsAccumulatorBatch::mergePairs(const size_t begin, const size_t end, const size_t offset) {
+	for (auto i = begin; i < end; i += 1) {
+		set(i, StatUtils::mergeValid(get(i), get(i + offset)));
+	}
+}
+
+void StatsAccumulatorBatch::mergePairsAvx2(const size_t begin, const size_t end, const size_t offset) {
+	auto* n = field(N_ITEMS_IDX);
+	auto* m1 = field(M1_IDX);
+	auto* m2 = field(M2_IDX);
+	auto* m3 = field(M3_IDX);
+	auto* m4 = field(M4_IDX);
+	auto* integerOnly = field(INTEGER_ONLY_IDX);
+	auto* minVal = field(MIN_IDX);
+
+	const auto zero = _mm256_setzero_pd();
+	const auto allOnes = _mm256_castsi256_pd(_mm256_set1_epi64x(UINT64_MAX));
+	const auto momentsValid = [](const __m256d a, const __m256d b, const __m256d c, const __m256d d) {
+		return _mm256_castsi256_pd(_mm256_and_si256(
+			_mm256_and_si256(VectorizationUtils::valuesValid(a), VectorizationUtils::valuesValid(b)),
+			_mm256_and_si256(VectorizationUtils::valuesValid(c), VectorizationUtils::valuesValid(d))));
+	};
+
+	auto i = begin;
+	for (; i + 4 <= end; i += 4) {
+		const auto j = i + offset;
+		const auto nA = _mm256_loadu_pd(n + i), nB = _mm256_loadu_pd(n + j);
+		const auto m1A = _mm256_loadu_pd(m1 + i), m1B = _mm256_loadu_pd(m1 + j);
+		const auto m2A = _mm256_loadu_pd(m2 + i), m2B = _mm256_loadu_pd(m2 + j);
+		const auto m3A = _mm256_loadu_pd(m3 + i), m3B = _mm256_loadu_pd(m3 + j);
+		const auto m4A = _mm256_loadu_pd(m4 + i), m4B = _mm256_loadu_pd(m4 + j);
+		const auto intA = _mm256_loadu_pd(integerOnly + i), intB = _mm256_loadu_pd(integerOnly + j);
+		const auto minA = _mm256_loadu_pd(minVal + i), minB = _mm256_loadu_pd(minVal + j);
+
+		const auto nTotal = _mm256_add_pd(nA, nB);
+		const auto nAnB = _mm256_mul_pd(nA, nB);
+		const auto nTotal2 = _mm256_mul_pd(nTotal, nTotal);
+		const auto delta = _mm256_sub_pd(m1B, m1A);
+		const auto delta2 = _mm256_mul_pd(delta, delta);
+
+		// m1 = (nA * m1A + nB * m1B) / n
+		const auto m1R = _mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(nA, m1A), _mm256_mul_pd(nB, m1B)), nTotal);
+
+		// m2 = m2A + m2B + delta^2 * nA * nB / n
+		const auto m2R = _mm256_add_pd(_mm256_add_pd(m2A, m2B), _mm256_div_pd(_mm256_mul_pd(delta2, nAnB), nTotal));
+
+		// m3 = m3A + m3B + delta^3 * nA * nB * (nA - nB) / n^2 + 3 * delta * (nA * m2B - nB * m2A) / n
+		const auto m3a = _mm256_div_pd(
+			_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(delta2, delta), nAnB), _mm256_sub_pd(nA, nB)), nTotal2);
+		const auto m3b = _mm256_div_pd(
+			_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(3.0), delta),
+			              _mm256_sub_pd(_mm256_mul_pd(nA, m2B), _mm256_mul_pd(nB, m2A))), nTotal);
+		const auto m3R = _mm256_add_pd(_mm256_add_pd(m3A, m3B), _mm256_add_pd(m3a, m3b));
+
+		// m4 = m4A + m4B + delta^4 * nA * nB * (nA^2 - nA * nB + nB^2) / n^3
+		//		+ 6 * delta^2 * (nA^2 * m2B + nB^2 * m2A) / n^2 + 4 * delta * (nA * m3B - nB * m3A) / n
+		const auto m4a = _mm256_div_pd(
+			_mm256_mul_pd(_mm256_mul_pd(_mm256_mul_pd(delta2, delta2), nAnB),
+			              _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(nA, nA), nAnB), _mm256_mul_pd(nB, nB))),
+			_mm256_mul_pd(nTotal2, nTotal));
+		const auto m4b = _mm256_div_pd(
+			_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(6.0), delta2),
+			              _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(nA, nA), m2B),
+			                            _mm256_mul_pd(_mm256_mul_pd(nB, nB), m2A))), nTotal2);
+		const auto m4c = _mm256_div_pd(
+			_mm256_mul_pd(_mm256_mul_pd(_mm256_set1_pd(4.0), delta),
+			              _mm256_sub_pd(_mm256_mul_pd(nA, m3B), _mm256_mul_pd(nB, m3A))), nTotal);
+		const auto m4R = _mm256_add_pd(_mm256_add_pd(m4A, m4B), _mm256_add_pd(m4a, _mm256_add_pd(m4b, m4c)));
+
+		// Flags are 1.0 or 0.0, therefore AND of the bit patterns is the logical AND
+		const auto intR = _mm256_and_pd(intA, intB);
+		const auto minR = _mm256_min_pd(minA, minB);
+
+		// Same selection as StatUtils::mergeValid - empty or invalid side is skipped
+		const auto validA = momentsValid(m1A, m2A, m3A, m4A);
+		const auto validB = momentsValid(m1B, m2B, m3B, m4B);
+		const auto usableA = _mm256_and_pd(validA, _mm256_cmp_pd(nA, zero, _CMP_GT_OQ));
+		const auto usableB = _mm256_and_pd(validB, _mm256_cmp_pd(nB, zero, _CMP_GT_OQ));
+		const auto useMerged = _mm256_and_pd(_mm256_and_pd(usableA, usableB), momentsValid(m1R, m2R, m3R, m4R));
+		const auto useA = _mm256_or_pd(usableA, _mm256_andnot_pd(_mm256_or_pd(usableB, validA), allOnes));
+
+		const auto select = [&](const __m256d a, const __m256d b, const __m256d merged) {
+			return _mm256_blendv_pd(_mm256_blendv_pd(b, a, useA), merged, useMerged);
+		};
+
+		_mm256_storeu_pd(n + i, select(nA, nB, nTotal));
+		_mm256_storeu_pd(m1 + i, select(m1A, m1B, m1R));
+		_mm256_storeu_pd(m2 + i, select(m2A, m2B, m2R));
+		_mm256_storeu_pd(m3 + i, select(m3A, m3B, m3R));
+		_mm256_storeu_pd(m4 + i, select(m4A, m4B, m4R));
+		_mm256_storeu_pd(integerOnly + i, select(intA, intB, intR));
+		_mm256_storeu_pd(minVal + i, select(minA, minB, minR));
+	}
+
+	// Remaining pairs
+	for (; i < end; i += 1) {
+		set(i, StatUtils::mergeValid(get(i), get(i + offset)));
+	}
+}
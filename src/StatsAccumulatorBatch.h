@@ -0,0 +1,139 @@
+#pragma once
+#include <vector>
+
+#include "StatsAccumulator.h"
+
+// Fields of the batch - each field is stored as a contiguous array of doubles. The order matches the output of the
+// OpenCL kernel so that results of the device can be read directly into the batch
+constexpr auto N_ITEMS_IDX = 0;
+constexpr auto M1_IDX = 1;
+constexpr auto M2_IDX = 2;
+constexpr auto M3_IDX = 3;
+constexpr auto M4_IDX = 4;
+constexpr auto INTEGER_ONLY_IDX = 5;
+constexpr auto MIN_IDX = 6;
+constexpr auto N_BATCH_FIELDS = 7;
+
+// Number of pairs merged serially by a single task within one level of the tree - a multiple of four, so that only the
+// last block of a level has pairs that do not fill the whole AVX2 vector. Smaller levels are merged by a single task
+constexpr auto MERGE_BLOCK_PAIRS = size_t{1024};
+
+/**
+ * \brief Struct-of-arrays container of StatsAccumulator objects. Number of items is stored as double (exact up to 2^53)
+ *		  and the integer-only flag as 1.0 or 0.0 so that all fields can be processed by the same vector instructions.
+ *		  Accumulators are merged in a pairwise tree where each level merges four pairs at once with AVX2 and large
+ *		  levels are split into blocks merged in parallel
+ */
+class StatsAccumulatorBatch {
+
+	/**
+	 * \brief Number of accumulators in the batch
+	 */
+	size_t nItems = 0;
+
+	/**
+	 * \brief Values of all fields - field f of accumulator i is stored at f * nItems + i
+	 */
+	std::vector<double> fields;
+
+public:
+	/**
+	 * \brief Creates batch of empty accumulators
+	 * \param size number of accumulators
+	 */
+	explicit StatsAccumulatorBatch(size_t size = 0);
+
+	/**
+	 * \brief Creates batch from the accumulators
+	 * \param items accumulators
+	 */
+	explicit StatsAccumulatorBatch(const std::vector<StatsAccumulator>& items);
+
+	/**
+	 * \brief Returns number of accumulators
+	 * \return number of accumulators
+	 */
+	[[nodiscard]] size_t size() const {
+		return nItems;
+	}
+
+	/**
+	 * \brief Returns pointer to the array of given field
+	 * \param fieldIdx index of the field (e.g. M1_IDX)
+	 * \return pointer to the first value of the field
+	 */
+	double* field(const size_t fieldIdx) {
+		return fields.data() + fieldIdx * nItems;
+	}
+
+	[[nodiscard]] const double* field(const size_t fieldIdx) const {
+		return fields.data() + fieldIdx * nItems;
+	}
+
+	/**
+	 * \brief Returns pointer to the storage of all fields, used to copy the whole batch from or to the device
+	 * \return pointer to the storage
+	 */
+	double* data() {
+		return fields.data();
+	}
+
+	/**
+	 * \brief Returns size of the storage of all fields in bytes
+	 * \return size in bytes
+	 */
+	[[nodiscard]] size_t sizeBytes() const {
+		return fields.size() * sizeof(double);
+	}
+
+	/**
+	 * \brief Stores accumulator at given index
+	 * \param idx index
+	 * \param item accumulator
+	 */
+	void set(size_t idx, const StatsAccumulator& item);
+
+	/**
+	 * \brief Returns accumulator at given index
+	 * \param idx index
+	 * \return accumulator
+	 */
+	[[nodiscard]] StatsAccumulator get(size_t idx) const;
+
+	/**
+	 * \brief Merges accumulators in range [begin, end) via pairwise tree reduction. Empty and invalid accumulators
+	 *		  are skipped the same way as in StatUtils::mergeValid. The order of merges and the blocks merged in
+	 *		  parallel depend only on the size of the range, therefore the result is deterministic
+	 * \param begin first index
+	 * \param end end index (exclusive)
+	 * \param useAvx2 whether to merge with AVX2 instructions
+	 * \return merged accumulator
+	 */
+	[[nodiscard]] StatsAccumulator merge(size_t begin, size_t end, bool useAvx2) const;
+
+	/**
+	 * \brief Splits the batch into blocks of the same size and merges each of them - used for multi-column jobs,
+	 *		  where column c occupies block c
+	 * \param nBlocks number of blocks
+	 * \param useAvx2 whether to merge with AVX2 instructions
+	 * \return merged accumulator for each block
+	 */
+	[[nodiscard]] std::vector<StatsAccumulator> mergeBlocks(size_t nBlocks, bool useAvx2) const;
+
+private:
+	/**
+	 * \brief Merges accumulator i + offset into accumulator i for each i in [begin, end)
+	 * \param begin first merged pair
+	 * \param end end of the merged pairs (exclusive)
+	 * \param offset distance between the merged accumulators
+	 */
+	void mergePairs(size_t begin, size_t end, size_t offset);
+
+	/**
+	 * \brief AVX2 variant of mergePairs, four pairs are merged at once
+	 * \param begin first merged pair
+	 * \param end end of the merged pairs (exclusive)
+	 * \param offset distance between the merged accumulators
+	 */
+	void mergePairsAvx2(size_t begin, size_t end, size_t offset);
+};
@@ -37,6 +37,14 @@ public:
 		return std::chrono::duration_cast<std::chrono::milliseconds>(endTimePoint - startTimePoint);
 	}
 
+	/**
+	 * \brief Returns the elapsed time in microseconds
+	 * \return Elapsed time in microseconds
+	 */
+	[[nodiscard]] auto getElapsedTimeMicros() const {
+		return std::chrono::duration_cast<std::chrono::microseconds>(endTimePoint - startTimePoint);
+	}
+
 	auto printResults() const {
 		const auto elapsedTime = getElapsedTimeMillis().count();
 		// Print time in ns, ms and seconds
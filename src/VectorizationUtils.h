@@ -3,6 +3,8 @@
 #include <iostream>
 #include <array>
 
+#include "Histogram.h"
+
 
 // Since this is not natively supported by AVX2
 // Adapted from https://stackoverflow.com/questions/41144668/how-to-efficiently-perform-double-int64-conversions-with-sse-avx
@@ -87,6 +89,36 @@ namespace VectorizationUtils {
 		return _mm256_castsi256_pd(_mm256_and_si256(_mm256_castpd_si256(value), mask));
 	}
 
+	/**
+	 * \brief Computes Histogram bin indices for each value in the vector - this is the vectorized variant of
+	 *		  Histogram::binIdx
+	 * \param x vector of doubles
+	 * \return vector of bin indices
+	 */
+	inline auto histogramBinIndices(const __m256d& x) {
+		const auto bits = _mm256_castpd_si256(x);
+		const auto sign = _mm256_srli_epi64(bits, 63);
+		const auto key = _mm256_srli_epi64(_mm256_and_si256(bits, EXPONENT_MASK), HISTOGRAM_BIN_SHIFT);
+		return _mm256_add_epi64(key, _mm256_slli_epi64(sign, 11 + HISTOGRAM_MANTISSA_BITS));
+	}
+
+	/**
+	 * \brief Pushes valid values from the vector to the histogram
+	 * \param histogram histogram to push to
+	 * \param x vector of doubles, may contain invalid values which are skipped
+	 */
+	inline void pushToHistogram(Histogram& histogram, const __m256d& x) {
+		alignas(32) auto indices = std::array<int64_t, 4>();
+		alignas(32) auto valid = std::array<int64_t, 4>();
+		_mm256_store_si256(reinterpret_cast<__m256i*>(indices.data()), histogramBinIndices(x));
+		_mm256_store_si256(reinterpret_cast<__m256i*>(valid.data()), valuesValid(x));
+		for (auto i = 0; i < 4; i += 1) {
+			if (valid[i]) {
+				histogram.pushBinIdx(static_cast<size_t>(indices[i]));
+			}
+		}
+	}
+
 	/**
 	 * \brief A simple printout to console that tests some values
 	 */
@@ -1,6 +1,7 @@
 #pragma once
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <thread>
 
 #include "Logging.h"
@@ -28,6 +29,12 @@ class Watchdog {
 	 */
 	std::atomic<bool> keepRunning = true;
 
+	/**
+	 * \brief Whether a run is being monitored - the thread is kept alive between the runs and only waits for the next
+	 *		  start
+	 */
+	std::atomic<bool> isMonitoring = false;
+
 	/**
 	 * \brief Sleep time in milliseconds
 	 */
@@ -43,12 +50,20 @@ class Watchdog {
 	 */
 	std::condition_variable sleepCondition;
 
+	/**
+	 * \brief Called after each check of a monitored run - used to detect and recover stalled coordinators
+	 */
+	std::function<void()> checkCallback;
+
 public:
 	/**
 	 * \brief Creates new Watchdog instance
 	 * \param sleepMs amount of MS to sleep between checks
+	 * \param checkCallback function called after each check of a monitored run, may be empty
 	 */
-	explicit Watchdog(const std::chrono::milliseconds sleepMs = DEFAULT_SLEEP_MS): sleepMs(sleepMs) {
+	explicit Watchdog(const std::chrono::milliseconds sleepMs = DEFAULT_SLEEP_MS,
+	                  std::function<void()> checkCallback = {}): sleepMs(sleepMs),
+	                                                             checkCallback(std::move(checkCallback)) {
 		log(INFO, "[WATCHDOG] Watchdog created, timeout set to: " + std::to_string(sleepMs.count()) + " ms");
 		// Start the thread
 		watchdogThread = std::thread(&Watchdog::watchdogMain, this);
@@ -66,8 +81,7 @@ public:
 	 * \brief Joins the Watchdog thread (if joinable)
 	 */
 	void join() {
-		keepRunning = false;
-		sleepCondition.notify_one();
+		terminate();
 
 		if (watchdogThread.joinable()) {
 			watchdogThread.join();
@@ -79,39 +93,71 @@ public:
 	 */
 	void terminate() {
 		keepRunning = false;
+		startSemaphore.release(); // Wake up the thread if it waits for the next run
 		sleepCondition.notify_one();
 	}
 
 	/**
-	 * \brief Starts the watchdog - i.e. releases the startSemaphore
+	 * \brief Starts monitoring of a run - i.e. releases the startSemaphore
 	 */
 	void start() {
+		counter = 0;
+		isMonitoring = true;
 		startSemaphore.release();
 	}
 
+	/**
+	 * \brief Stops monitoring once the run is finished, the thread waits for the next start
+	 */
+	void stop() {
+		isMonitoring = false;
+		sleepCondition.notify_one();
+	}
+
 private:
 	void watchdogMain() {
-		startSemaphore.acquire(); // Try to acquire start semaphore
-		log(DEBUG, "[WATCHDOG] Watchdog is ready and running ...");
-		while (keepRunning) {
+		while (true) {
+			startSemaphore.acquire(); // Wait for the next run
+			if (!keepRunning) {
+				return;
+			}
+
+			log(DEBUG, "[WATCHDOG] Watchdog is ready and running ...");
+			monitorRun();
+		}
+	}
+
+	/**
+	 * \brief Periodically checks the progress until the run is stopped or the watchdog is terminated
+	 */
+	void monitorRun() {
+		while (keepRunning && isMonitoring) {
 			{
 				auto uniqueLock = std::unique_lock(mutex);
-				sleepCondition.wait_for(uniqueLock, sleepMs);
+				if (sleepCondition.wait_for(uniqueLock, sleepMs, [this] {
+					return !keepRunning || !isMonitoring;
+				})) {
+					// Woken up by stop or terminate
+					return;
+				}
 			}
 			// Null the counter and take out the previous value for comparison
 			const auto counterVal = counter.exchange(0);
 			if (counterVal <= 0 && keepRunning) {
 				log(WARNING, "[WATCHDOG] No progress detected in the last " + std::to_string(sleepMs.count()) + " ms");
-				continue;
 			}
-
-			// Otherwise we can log the value
-			if (keepRunning) {
+			else if (keepRunning) {
+				// Otherwise we can log the value
 				const auto kbsProcessed = counterVal / 1024;
 				const auto mbsProcessed = kbsProcessed / 1024;
 				log(INFO, "[WATCHDOG] Processed " + std::to_string(kbsProcessed) + " kB (" +
 				    std::to_string(mbsProcessed) + " MB) since the last update.");
 			}
+
+			// Single coordinator can stall while the others make progress, therefore this is checked every time
+			if (checkCallback && keepRunning && isMonitoring) {
+				checkCallback();
+			}
 		}
 	}
 };
@@ -1,10 +1,15 @@
-﻿#include "DistributionClassification.h"
+﻿#include "Server.h" // Winsock must be included before any other header can include windows.h
+#include "DistributionClassification.h"
 #include "JobScheduler.h"
 #include "Logging.h"
 #include "StatUtils.h"
 #include "Timer.h"
 #include "ArgumentParser.h"
 #include "Benchmark.h"
+#include "Batch.h"
+
+// Maximum number of keys printed to the console, all keys are written to the output file
+constexpr auto MAX_PRINTED_GROUPS = 50ULL;
 
 void run(ProcessingConfig& processingConfig) {
 	log(INFO, "Processing file: \"" + processingConfig.DistFilePath.string() + "\"");
@@ -27,12 +32,21 @@ void run(ProcessingConfig& processingConfig) {
 		auto result = jobScheduler.run();
 		timer.stop();
 
-		classifyDistribution(StatUtils::mergeLeftToRight(result));
+		const auto groupByKey = !processingConfig.KeyFilePath.empty();
+		printResults(result, jobScheduler.getHistograms(), jobScheduler.getCoMoments(), jobScheduler.getGroups(),
+		             groupByKey, std::cout, MAX_PRINTED_GROUPS);
 
 		// If output file is not empty write the results to it as well
 		if (!processingConfig.OutputPath.empty()) {
 			auto file = std::fstream(processingConfig.OutputPath, std::ios::out);
-			classifyDistribution(StatUtils::mergeLeftToRight(result), file);
+			printResults(result, jobScheduler.getHistograms(), jobScheduler.getCoMoments(), jobScheduler.getGroups(),
+			             groupByKey, file);
+		}
+
+		// Machine-readable stage latencies go next to the output file, or to the console if there is none
+		if constexpr (STAGE_PROFILING_ENABLED) {
+			auto profileFile = openStageProfileFile(processingConfig);
+			jobScheduler.writeStageProfiles(profileFile.is_open() ? profileFile : std::cout);
 		}
 
 		timer.printResults();
@@ -56,6 +70,21 @@ int main(int argc, char** argv) {
 		exit(1);  // NOLINT(concurrency-mt-unsafe)
 	}
 
+	// Client only sends the file to the server, the devices are set up by the server
+	if (!processingConfig.ConnectSocketPath.empty()) {
+		runClient(processingConfig);
+		return 0;
+	}
+
+	if (!processingConfig.ServerSocketPath.empty()) {
+		runServer(processingConfig);
+		return 0;
+	}
+
+	if (processingConfig.IsBatch) {
+		return runBatch(processingConfig) ? 0 : 1;
+	}
+
 	if (processingConfig.IsBenchmark) {
 		// Run benchmark
 		runBenchmark(processingConfig);